@@ -7,54 +7,99 @@
 #include <vector>
 #include <unordered_map>
 #include <string>
-#include <regex>
+#include <limits>
+#include <optional>
 
 #include "TreeQueue.hpp"
+#include "RegexUtils.hpp"
+#include "FileEntry.hpp"
+#include "FileTable.hpp"
 #include "FileQueue.hpp"
 #include "PairQueue.hpp"
 #include "GroupHandler.hpp"
+#include "CompareUtils.hpp"
+#include "MetadataUtils.hpp"
+#include "WorkerPool.hpp"
+#include "HashCache.hpp"
+#include "HashCascade.hpp"
+#include "ChunkIndex.hpp"
+#include "FileIdentityMap.hpp"
+#include "FileWatcher.hpp"
+#include "WatchIndex.hpp"
+#include "ReferenceDb.hpp"
 
 namespace fs = std::filesystem;
 
 class AntSeek {
 public:
     struct Config {
-        std::vector<std::regex> filenamePatterns;
+        RegexUtils::FilenameMatcher filenameMatcher;
         std::vector<fs::path> directories;
-        fs::path compareToFile;
+        std::vector<fs::path> compareToFiles; // Reference files, a directory stands for the files in it
+        fs::path referenceDbFile; // Compiled references (see ReferenceDb), instead of compareToFiles
+        fs::path hashCacheFile;
         bool matchFilename{ false };
         bool matchSize{ false };
-        enum class MatchContent { None, Full, Begin, End, Find } matchContent{ MatchContent::None };
-        enum class HashMode { None, First, Last } hashMode{ HashMode::None };
+        enum class MatchContent { None, Full, Begin, End, Find, Similar } matchContent{ MatchContent::None }; // Similar: AllVsAll only
+        enum class HashMode { None, First, Last, Cascade, Full } hashMode{ HashMode::None }; // Cascade, Full: AllVsAll only
         size_t hashSize{ 4096 };
+        double minSimilarity{ 0.5 }; // Share of the smaller file two files need in common to be reported (Similar)
         std::vector<uint8_t> jokerBytes;
+        size_t referenceWindowSize{ CompareUtils::defaultReferenceWindow }; // Larger references are not loaded, but compared a window at a time (Begin, End, Full), a multiple of 64
         enum class OperationMode { ListFiles, CompareToFile, AllVsAll } operationMode{ OperationMode::ListFiles };
         enum class OutputFormat { Grouped, TSV, Pipe } outputFormat{ OutputFormat::Pipe };
+        MetadataUtils::Engine metadataEngine{ MetadataUtils::Engine::Sync };
+        FileReader::CachePolicy pageCache{ FileReader::CachePolicy::Drop }; // What the content reads leave in the page cache
+        bool verify{ false }; // Byte-compare the files grouped by full content hash (Cascade, Full) against their group
+        bool watch{ false }; // Keep running after the scan and report group changes (AllVsAll only)
+        RegexUtils::FilenameMatcher excludedDirectories; // Matched against directory names, matching ones are not descended into
+        int maxDepth{ -1 }; // Directory levels to descend below the roots, -1: unlimited
+        std::uintmax_t minFileSize{ 0 };
+        std::uintmax_t maxFileSize{ std::numeric_limits<std::uintmax_t>::max() };
+        std::int64_t minMtimeNs{ std::numeric_limits<std::int64_t>::min() };
+        std::int64_t maxMtimeNs{ std::numeric_limits<std::int64_t>::max() };
 
         void setDirectories(const std::vector<std::string>& strvecDirectories);
         void setFilenamePatterns(const std::vector<std::string>& strvecFilenamePatterns);
+        void setExcludedDirectories(const std::vector<std::string>& strvecDirectoryPatterns);
+        bool hasFileFilters() const;
+        bool hashesFullContent() const;
     };
 
     struct ThreadConfig {
         int fileCollectorCount{ 4 };
         int hashCalculatorCount{ 4 };
         int comparerCount{ 4 };
-        size_t bufferSize{ 8192 };
+        size_t bufferSize{ 65536 }; // Per read of the content reading stages (see ReadBuffers)
+        std::uint64_t mapThreshold{ 0 }; // Files at least this large are memory-mapped for streaming reads (0: never, see FileReader)
+        size_t mapWindowSize{ 256 << 20 }; // Larger files are mapped in windows of this size
+        int metadataWorkerCount{ 32 }; // Only used by the thread pool metadata engine
+        int segmentWorkerCount{ 4 }; // Hash and compare the segments of a large file in parallel (see HashUtils::treeSegmentSize)
+        DeviceSlots::Limits deviceReadLimits; // Concurrent content reads per device, by device class
     };
 
     explicit AntSeek(const Config& cfg);
     void start(const ThreadConfig& thrCfg);
     void requestStop();
+    void compileReferences(const fs::path& file);
     void waitForFinish();
     void getStatus();
     void printResults();
+    void watchForChanges();
 
 private:
+    struct DirectoryTask {
+        fs::path path;
+        int depth{ 0 }; // Levels below its root
+    };
+
     Config config;
-    std::unique_ptr <TreeQueue<fs::path>> dirQueue;
-    FileQueue<fs::directory_entry> fileQueue;
-    PairQueue<fs::path> hashQueue;
-    GroupHandler<fs::path> groupHandler;
+    std::vector<fs::path> rootDirectories;
+    std::unique_ptr <TreeQueue<DirectoryTask>> dirQueue;
+    FileTable fileTable; // Every later stage refers to the files by their ID in it
+    FileQueue fileQueue{ fileTable };
+    PairQueue hashQueue{ fileTable };
+    GroupHandler<FileId> groupHandler;
     std::vector<std::jthread> workers;
     std::stop_source stopSource;
 
@@ -62,21 +107,70 @@ private:
     std::atomic<int> activeHashCalculatorCount{ 0 };
     std::atomic<int> activeComparerCount{ 0 };
 
-    std::uintmax_t referenceFileSize{ 0 };
-    std::string referenceFileName;
-    uint64_t referenceFileHash{ 0 };
-    std::vector<uint8_t> referenceData;
-    std::vector<uint64_t> referenceDataMask;
+    bool collectFileMetadata{ false }; // Resolve file metadata during traversal, because the first stage keys or filters on it
+    bool readsFileContent{ false }; // Files are then deduplicated by inode and their reads scheduled per device
+    bool comparesContent{ false }; // AllVsAll groups are decided by the compare stage, not by the keys alone
+    size_t groupOpenLimit{ 256 }; // Files a group compare reads together (see CompareUtils::compareGroup)
+    FileIdentityMap fileIdentities;
+    std::unique_ptr<WorkerPool> metadataPool;
+    std::unique_ptr<WorkerPool> segmentPool;
+    std::unique_ptr<HashCache> hashCache;
+    std::unique_ptr<HashCascade> hashCascade;
+    std::unique_ptr<ChunkIndex> chunkIndex;
+    std::unique_ptr<FileWatcher> fileWatcher;
+
+    struct Reference {
+        fs::path path;
+        std::string name;
+        std::uintmax_t size{ 0 };
+        uint64_t chunkHash{ 0 };
+        std::vector<uint8_t> data;
+        std::vector<uint64_t> mask;
+        std::unique_ptr<CompareUtils::StreamedReference> streamed; // Larger than the window: read along with each file (data and mask empty)
+    };
+    std::vector<Reference> references; // Their content is in the database if there is one (data and mask empty)
+    std::vector<uint32_t> streamedReferences; // Their indices
+    std::unique_ptr<ReferenceDb> referenceDb;
+    std::vector<MultiMaskSearcher::Pattern> referencePatterns;
+    std::unique_ptr<MaskSearcher> referenceSearcher; // Find mode, a single reference
+    std::unique_ptr<MultiMaskSearcher> multiReferenceSearcher; // Find mode, several references
+    std::unordered_map<FileId, std::vector<uint32_t>> referenceCandidates; // Files only some of the references can match
 
-    std::vector<fs::path> results;
+    std::vector<FileId> results;
+    std::vector<std::pair<FileId, uint32_t>> referenceMatches; // File, reference
     std::mutex results_mtx;
     
-    void loadCompareToFile();
+    std::vector<fs::path> getRootDirectories() const;
+    void loadReferences();
+    void loadReferenceFiles();
+    void loadReferenceDb();
+    void loadReference(const fs::path& path);
+    CompareUtils::MatchResult compareReferences(const fs::path& path, std::vector<char>& found, bool checkEnd);
+    bool acceptsReference(const Reference& reference, FileId file, std::optional<uint64_t>& chunkHash);
+    void printReferenceMatches();
     void printGroup(int groupId);
     void printLine(int groupId, const std::string& line);
-    std::unordered_map<int, std::vector<fs::path>> getPairQueueResult();
-    void fileCollectorThread(std::stop_token st);
+    void printSimilarFiles();
+    std::unordered_map<int, std::vector<FileId>> getPairQueueResult();
+    std::vector<std::pair<int, std::vector<FileId>>> getGroups();
+    void printChange(bool added, int groupId, const std::string& line);
+    void setupWatchIndex(WatchIndex& index);
+    void watchNewDirectory(const fs::path& root, WatchIndex& index);
+    int getDepth(const fs::path& dir) const;
+    bool passesFileFilters(const FileEntry& file) const;
+    uint64_t getChunkHash(const FileEntry& file, bool fromStart);
+    uint64_t getSparseHash(const FileEntry& file);
+    XXH128_hash_t getFullHash(const FileEntry& file);
+    void cacheFullHash(const FileEntry& file);
+    WorkerPool* getSegmentPool(std::uint64_t device) const;
+    void setGroupOpenLimit(int comparerCount);
+    void printCascadeStats();
+    void fileCollectorThread(std::stop_token st, int threadIndex);
+    void collectFiles(FileId first, size_t count, std::vector<FileId>& ids);
     void hashCalculatorThread(std::stop_token st);
+    void runCascadeStage(FileId current, bool justCollect, std::vector<FileId>& escalated);
+    void indexChunks(FileId current, std::vector<ContentChunker::Chunk>& chunks);
+    void compareGroup(const std::vector<FileId>& files);
     void compareContentThread(std::stop_token st);
     void compareContentFlexibleThread(std::stop_token st);
 };
\ No newline at end of file
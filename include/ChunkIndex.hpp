@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <cstdint>
+
+#include "ContentChunker.hpp"
+#include "FileTable.hpp"
+
+// The chunk fingerprints of every file chunked, to find the pairs of files with a large part of their content in common.
+// A file counts each distinct chunk once. Two files share the bytes of the distinct chunks they both have, and their
+// similarity is the share of the smaller one (by distinct bytes) found in the other: a file which is a prefix of a
+// longer one, e.g. a rotated log, is fully contained in it.
+class ChunkIndex {
+public:
+    struct SimilarPair {
+        FileId first;
+        FileId second;
+        std::uint64_t sharedBytes;
+        double similarity;
+    };
+
+    // A chunk found in more files than this is not counted (e.g. runs of zeros): the pairs of its files would be quadratic
+    static constexpr size_t maxFilesPerChunk = 256;
+
+    // Takes the chunks of a file in any order, they are sorted and deduplicated in place
+    void add(FileId file, std::vector<ContentChunker::Chunk>& chunks) {
+        std::sort(chunks.begin(), chunks.end(), [](const auto& a, const auto& b) { return a.hash < b.hash; });
+        auto last = std::unique(chunks.begin(), chunks.end(), [](const auto& a, const auto& b) { return a.hash == b.hash; });
+        chunks.erase(last, chunks.end());
+
+        std::uint64_t bytes = 0;
+        for (const auto& chunk : chunks) {
+            bytes += chunk.length;
+        }
+
+        std::lock_guard lock(mtx);
+        for (const auto& chunk : chunks) {
+            entries.push_back({ chunk.hash, file, chunk.length });
+        }
+        distinctBytes[file] = bytes;
+    }
+
+    // The pairs with at least minSimilarity in common, most shared bytes first. Call it once every file is added.
+    // skippedChunks is set to the number of chunks not counted, see maxFilesPerChunk.
+    std::vector<SimilarPair> findSimilar(double minSimilarity, size_t& skippedChunks) {
+        std::lock_guard lock(mtx);
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.hash < b.hash || (a.hash == b.hash && a.file < b.file);
+            });
+
+        // Shared bytes by pair of files, the lower ID in the high half of the key
+        std::unordered_map<std::uint64_t, std::uint64_t> shared;
+        skippedChunks = 0;
+        for (size_t begin = 0; begin < entries.size(); ) {
+            size_t end = begin + 1;
+            while (end < entries.size() && entries[end].hash == entries[begin].hash) {
+                ++end;
+            }
+            if (end - begin > maxFilesPerChunk) {
+                ++skippedChunks;
+            }
+            else {
+                for (size_t a = begin; a < end; ++a) {
+                    for (size_t b = a + 1; b < end; ++b) {
+                        shared[(static_cast<std::uint64_t>(entries[a].file) << 32) | entries[b].file] += entries[a].length;
+                    }
+                }
+            }
+            begin = end;
+        }
+
+        std::vector<SimilarPair> pairs;
+        for (const auto& [key, bytes] : shared) {
+            auto first = static_cast<FileId>(key >> 32);
+            auto second = static_cast<FileId>(key);
+            auto smaller = std::min(distinctBytes[first], distinctBytes[second]);
+            double similarity = static_cast<double>(bytes) / static_cast<double>(smaller);
+            if (similarity >= minSimilarity) {
+                pairs.push_back({ first, second, bytes, similarity });
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const SimilarPair& a, const SimilarPair& b) {
+            return a.sharedBytes > b.sharedBytes ||
+                (a.sharedBytes == b.sharedBytes && (a.first < b.first || (a.first == b.first && a.second < b.second)));
+            });
+        return pairs;
+    }
+
+private:
+    struct Entry {
+        std::uint64_t hash;
+        FileId file;
+        std::uint32_t length;
+    };
+
+    std::vector<Entry> entries;
+    std::unordered_map<FileId, std::uint64_t> distinctBytes;
+    std::mutex mtx;
+};
@@ -1,12 +1,22 @@
 #pragma once
 
 #include <filesystem>
-#include <fstream>
 #include <utility>
 #include <vector>
 #include <span>
 #include <algorithm>
 #include <cstring>
+#include <atomic>
+#include <memory>
+#include <bit>
+#include <stdexcept>
+#include <limits>
+
+#include "HashUtils.hpp"
+#include "FileReader.hpp"
+#include "MaskCompare.hpp"
+#include "MaskSearch.hpp"
+#include "MultiMaskSearch.hpp"
 
 namespace CompareUtils {
 
@@ -18,86 +28,460 @@ namespace CompareUtils {
         Error
     };
 
-    inline MatchResult compareFileContents(const fs::path& file1, const fs::path& file2, std::size_t buffer_size = 8192) {
-        try {
-            std::ifstream f1(file1, std::ios::binary);
-            std::ifstream f2(file2, std::ios::binary);
-
-            if (!f1.is_open() || !f2.is_open())
-                return MatchResult::Error;
+    namespace detail {
 
-            std::vector<char> buffer1(buffer_size);
-            std::vector<char> buffer2(buffer_size);
+        // Reads both files side by side (mapped, or into the two read buffers of the thread), hashing the content if digest is set
+        inline MatchResult compareStreams(FileReader& f1, FileReader& f2, XXH128_hash_t* digest, std::size_t bufferSize) {
+            auto buffer1 = ReadBuffers::get(0, bufferSize);
+            auto buffer2 = ReadBuffers::get(1, bufferSize);
 
-            while (f1 && f2) {
-                f1.read(buffer1.data(), buffer_size);
-                f2.read(buffer2.data(), buffer_size);
+            XXH3_state_t state;
+            if (digest)
+                XXH3_128bits_reset(&state);
 
-                std::streamsize bytesRead1 = f1.gcount();
-                std::streamsize bytesRead2 = f2.gcount();
+            while (true) {
+                const std::uint8_t* data1;
+                const std::uint8_t* data2;
+                auto bytesRead1 = f1.next(data1, bufferSize, buffer1);
+                auto bytesRead2 = f2.next(data2, bufferSize, buffer2);
 
-                if (bytesRead1 != bytesRead2)
+                if (bytesRead1 < 0 || bytesRead1 != bytesRead2)
                     return MatchResult::Error; // Possible I/O error or background modification?
 
-                if (!std::equal(buffer1.begin(), buffer1.begin() + bytesRead1, buffer2.begin()))
+                if (std::memcmp(data1, data2, static_cast<size_t>(bytesRead1)) != 0)
                     return MatchResult::NoMatch;
+
+                if (digest)
+                    XXH3_128bits_update(&state, data1, static_cast<size_t>(bytesRead1));
+
+                if (static_cast<size_t>(bytesRead1) < bufferSize)
+                    break; // End of both files
             }
 
+            if (digest)
+                *digest = XXH3_128bits_digest(&state);
             return MatchResult::Match;
         }
-        catch (const std::exception&) {
-            return MatchResult::Error;
+
+        // Compares length bytes of both files from offset, giving up once stop is set (by another range)
+        inline MatchResult compareRange(FileReader& f1, FileReader& f2, std::uint64_t offset, std::uint64_t length, XXH128_hash_t* digest,
+            std::size_t bufferSize, const std::atomic<bool>& stop) {
+            auto buffer1 = ReadBuffers::get(0, bufferSize);
+            auto buffer2 = ReadBuffers::get(1, bufferSize);
+
+            XXH3_state_t state;
+            if (digest)
+                XXH3_128bits_reset(&state);
+
+            for (std::uint64_t end = offset + length; offset < end; ) {
+                if (stop.load(std::memory_order_relaxed))
+                    return MatchResult::Match; // Decided by another range
+                const std::uint8_t* data1 = nullptr;
+                const std::uint8_t* data2 = nullptr;
+                auto count = static_cast<size_t>(std::min<std::uint64_t>(bufferSize, end - offset));
+                auto bytesRead1 = f1.viewAt(data1, count, offset, buffer1);
+                auto bytesRead2 = f2.viewAt(data2, count, offset, buffer2);
+
+                if (bytesRead1 < 0 || bytesRead2 < 0 || static_cast<size_t>(bytesRead1) != count || static_cast<size_t>(bytesRead2) != count)
+                    return MatchResult::Error;
+
+                if (std::memcmp(data1, data2, count) != 0)
+                    return MatchResult::NoMatch;
+
+                if (digest)
+                    XXH3_128bits_update(&state, data1, count);
+                offset += count;
+            }
+
+            if (digest)
+                *digest = XXH3_128bits_digest(&state);
+            return MatchResult::Match;
         }
-    }
 
-    inline MatchResult compareFileContents(const fs::directory_entry& file1, const fs::directory_entry& file2, std::size_t buffer_size = 8192) {
-        try {
-            if (!file1.is_regular_file() || !file2.is_regular_file())
+        // Files larger than a tree segment (see HashUtils::hashFile) are compared segment by segment, spread over the
+        // workers of the pool if given: the first difference found stops the others. The digest is the tree digest then.
+        inline MatchResult compareFiles(const fs::path& file1, const fs::path& file2, XXH128_hash_t* digest, WorkerPool* pool, std::size_t bufferSize) {
+            FileReader f1(file1);
+            FileReader f2(file2);
+
+            if (!f1.isOpen() || !f2.isOpen())
                 return MatchResult::Error;
 
-            if (file1.file_size() != file2.file_size())
+            auto size = f1.size();
+            if (size < 0 || f2.size() < 0)
+                return MatchResult::Error;
+            if (size != f2.size())
+                return MatchResult::NoMatch;
+            if (static_cast<std::uint64_t>(size) <= HashUtils::treeSegmentSize)
+                return compareStreams(f1, f2, digest, bufferSize);
+
+            auto fileSize = static_cast<std::uint64_t>(size);
+            std::vector<MatchResult> results(HashUtils::treeSegmentCount(fileSize), MatchResult::Match);
+            std::vector<XXH128_hash_t> segments(digest ? results.size() : 0);
+            std::atomic<bool> stop{ false };
+            // Runs on the workers as well, nothing may be thrown out of it
+            auto compareSegments = [&](std::size_t begin, std::size_t end) {
+                try {
+                    FileReader s1(file1);
+                    FileReader s2(file2);
+                    if (!s1.isOpen() || !s2.isOpen()) {
+                        results[begin] = MatchResult::Error;
+                        stop.store(true);
+                        return;
+                    }
+                    for (auto i = begin; i < end && !stop.load(std::memory_order_relaxed); ++i) {
+                        auto offset = i * HashUtils::treeSegmentSize;
+                        results[i] = compareRange(s1, s2, offset, std::min(HashUtils::treeSegmentSize, fileSize - offset),
+                            digest ? &segments[i] : nullptr, bufferSize, stop);
+                        if (results[i] != MatchResult::Match)
+                            stop.store(true);
+                    }
+                }
+                catch (const std::exception&) {
+                    if (results[begin] == MatchResult::Match)
+                        results[begin] = MatchResult::Error;
+                    stop.store(true);
+                }
+            };
+
+            if (pool)
+                pool->parallelFor(results.size(), 1, compareSegments);
+            else
+                compareSegments(0, results.size());
+
+            // A difference found decides, even if another range failed to read
+            if (std::find(results.begin(), results.end(), MatchResult::NoMatch) != results.end())
                 return MatchResult::NoMatch;
+            if (stop.load())
+                return MatchResult::Error;
+            if (digest)
+                *digest = HashUtils::combineSegmentDigests(segments, fileSize);
+            return MatchResult::Match;
+        }
+
+    }
 
-            return compareFileContents(file1.path(), file2.path(), buffer_size);
+    inline MatchResult compareFileContents(const fs::path& file1, const fs::path& file2, WorkerPool* pool = nullptr, std::size_t buffer_size = ReadBuffers::getDefaultSize()) {
+        try {
+            return detail::compareFiles(file1, file2, nullptr, pool, buffer_size);
         }
         catch (const std::exception&) {
             return MatchResult::Error;
         }
     }
 
-    inline bool compareWithMask(const std::span<const uint8_t> data, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask) {
-// TODO: SIMD optimalisations
-            const auto refSize = reference.size();
-            size_t blocks = (refSize + 63) >> 6;
-            size_t bytePos = 0;        
-            for (size_t b = 0 ; b < blocks ; ++b) {
-                uint64_t rmb = referenceMask[b];
-                
-                if (rmb == 0) {
-                    bytePos += 64;                   
-                    continue;
+    // Same as compareFileContents(), but also computes the digest of the content as it is read (see HashUtils::hashFile).
+    // The digest is only valid (and then belongs to both files) if the result is Match, as the reading stops at the first difference.
+    inline MatchResult compareFileContents(const fs::path& file1, const fs::path& file2, XXH128_hash_t& digest, WorkerPool* pool = nullptr,
+        std::size_t buffer_size = ReadBuffers::getDefaultSize()) {
+        try {
+            return detail::compareFiles(file1, file2, &digest, pool, buffer_size);
+        }
+        catch (const std::exception&) {
+            return MatchResult::Error;
+        }
+    }
+
+    struct GroupResult {
+        std::vector<std::vector<size_t>> classes;   // Indices of files with equal content, classes of at least two files
+        std::vector<XXH128_hash_t> digests;         // Per class if requested, the digest of the content (see HashUtils::hashFile)
+        std::vector<size_t> failed;                 // Files which could not be read
+    };
+
+    namespace detail {
+
+        constexpr std::size_t blockBudget = 64 << 20; // For the blocks of a lockstep compare
+
+        // Splits the files into classes of equal content, reading them all together block by block (in lockstep).
+        // After each block a set of files is split by the block content, files left alone are not read any further,
+        // and the others go on in their own subsets, so no byte of a file is read twice, however many files there are.
+        // At most maxOpenFiles files are kept open, the blocks of the others are read through a descriptor of their own.
+        // Only the first file of each class of a block keeps its block, so identical files take a single block.
+        // With a range, only [begin, end) of the files is compared, and the digests are those of the range. The files
+        // flagged in dropped (if given) are no longer read, and the files found unique or failing here get flagged.
+        inline void compareLockstep(std::span<const fs::path> paths, bool withDigests, std::size_t bufferSize, std::size_t maxOpenFiles,
+            std::size_t blockBudget, GroupResult& result, std::uint64_t begin = 0, std::uint64_t end = std::numeric_limits<std::uint64_t>::max(),
+            std::span<std::atomic<bool>> dropped = {}) {
+            auto fileCount = paths.size();
+            if (fileCount < 2)
+                return;
+
+            // A power of two, so the blocks never straddle a tree segment of the digest
+            std::size_t blockSize = std::bit_floor(std::clamp<std::size_t>(std::min(bufferSize, blockBudget / fileCount), ReadBuffers::alignment, HashUtils::treeSegmentSize));
+            auto blocks = ReadBuffers::get(2, blockSize * fileCount);
+
+            std::vector<std::unique_ptr<FileReader>> readers(fileCount);
+            std::size_t openCount = 0;
+            auto close = [&](size_t m) {
+                if (readers[m]) {
+                    readers[m].reset();
+                    --openCount;
                 }
-                
-                if (rmb == ~0ULL) {
-                    if (std::memcmp(reference.data() + bytePos, data.data() + bytePos, 64) != 0)
-                        return false;
-
-                    bytePos += 64;
-                }
-                else {
-                    size_t bytesLeft = refSize - bytePos;
-                    size_t cnt = bytesLeft < 64 ? bytesLeft : 64;
-                    for (size_t i = 0  ; i < cnt ; ++i, ++bytePos) {
-                        if (((rmb >> i) & 1) &&
-                            (reference[bytePos] != data[bytePos]))
-                        {
+            };
+            auto drop = [&](size_t m) {
+                close(m);
+                if (!dropped.empty())
+                    dropped[m].store(true, std::memory_order_relaxed);
+            };
+
+            // Views the block of a file, read into the slot unless the file is mapped
+            auto view = [&](size_t m, const std::uint8_t*& data, std::size_t count, std::uint64_t offset, std::span<std::uint8_t> slot) -> std::ptrdiff_t {
+                if (!readers[m] && openCount < maxOpenFiles) {
+                    readers[m] = std::make_unique<FileReader>(paths[m]);
+                    ++openCount;
+                }
+                if (readers[m])
+                    return readers[m]->isOpen() ? readers[m]->viewAt(data, count, offset, slot) : -1;
+
+                FileReader reader(paths[m]);
+                data = slot.data();
+                return reader.isOpen() ? reader.readAt(slot.data(), count, offset) : -1;
+            };
+
+            struct Subset {
+                std::vector<size_t> members;
+                std::uint64_t offset{ 0 };
+                XXH3_state_t state;
+                std::vector<XXH128_hash_t> segments;
+            };
+
+            auto emit = [&](Subset& subset) {
+                result.classes.push_back(subset.members);
+                for (auto m : subset.members)
+                    close(m);
+                if (withDigests) {
+                    auto size = subset.offset - begin;
+                    if (size > HashUtils::treeSegmentSize) {
+                        subset.segments.push_back(XXH3_128bits_digest(&subset.state));
+                        result.digests.push_back(HashUtils::combineSegmentDigests(subset.segments, size));
+                    }
+                    else {
+                        result.digests.push_back(XXH3_128bits_digest(&subset.state));
+                    }
+                }
+            };
+
+            // Takes the next block of the subset (the same for all of its files) into the digest, and tells whether
+            // it was the last one
+            auto advance = [&](Subset& subset, const std::uint8_t* block, std::size_t count, std::size_t requested) {
+                auto position = subset.offset - begin;
+                if (withDigests && count > 0) {
+                    if (position > 0 && position % HashUtils::treeSegmentSize == 0) {
+                        subset.segments.push_back(XXH3_128bits_digest(&subset.state));
+                        XXH3_128bits_reset(&subset.state);
+                    }
+                    XXH3_128bits_update(&subset.state, block, count);
+                }
+                subset.offset += count;
+                return count < requested || subset.offset == end;
+            };
+
+            std::vector<Subset> pending(1);
+            for (size_t m = 0; m < fileCount; ++m)
+                pending[0].members.push_back(m);
+            pending[0].offset = begin;
+            if (withDigests)
+                XXH3_128bits_reset(&pending[0].state);
+
+            std::vector<const std::uint8_t*> data(fileCount);
+            std::vector<std::ptrdiff_t> counts(fileCount);
+            std::vector<std::vector<size_t>> split;
+            while (!pending.empty()) {
+                Subset subset = std::move(pending.back());
+                pending.pop_back();
+
+                while (true) {
+                    auto requested = static_cast<std::size_t>(std::min<std::uint64_t>(blockSize, end - subset.offset));
+                    // Classes of equal length and block content, each compared against its first member, which
+                    // takes the next slot: the block of a file joining a class is overwritten by the next file
+                    split.clear();
+                    for (auto m : subset.members) {
+                        if (!dropped.empty() && dropped[m].load(std::memory_order_relaxed)) {
+                            close(m); // Unique in another range
+                            continue;
+                        }
+                        counts[m] = view(m, data[m], requested, subset.offset, blocks.subspan(split.size() * blockSize, blockSize));
+                        if (counts[m] < 0) {
+                            result.failed.push_back(m);
+                            drop(m);
+                            continue;
+                        }
+                        auto it = std::find_if(split.begin(), split.end(), [&](const std::vector<size_t>& c) {
+                            return counts[c.front()] == counts[m] && std::memcmp(data[c.front()], data[m], static_cast<size_t>(counts[m])) == 0;
+                            });
+                        if (it != split.end())
+                            it->push_back(m);
+                        else
+                            split.push_back({ m });
+                    }
+                    std::erase_if(split, [&](const std::vector<size_t>& c) {
+                        if (c.size() > 1)
                             return false;
+                        drop(c.front()); // Unique from here on
+                        return true;
+                        });
+
+                    if (split.empty())
+                        break;
+
+                    if (split.size() == 1) {
+                        // Still alike, carry on with the next block
+                        subset.members = std::move(split.front());
+                        auto count = static_cast<std::size_t>(counts[subset.members.front()]);
+                        if (advance(subset, data[subset.members.front()], count, requested)) {
+                            emit(subset); // End of the files
+                            break;
                         }
+                        continue;
                     }
+
+                    for (auto& members : split) {
+                        Subset child;
+                        child.members = std::move(members);
+                        child.offset = subset.offset;
+                        if (withDigests) {
+                            XXH3_copyState(&child.state, &subset.state);
+                            child.segments = subset.segments;
+                        }
+                        auto count = static_cast<std::size_t>(counts[child.members.front()]);
+                        if (advance(child, data[child.members.front()], count, requested))
+                            emit(child);
+                        else
+                            pending.push_back(std::move(child));
+                    }
+                    break;
                 }
             }
+        }
 
-            return true;
+    }
+
+    namespace detail {
+
+        // The size of all the files, 0 if they differ or a size can't be queried
+        inline std::uint64_t commonSize(std::span<const fs::path> paths) {
+            std::uint64_t size = 0;
+            for (size_t i = 0; i < paths.size(); ++i) {
+                std::error_code ec;
+                auto fileSize = fs::file_size(paths[i], ec);
+                if (ec || (i > 0 && fileSize != size))
+                    return 0;
+                size = fileSize;
+            }
+            return size;
+        }
+
+        // Compares the tree segments of files of the same size (see HashUtils::hashFile) on the workers of the pool, each
+        // segment in lockstep for all files. A file found unique in a segment is no longer read by the others, and the
+        // classes are those of files alike in every segment, with the tree digest of their segment digests.
+        inline GroupResult compareSegments(std::span<const fs::path> paths, std::uint64_t fileSize, bool withDigests, WorkerPool& pool,
+            std::size_t maxOpenFiles, std::size_t bufferSize) {
+            auto segmentCount = HashUtils::treeSegmentCount(fileSize);
+            auto concurrency = std::min(segmentCount, pool.threadCount() + 1);
+            std::vector<GroupResult> segments(segmentCount);
+            std::vector<std::atomic<bool>> dropped(paths.size());
+            pool.parallelFor(segmentCount, 1, [&](std::size_t first, std::size_t last) {
+                for (auto i = first; i < last; ++i) {
+                    auto offset = i * HashUtils::treeSegmentSize;
+                    compareLockstep(paths, withDigests, bufferSize, std::max<std::size_t>(maxOpenFiles / concurrency, 2), blockBudget / concurrency,
+                        segments[i], offset, std::min(offset + HashUtils::treeSegmentSize, fileSize), dropped);
+                }
+                });
+
+            // The classes of the first segment, split by the classes of each next one
+            constexpr size_t none = std::numeric_limits<size_t>::max();
+            std::vector<std::vector<size_t>> classes = std::move(segments[0].classes);
+            std::vector<std::vector<XXH128_hash_t>> digests(classes.size());
+            for (size_t c = 0; c < classes.size() && withDigests; ++c)
+                digests[c].push_back(segments[0].digests[c]);
+            std::vector<size_t> classOf(paths.size());
+            for (size_t i = 1; i < segmentCount && !classes.empty(); ++i) {
+                std::fill(classOf.begin(), classOf.end(), none);
+                for (size_t c = 0; c < segments[i].classes.size(); ++c) {
+                    for (auto m : segments[i].classes[c])
+                        classOf[m] = c;
+                }
+                std::vector<std::vector<size_t>> nextClasses;
+                std::vector<std::vector<XXH128_hash_t>> nextDigests;
+                for (size_t c = 0; c < classes.size(); ++c) {
+                    auto firstClass = nextClasses.size();
+                    for (auto m : classes[c]) {
+                        if (classOf[m] == none)
+                            continue;
+                        auto it = std::find_if(nextClasses.begin() + static_cast<std::ptrdiff_t>(firstClass), nextClasses.end(),
+                            [&](const std::vector<size_t>& members) { return classOf[members.front()] == classOf[m]; });
+                        if (it != nextClasses.end()) {
+                            it->push_back(m);
+                            continue;
+                        }
+                        nextClasses.push_back({ m });
+                        nextDigests.push_back(digests[c]);
+                        if (withDigests)
+                            nextDigests.back().push_back(segments[i].digests[classOf[m]]);
+                    }
+                }
+                classes.clear();
+                digests.clear();
+                for (size_t c = 0; c < nextClasses.size(); ++c) {
+                    if (nextClasses[c].size() < 2)
+                        continue;
+                    classes.push_back(std::move(nextClasses[c]));
+                    digests.push_back(std::move(nextDigests[c]));
+                }
+            }
+
+            GroupResult result;
+            result.classes = std::move(classes);
+            for (size_t c = 0; c < result.classes.size() && withDigests; ++c)
+                result.digests.push_back(HashUtils::combineSegmentDigests(digests[c], fileSize));
+            std::vector<bool> failed(paths.size(), false);
+            for (const auto& segment : segments) {
+                for (auto m : segment.failed) {
+                    if (!failed[m])
+                        result.failed.push_back(m);
+                    failed[m] = true;
+                }
+            }
+            return result;
+        }
+
+    }
+
+    // Sorts a group of files (e.g. of the same size and first block hash) into classes of equal content, reading each
+    // file at most once, in a single lockstep pass however large the group (see compareLockstep). Files of the same
+    // size larger than a tree segment are compared segment by segment on the workers of the pool if given.
+    inline GroupResult compareGroup(std::span<const fs::path> paths, bool withDigests, WorkerPool* pool = nullptr, std::size_t maxOpenFiles = 256,
+        std::size_t bufferSize = ReadBuffers::getDefaultSize()) {
+        maxOpenFiles = std::max<std::size_t>(maxOpenFiles, 2);
+        if (pool && paths.size() > 1) {
+            auto size = detail::commonSize(paths);
+            if (size > HashUtils::treeSegmentSize)
+                return detail::compareSegments(paths, size, withDigests, *pool, maxOpenFiles, bufferSize);
+        }
+
+        GroupResult result;
+        detail::compareLockstep(paths, withDigests, bufferSize, maxOpenFiles, detail::blockBudget, result);
+        return result;
+    }
+
+    inline MatchResult compareFileContents(const fs::directory_entry& file1, const fs::directory_entry& file2, std::size_t buffer_size = ReadBuffers::getDefaultSize()) {
+        try {
+            if (!file1.is_regular_file() || !file2.is_regular_file())
+                return MatchResult::Error;
+
+            if (file1.file_size() != file2.file_size())
+                return MatchResult::NoMatch;
+
+            return compareFileContents(file1.path(), file2.path(), nullptr, buffer_size);
+        }
+        catch (const std::exception&) {
+            return MatchResult::Error;
+        }
+    }
+
+    // The kernel compares 64 bytes at a time with the widest instructions of the CPU, see MaskCompare
+    inline bool compareWithMask(const std::span<const uint8_t> data, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask) {
+        return MaskCompare::get()(data.data(), reference.data(), referenceMask.data(), reference.size());
     }
 
     inline MatchResult compareFileContentsFlexible(const fs::path& file, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask, bool checkEnd = false) {
@@ -110,28 +494,22 @@ namespace CompareUtils {
             if (referenceMask.size() < ((refSize + 63) >> 6))
                 return MatchResult::Error;
 
-            std::ifstream f(file, std::ios::binary);
-            if (!f.is_open())
+            FileReader f(file);
+            if (!f.isOpen())
                 return MatchResult::Error;
 
-            f.seekg(0, std::ios::end);
-            auto fileSize = f.tellg();
-            if (fileSize == std::streampos(-1))
+            auto fileSize = f.size();
+            if (fileSize < 0)
                 return MatchResult::Error;
 
-            if (fileSize < static_cast<decltype(fileSize)>(refSize))
+            if (static_cast<std::uint64_t>(fileSize) < refSize)
                 return MatchResult::NoMatch;
 
-            f.seekg(checkEnd ? fileSize - static_cast<std::streamoff>(refSize) : std::streampos(0));
-            if (!f)
+            auto buffer = ReadBuffers::get(0, refSize);
+            auto bytesRead = f.readAt(buffer.data(), refSize, checkEnd ? static_cast<std::uint64_t>(fileSize) - refSize : 0);
+            if (bytesRead < 0 || static_cast<size_t>(bytesRead) != refSize)
                 return MatchResult::Error;
 
-            std::vector<uint8_t> buffer(refSize);
-            f.read(reinterpret_cast<char*>(buffer.data()), refSize);
-
-            if (f.gcount() != refSize || f.fail())
-                    return MatchResult::Error;
-
             if (compareWithMask(buffer, reference, referenceMask))
                 return MatchResult::Match;
                 
@@ -142,59 +520,174 @@ namespace CompareUtils {
         }
     }
 
-    inline bool searchWithMask(std::span<const uint8_t> data, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask, std::size_t size) {
-// TODO: implement skip table
-        if (size < reference.size())
-            return false;
+    // The searcher is built for the reference once, and used for every file searched
+    inline MatchResult searchInFileContentsFlexible(const fs::path& file, const MaskSearcher& searcher, std::size_t refSize, std::size_t baseBufferSize = ReadBuffers::getDefaultSize()) {
+        try {
+            if (refSize == 0)
+                return MatchResult::Match;
 
-        size_t end = size - reference.size();
-        
-        for (size_t i = 0 ; i <= end ; ++i) {
-            if (compareWithMask(data.subspan(i), reference, referenceMask))
-                return true;
-        }
+            FileReader f(file);
+            if (!f.isOpen())
+                return MatchResult::Error;
+
+            // Consecutive windows overlap by refSize - 1 bytes, which may start a match continuing in the next window.
+            // A mapped file is looked at in place, otherwise the overlap is read again along with the next block.
+            size_t overlap = refSize - 1;
+            size_t windowSize = baseBufferSize + overlap;
+            auto buffer = ReadBuffers::get(0, windowSize);
+
+            for (std::uint64_t offset = 0 ; ; offset += baseBufferSize) {
+                const std::uint8_t* data;
+                auto bytesRead = f.viewAt(data, windowSize, offset, buffer);
+                if (bytesRead < 0)
+                    return MatchResult::Error;
+                if (static_cast<size_t>(bytesRead) < refSize)
+                    break;
+
+                if (searcher.find(data, static_cast<size_t>(bytesRead)) != MaskSearcher::npos)
+                    return MatchResult::Match;
+
+                if (static_cast<size_t>(bytesRead) < windowSize)
+                    break; // End of the file
+            }
 
-        return false;
+            return MatchResult::NoMatch;
+        }
+        catch (const std::exception&) {
+            return MatchResult::Error;
+        }
     }
 
-    inline MatchResult searchInFileContentsFlexible(const fs::path& file, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask, std::size_t baseBufferSize = 8192) {
+    inline MatchResult searchInFileContentsFlexible(const fs::path& file, const std::span<const uint8_t> reference, const std::span<const uint64_t> referenceMask, std::size_t baseBufferSize = ReadBuffers::getDefaultSize()) {
     // IMPORTANT: Bits in the last element of referenceMask that correspond to positions beyond the end of 'reference' must NOT be set.
+        if (referenceMask.size() < ((reference.size() + 63) >> 6))
+            return MatchResult::Error;
+
+        return searchInFileContentsFlexible(file, MaskSearcher(reference, referenceMask), reference.size(), baseBufferSize);
+    }
+
+    // References larger than this are compared window by window, see compareFileContentsStreamed
+    constexpr std::size_t defaultReferenceWindow = 64 << 20;
+
+    namespace detail {
+
+        // Compares the bytes [begin, end) of a reference to the file from fileOffset, a window of windowSize bytes at a time
+        // (begin and windowSize multiples of 64). window(offset, length, data, mask) sets the content and mask of the
+        // reference at offset, false on error.
+        template<typename TWindow>
+        inline MatchResult compareWindows(FileReader& f, std::uint64_t fileOffset, std::uint64_t begin, std::uint64_t end, std::size_t windowSize,
+            TWindow&& window) {
+            auto buffer = ReadBuffers::get(0, windowSize);
+            auto compare = MaskCompare::get();
+            for (std::uint64_t offset = begin ; offset < end ; offset += windowSize) {
+                auto length = static_cast<size_t>(std::min<std::uint64_t>(windowSize, end - offset));
+                const std::uint8_t* data;
+                auto bytesRead = f.viewAt(data, length, fileOffset + offset, buffer);
+                if (bytesRead < 0 || static_cast<size_t>(bytesRead) != length)
+                    return MatchResult::Error;
+
+                const std::uint8_t* referenceData;
+                const std::uint64_t* referenceMask;
+                if (!window(offset, length, referenceData, referenceMask))
+                    return MatchResult::Error;
+                if (!compare(data, referenceData, referenceMask, length))
+                    return MatchResult::NoMatch;
+            }
+            return MatchResult::Match;
+        }
+    }
+
+    // Compares the beginning (or the end) of the file to each reference not found yet, reading it once for all of them.
+    // References larger than windowSize are compared on their own, a window at a time, so no more than that is read at once.
+    // found[i] is set for each reference i matching, Match is returned if any did.
+    inline MatchResult compareFileContentsFlexible(const fs::path& file, std::span<const MultiMaskSearcher::Pattern> references, std::vector<char>& found, bool checkEnd = false,
+        std::size_t windowSize = defaultReferenceWindow) {
         try {
-            const auto refSize = reference.size();
-            if (refSize == 0)
-                return MatchResult::Match;
+            FileReader f(file);
+            if (!f.isOpen())
+                return MatchResult::Error;
 
-            if (referenceMask.size() < ((refSize + 63) >> 6))
+            auto fileSize = f.size();
+            if (fileSize < 0)
                 return MatchResult::Error;
 
-            std::ifstream f(file, std::ios::binary);
-            if (!f.is_open())
+            bool matched = false;
+            size_t readSize = 0;
+            for (size_t i = 0 ; i < references.size() ; ++i) {
+                const auto& reference = references[i];
+                auto refSize = reference.data.size();
+                if (found[i] || refSize > static_cast<std::uint64_t>(fileSize))
+                    continue;
+                if (refSize <= windowSize) {
+                    readSize = std::max(readSize, refSize);
+                    continue;
+                }
+
+                auto window = [&reference](std::uint64_t offset, size_t, const std::uint8_t*& data, const std::uint64_t*& mask) {
+                    data = reference.data.data() + offset;
+                    mask = reference.mask.data() + (offset >> 6);
+                    return true;
+                };
+                auto res = detail::compareWindows(f, checkEnd ? static_cast<std::uint64_t>(fileSize) - refSize : 0, 0, refSize, windowSize, window);
+                if (res == MatchResult::Error)
+                    return res;
+                if (res == MatchResult::Match) {
+                    found[i] = 1;
+                    matched = true;
+                }
+            }
+
+            auto buffer = ReadBuffers::get(0, readSize);
+            auto bytesRead = f.readAt(buffer.data(), readSize, checkEnd ? static_cast<std::uint64_t>(fileSize) - readSize : 0);
+            if (bytesRead < 0 || static_cast<size_t>(bytesRead) != readSize)
                 return MatchResult::Error;
 
-            size_t overlap = refSize - 1;
-            std::vector<uint8_t> buffer(baseBufferSize + overlap);
-            
-            f.read(reinterpret_cast<char*>(buffer.data()), baseBufferSize + overlap);
-            std::streamsize bytesRead = f.gcount();
-            if (bytesRead < refSize)
-                return MatchResult::NoMatch;
+            auto compare = MaskCompare::get();
+            for (size_t i = 0 ; i < references.size() ; ++i) {
+                const auto& reference = references[i];
+                if (found[i] || reference.data.size() > readSize)
+                    continue;
+                const uint8_t* data = buffer.data() + (checkEnd ? readSize - reference.data.size() : 0);
+                if (compare(data, reference.data.data(), reference.mask.data(), reference.data.size())) {
+                    found[i] = 1;
+                    matched = true;
+                }
+            }
 
-            if (searchWithMask(buffer, reference, referenceMask, bytesRead))
-                return MatchResult::Match;
-            
-            while (f) {
-                std::copy(buffer.end() - overlap, buffer.end(), buffer.begin());
-                
-                f.read(reinterpret_cast<char*>(buffer.data()) + overlap, baseBufferSize);
-                bytesRead = f.gcount();
-                if (bytesRead + overlap < refSize)
-                    break;
-                
-                if (searchWithMask(buffer, reference, referenceMask, bytesRead + overlap))
-                    return MatchResult::Match;
+            return matched ? MatchResult::Match : MatchResult::NoMatch;
+        }
+        catch (const std::exception&) {
+            return MatchResult::Error;
+        }
+    }
+
+    // Searches the file for each reference not found yet in a single pass, see MultiMaskSearcher::find.
+    // found[i] is set for each reference i found, Match is returned if any was.
+    inline MatchResult searchInFileContentsFlexible(const fs::path& file, const MultiMaskSearcher& searcher, std::vector<char>& found, std::size_t baseBufferSize = ReadBuffers::getDefaultSize()) {
+        try {
+            FileReader f(file);
+            if (!f.isOpen())
+                return MatchResult::Error;
+
+            size_t overlap = std::max<size_t>(searcher.getMaxSize(), 1) - 1;
+            size_t windowSize = baseBufferSize + overlap;
+            auto buffer = ReadBuffers::get(0, windowSize);
+            size_t remaining = static_cast<size_t>(std::count(found.begin(), found.end(), 0));
+            size_t foundCount = 0;
+
+            for (std::uint64_t offset = 0 ; foundCount < remaining ; offset += baseBufferSize) {
+                const std::uint8_t* data;
+                auto bytesRead = f.viewAt(data, windowSize, offset, buffer);
+                if (bytesRead < 0)
+                    return MatchResult::Error;
+
+                foundCount += searcher.find(data, static_cast<size_t>(bytesRead), found);
+
+                if (static_cast<size_t>(bytesRead) < windowSize)
+                    break; // End of the file
             }
-            
-            return MatchResult::NoMatch;
+
+            return foundCount > 0 ? MatchResult::Match : MatchResult::NoMatch;
         }
         catch (const std::exception&) {
             return MatchResult::Error;
@@ -230,4 +723,121 @@ namespace CompareUtils {
 
         return mask;
     }
+
+    // The mask of the window [begin, begin + length) of a reference, like generatePatternMask for the whole reference.
+    // context holds the window with up to pattern.size() - 1 bytes of the reference on both sides, from contextStart,
+    // for the jokers crossing its edges.
+    inline void generateWindowMask(std::span<const uint8_t> context, std::uint64_t contextStart, std::uint64_t begin, size_t length,
+        const std::vector<uint8_t>& pattern, std::vector<uint64_t>& mask) {
+        mask.assign((length + 63) >> 6, ~0ULL);
+        size_t leftover = length & 63;
+        if (leftover > 0) {
+            mask.back() &= (1ULL << leftover) - 1;
+        }
+
+        size_t patternSize = pattern.size();
+        if (patternSize > context.size() || patternSize == 0)
+            return;
+
+        auto windowStart = static_cast<size_t>(begin - contextStart);
+        for (size_t pos = 0 ; pos + patternSize <= context.size() ; ++pos) {
+            if (std::equal(pattern.begin(), pattern.end(), context.begin() + pos)) {
+                size_t from = std::max(pos, windowStart);
+                size_t to = std::min(pos + patternSize, windowStart + length);
+                for (size_t p = from ; p < to ; ++p) {
+                    mask[(p - windowStart) >> 6] &= ~(1ULL << ((p - windowStart) & 63));
+                }
+            }
+        }
+    }
+
+    // A reference too large to be held in memory: only its head is, the rest is read window by window along with each file
+    struct StreamedReference {
+        static constexpr std::size_t headSize = 1 << 20;
+
+        fs::path path;
+        std::uint64_t size{ 0 };
+        std::vector<uint8_t> jokerBytes;
+        std::vector<uint8_t> head; // The first min(headSize, window size) bytes
+        std::vector<uint64_t> headMask;
+    };
+
+    inline StreamedReference loadStreamedReference(const fs::path& path, const std::vector<uint8_t>& jokerBytes, std::size_t windowSize = defaultReferenceWindow) {
+        StreamedReference reference;
+        reference.path = path;
+        reference.jokerBytes = jokerBytes;
+
+        FileReader f(path);
+        auto size = f.isOpen() ? f.size() : -1;
+        if (size < 0)
+            throw std::runtime_error("Failed to open reference file: " + path.string());
+        reference.size = static_cast<std::uint64_t>(size);
+
+        // The head and the bytes after it a joker may continue into
+        size_t headLength = static_cast<size_t>(std::min<std::uint64_t>({ StreamedReference::headSize, windowSize, reference.size }));
+        size_t after = std::max<size_t>(jokerBytes.size(), 1) - 1;
+        size_t contextLength = static_cast<size_t>(std::min<std::uint64_t>(headLength + after, reference.size));
+        std::vector<uint8_t> context(contextLength);
+        auto bytesRead = f.readAt(context.data(), contextLength, 0);
+        if (bytesRead < 0 || static_cast<size_t>(bytesRead) != contextLength)
+            throw std::runtime_error("Failed to read reference file: " + path.string());
+
+        generateWindowMask(context, 0, 0, headLength, jokerBytes, reference.headMask);
+        context.resize(headLength);
+        reference.head = std::move(context);
+        return reference;
+    }
+
+    // Compares the beginning (or the end) of the file to a streamed reference: the head first, which rejects most files
+    // without reading the reference, then both files a window at a time, the joker mask of each window built as it is read.
+    inline MatchResult compareFileContentsStreamed(const fs::path& file, const StreamedReference& reference, bool checkEnd = false,
+        std::size_t windowSize = defaultReferenceWindow) {
+        try {
+            FileReader f(file);
+            if (!f.isOpen())
+                return MatchResult::Error;
+
+            auto fileSize = f.size();
+            if (fileSize < 0)
+                return MatchResult::Error;
+
+            if (static_cast<std::uint64_t>(fileSize) < reference.size)
+                return MatchResult::NoMatch;
+
+            std::uint64_t fileOffset = checkEnd ? static_cast<std::uint64_t>(fileSize) - reference.size : 0;
+            auto headWindow = [&reference](std::uint64_t, size_t, const std::uint8_t*& data, const std::uint64_t*& mask) {
+                data = reference.head.data();
+                mask = reference.headMask.data();
+                return true;
+            };
+            auto res = detail::compareWindows(f, fileOffset, 0, reference.head.size(), std::max<size_t>(reference.head.size(), 64), headWindow);
+            if (res != MatchResult::Match || reference.head.size() == reference.size)
+                return res;
+
+            FileReader r(reference.path);
+            if (!r.isOpen())
+                return MatchResult::Error;
+
+            size_t margin = std::max<size_t>(reference.jokerBytes.size(), 1) - 1;
+            auto contextBuffer = ReadBuffers::get(1, windowSize + 2 * margin);
+            std::vector<uint64_t> mask;
+            auto window = [&](std::uint64_t offset, size_t length, const std::uint8_t*& data, const std::uint64_t*& windowMask) {
+                std::uint64_t contextStart = offset - std::min<std::uint64_t>(offset, margin);
+                auto contextLength = static_cast<size_t>(std::min<std::uint64_t>(offset + length + margin, reference.size) - contextStart);
+                const std::uint8_t* context;
+                auto bytesRead = r.viewAt(context, contextLength, contextStart, contextBuffer);
+                if (bytesRead < 0 || static_cast<size_t>(bytesRead) != contextLength)
+                    return false;
+
+                generateWindowMask({ context, contextLength }, contextStart, offset, length, reference.jokerBytes, mask);
+                data = context + (offset - contextStart);
+                windowMask = mask.data();
+                return true;
+            };
+            return detail::compareWindows(f, fileOffset, reference.head.size(), reference.size, windowSize, window);
+        }
+        catch (const std::exception&) {
+            return MatchResult::Error;
+        }
+    }
 }
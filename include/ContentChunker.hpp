@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <filesystem>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include "HashUtils.hpp"
+#include "FileReader.hpp"
+
+// Content-defined chunking (FastCDC): the chunk boundaries are placed by a rolling (gear) hash of the content,
+// not at fixed offsets, so an insertion or deletion only changes the chunks around it, and files sharing most of
+// their content share most of their chunks, even when the shared parts are at different offsets.
+// The chunk sizes are normalized around the average size: a stricter boundary condition below it, a looser one above.
+// Each chunk is fingerprinted with XXH3-64 as it streams by, the content is read exactly once.
+class ContentChunker {
+public:
+    struct Chunk {
+        std::uint64_t hash;
+        std::uint32_t length;
+    };
+
+    static constexpr size_t minSize = 16 << 10;
+    static constexpr size_t averageSize = 64 << 10;
+    static constexpr size_t maxSize = 256 << 10;
+
+    ContentChunker() {
+        XXH3_64bits_reset(&state);
+    }
+
+    // Feeds the next part of the content, onChunk(Chunk) is called for every chunk completed by it
+    template<typename TOnChunk>
+    void feed(const std::uint8_t* data, size_t size, TOnChunk&& onChunk) {
+        size_t start = 0;
+        size_t i = 0;
+        while (i < size) {
+            if (length < minSize) {
+                // No boundary before the minimum size, the bytes are not even looked at
+                size_t skip = std::min(minSize - length, size - i);
+                i += skip;
+                length += skip;
+                continue;
+            }
+
+            fingerprint = (fingerprint << 1) + gear[data[i]];
+            ++i;
+            ++length;
+            if ((fingerprint & (length < averageSize ? maskSmall : maskLarge)) == 0 || length >= maxSize) {
+                XXH3_64bits_update(&state, data + start, i - start);
+                onChunk(Chunk{ XXH3_64bits_digest(&state), static_cast<std::uint32_t>(length) });
+                XXH3_64bits_reset(&state);
+                fingerprint = 0;
+                length = 0;
+                start = i;
+            }
+        }
+        if (start < size)
+            XXH3_64bits_update(&state, data + start, size - start);
+    }
+
+    // Ends the content, the last chunk is whatever is left
+    template<typename TOnChunk>
+    void finish(TOnChunk&& onChunk) {
+        if (length > 0)
+            onChunk(Chunk{ XXH3_64bits_digest(&state), static_cast<std::uint32_t>(length) });
+        XXH3_64bits_reset(&state);
+        fingerprint = 0;
+        length = 0;
+    }
+
+    // The chunks of a file in order, read in a single pass
+    static void chunkFile(const std::filesystem::path& path, std::vector<Chunk>& out, std::size_t bufferSize = ReadBuffers::getDefaultSize()) {
+        FileReader file(path);
+        if (!file.isOpen())
+            throw std::runtime_error("Failed to open file.");
+
+        ContentChunker chunker;
+        auto addChunk = [&out](const Chunk& chunk) { out.push_back(chunk); };
+        auto buffer = ReadBuffers::get(0, bufferSize);
+        while (true) {
+            const std::uint8_t* data;
+            auto bytesRead = file.next(data, bufferSize, buffer);
+            if (bytesRead < 0)
+                throw std::runtime_error("Failed to read file content.");
+            chunker.feed(data, static_cast<size_t>(bytesRead), addChunk);
+            if (static_cast<size_t>(bytesRead) < bufferSize)
+                break; // End of the file
+        }
+        chunker.finish(addChunk);
+    }
+
+private:
+    // The fingerprint is shifted left per byte, so its top bits depend on the last 64 bytes: the masks test those.
+    // 2 bits more than the average size below it, 2 bits less above it (normalization level 2).
+    static constexpr std::uint64_t maskSmall = ~0ULL << (64 - 18);
+    static constexpr std::uint64_t maskLarge = ~0ULL << (64 - 14);
+
+    // Random values per byte value, splitmix64
+    static constexpr std::array<std::uint64_t, 256> gear = [] {
+        std::array<std::uint64_t, 256> table{};
+        std::uint64_t seed = 0x6a09e667f3bcc908ULL;
+        for (auto& value : table) {
+            std::uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }();
+
+    XXH3_state_t state;
+    std::uint64_t fingerprint{ 0 };
+    size_t length{ 0 };
+};
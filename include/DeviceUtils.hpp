@@ -0,0 +1,98 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <cstdint>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+// Properties of the block devices behind the scanned files, used to schedule content reads per device.
+namespace DeviceUtils {
+
+    namespace fs = std::filesystem;
+
+    enum class DeviceClass {
+        Rotational,
+        SolidState,
+        Other   // No block device (network, FUSE, tmpfs, ...) or unknown
+    };
+
+#ifdef __linux__
+
+    // Reads queue/rotational of the device, or of its parent disk for a partition.
+    inline DeviceClass queryDeviceClass(std::uint64_t device) {
+        if (::major(device) == 0)
+            return DeviceClass::Other; // Anonymous device numbers have no block device behind them
+
+        std::error_code ec;
+        auto sysPath = fs::canonical("/sys/dev/block/" + std::to_string(::major(device)) + ":" + std::to_string(::minor(device)), ec);
+        if (ec)
+            return DeviceClass::Other;
+
+        for (const auto& dir : { sysPath, sysPath.parent_path() }) {
+            std::ifstream file(dir / "queue" / "rotational");
+            char value;
+            if (file >> value)
+                return (value == '1') ? DeviceClass::Rotational : DeviceClass::SolidState;
+        }
+        return DeviceClass::Other;
+    }
+
+    // Physical byte offset of the first extent of the file, 0 if unknown (e.g., no FIEMAP support, empty or inline file).
+    inline std::uint64_t getPhysicalOffset(const fs::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return 0;
+
+        // Room for the header and a single extent
+        alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)]{};
+        auto* map = reinterpret_cast<struct fiemap*>(buffer);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+
+        std::uint64_t offset = 0;
+        if (::ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+            !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+            offset = map->fm_extents[0].fe_physical;
+        }
+        ::close(fd);
+        return offset;
+    }
+
+#else
+
+    inline DeviceClass queryDeviceClass(std::uint64_t) {
+        return DeviceClass::Other;
+    }
+
+    inline std::uint64_t getPhysicalOffset(const fs::path&) {
+        return 0;
+    }
+
+#endif
+
+    // Cached per device, a scan only touches a handful of them.
+    inline DeviceClass getDeviceClass(std::uint64_t device) {
+        static std::mutex mtx;
+        static std::unordered_map<std::uint64_t, DeviceClass> classes;
+
+        std::lock_guard lock(mtx);
+        auto [it, inserted] = classes.try_emplace(device, DeviceClass::Other);
+        if (inserted)
+            it->second = queryDeviceClass(device);
+        return it->second;
+    }
+
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#endif
+
+#include "StringUtils.hpp"
+
+namespace DirectoryUtils {
+
+    namespace fs = std::filesystem;
+
+    enum class EntryType {
+        Directory,
+        RegularFile,
+        Other
+    };
+
+    // True if path is dir itself or anything below it.
+    inline bool isWithin(const fs::path& path, const fs::path& dir) {
+        auto [dirEnd, pathEnd] = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+        return dirEnd == dir.end();
+    }
+
+    struct Entry {
+        std::string_view name;
+        EntryType type{ EntryType::Other };
+#ifdef __linux__
+        struct stat st {};
+        bool hasStat{ false };
+#endif
+    };
+
+#ifdef __linux__
+
+    // Lists a directory with raw getdents64 calls on an open directory descriptor.
+    // Entries are classified by d_type, so no syscall is made per entry unless the filesystem does not report
+    // the type or the entry is a symbolic link (links are followed, like std::filesystem::directory_entry does).
+    // Further metadata can be resolved relative to the directory descriptor (see MetadataUtils), only when it is needed.
+    class DirectoryReader {
+    public:
+        explicit DirectoryReader(const fs::path& dir) : dirPath(dir) {
+            dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dirFd < 0)
+                throw fs::filesystem_error("Failed to open directory", dir, std::error_code(errno, std::generic_category()));
+        }
+
+        DirectoryReader(const DirectoryReader&) = delete;
+        DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+        ~DirectoryReader() {
+            ::close(dirFd);
+        }
+
+        bool next(Entry& entry) {
+            while (true) {
+                if (bufferPos >= bufferEnd) {
+                    long n = ::syscall(SYS_getdents64, dirFd, buffer, sizeof(buffer));
+                    if (n < 0)
+                        throw fs::filesystem_error("Failed to read directory", dirPath, std::error_code(errno, std::generic_category()));
+                    if (n == 0)
+                        return false;
+
+                    bufferPos = 0;
+                    bufferEnd = static_cast<size_t>(n);
+                }
+
+                auto* d = reinterpret_cast<const LinuxDirent64*>(buffer + bufferPos);
+                bufferPos += d->d_reclen;
+
+                std::string_view name(d->d_name);
+                if (name == "." || name == "..")
+                    continue;
+
+                entry.name = name;
+                entry.hasStat = false;
+                switch (d->d_type) {
+                case DT_DIR:
+                    entry.type = EntryType::Directory;
+                    break;
+                case DT_REG:
+                    entry.type = EntryType::RegularFile;
+                    break;
+                case DT_LNK:
+                case DT_UNKNOWN:
+                    entry.type = stat(entry) ? typeFromMode(entry.st.st_mode) : EntryType::Other;
+                    break;
+                default:
+                    entry.type = EntryType::Other;
+                    break;
+                }
+                return true;
+            }
+        }
+
+        fs::path path(const Entry& entry) const {
+            return dirPath / entry.name;
+        }
+
+        // Entries can be resolved relative to this descriptor (openat, fstatat, statx) while the reader is alive.
+        int fd() const {
+            return dirFd;
+        }
+
+    private:
+        struct LinuxDirent64 {
+            uint64_t d_ino;
+            int64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+
+        fs::path dirPath;
+        int dirFd{ -1 };
+        alignas(LinuxDirent64) char buffer[32768];
+        size_t bufferPos{ 0 };
+        size_t bufferEnd{ 0 };
+
+        bool stat(Entry& entry) {
+            if (!entry.hasStat) {
+                // entry.name points into the getdents64 buffer, where the name is NUL terminated
+                if (::fstatat(dirFd, entry.name.data(), &entry.st, 0) != 0)
+                    return false;
+                entry.hasStat = true;
+            }
+            return true;
+        }
+
+        static EntryType typeFromMode(mode_t mode) {
+            if (S_ISDIR(mode))
+                return EntryType::Directory;
+            if (S_ISREG(mode))
+                return EntryType::RegularFile;
+            return EntryType::Other;
+        }
+    };
+
+#else
+
+    // Portable fallback built on std::filesystem::directory_iterator.
+    class DirectoryReader {
+    public:
+        explicit DirectoryReader(const fs::path& dir) : it(dir) {}
+
+        bool next(Entry& entry) {
+            if (started)
+                ++it;
+            started = true;
+
+            if (it == fs::directory_iterator())
+                return false;
+
+            name = StringUtils::pathToString(it->path().filename());
+            entry.name = name;
+            if (it->is_directory())
+                entry.type = EntryType::Directory;
+            else if (it->is_regular_file())
+                entry.type = EntryType::RegularFile;
+            else
+                entry.type = EntryType::Other;
+            return true;
+        }
+
+        fs::path path(const Entry&) const {
+            return it->path();
+        }
+
+    private:
+        fs::directory_iterator it;
+        std::string name;
+        bool started{ false };
+    };
+
+#endif
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <cstdint>
+#include <functional>
+
+// A regular file found by the collectors, together with the metadata already resolved while listing its directory,
+// so that later stages do not have to query the filesystem again.
+struct FileEntry {
+    std::filesystem::path path;
+    // The metadata is only resolved when a stage needs it (see AntSeek::collectFileMetadata)
+    std::uintmax_t size{ 0 };
+    std::uint64_t device{ 0 };
+    std::uint64_t inode{ 0 };
+    std::int64_t mtimeNs{ 0 };
+};
+
+// Files are identified by their path in the hashed containers of the pipeline
+inline bool operator==(const FileEntry& a, const FileEntry& b) {
+    return a.path == b.path;
+}
+
+template<>
+struct std::hash<FileEntry> {
+    size_t operator()(const FileEntry& file) const noexcept {
+        return std::hash<std::filesystem::path>{}(file.path);
+    }
+};
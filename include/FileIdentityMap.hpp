@@ -0,0 +1,88 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <string_view>
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "FileTable.hpp"
+#include "HashUtils.hpp"
+
+// Tells apart the first path of a file (the primary) from further paths to the same inode (hard links, symbolic links
+// to files, overlapping roots), so the content of a file is only ever read through its primary.
+// Files are identified by (device, inode), optionally together with their filename when names have to match as well.
+// Sharded by identity, so the collectors rarely contend.
+class FileIdentityMap {
+public:
+    // Returns true if the file is the primary of its identity. Otherwise it is recorded as an alias of the primary.
+    // Files without an inode number (not resolved, or not provided by the platform) are always primaries.
+    // The name has to outlive the map (a view into the file table).
+    bool claim(FileId file, std::uint64_t device, std::uint64_t inode, std::string_view name = {}) {
+        if (inode == 0)
+            return true;
+
+        Key key{ device, inode, name };
+        size_t hash = KeyHash{}(key);
+        auto& shard = shards[hash % shardCount];
+
+        std::lock_guard lock(shard.mtx);
+        auto [it, inserted] = shard.identities.try_emplace(std::move(key));
+        if (inserted) {
+            it->second.primary = file;
+            return true;
+        }
+
+        it->second.aliases.push_back(file);
+        ++aliasCount;
+        return false;
+    }
+
+    bool hasAliases() const {
+        return aliasCount.load() > 0;
+    }
+
+    // Calls fn(primary, aliases) for every file reached through more than one path. Not thread-safe against claim().
+    template<typename TFunc>
+    void forEachAliased(TFunc&& fn) const {
+        for (const auto& shard : shards) {
+            for (const auto& [key, identity] : shard.identities) {
+                if (!identity.aliases.empty())
+                    fn(identity.primary, identity.aliases);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t shardCount = 64;
+
+    struct Key {
+        std::uint64_t device;
+        std::uint64_t inode;
+        std::string_view name;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const noexcept {
+            const std::uint64_t ids[2] = { key.device, key.inode };
+            return static_cast<size_t>(XXH3_64bits_withSeed(key.name.data(), key.name.size(), XXH3_64bits(ids, sizeof(ids))));
+        }
+    };
+
+    struct Identity {
+        FileId primary{ 0 };
+        std::vector<FileId> aliases;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        std::unordered_map<Key, Identity, KeyHash> identities;
+    };
+
+    std::array<Shard, shardCount> shards;
+    std::atomic<size_t> aliasCount{ 0 };
+};
@@ -1,90 +1,179 @@
 #pragma once
 
-#include <string>
-#include <queue>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
+#include <span>
+#include <array>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 
 #include "HashUtils.hpp"
+#include "IoScheduler.hpp"
+#include "FileTable.hpp"
 
 // A specialized queue for detecting multiple instances of the same file in a filesystem.
-// This class implements a special-purpose queue where elements are pushed one by one,
-// but can only be popped if their key has occurred multiple times.
-template<typename TValue>
+// This class implements a special-purpose queue where elements can only be popped
+// if their key has occurred multiple times.
+// Popped elements are handed out per device (see IoScheduler), and have to be returned with setProcessed() once read.
+// Files are passed by ID, their device and position on disk are looked up in the file table.
+//
+// The collectors push the matching files of a directory as one batch. The key maps are sharded by key hash, each shard is
+// locked once per batch, and the files which became ready are handed to the ready queue under a lock of its own,
+// so the hash workers never wait for the key maps.
 class FileQueue {
 public:
-    template<typename TKey>
-    void push(TKey key, const TValue& value) {
-        {
-            std::lock_guard lock(mtx);
-            auto& map = getMap<TKey>();
-            auto it = map.find(key);
-            if (it != map.end()) {
-                auto& valuePair = it->second;
-                if (!valuePair.first) {
-                    valuePair.first = true;
-                    fileQueue.push(valuePair.second);
+    explicit FileQueue(const FileTable& fileTable) : table(fileTable) {}
+
+    void setDeviceLimits(const DeviceSlots::Limits& limits) {
+        std::lock_guard lock(readyMtx);
+        scheduler.setLimits(limits);
+    }
+
+    // keyOf(file) gives the key of each file
+    template<typename TKeyFunc>
+    void push(std::span<const FileId> files, TKeyFunc&& keyOf) {
+        using TKey = std::decay_t<decltype(keyOf(files.front()))>;
+        if (files.empty())
+            return;
+
+        // Grouped by shard, so every shard is locked once
+        std::vector<std::pair<size_t, size_t>> order; // Shard, index into files
+        std::vector<TKey> keys;
+        order.reserve(files.size());
+        keys.reserve(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            keys.push_back(keyOf(files[i]));
+            order.emplace_back(KeyHash{}(keys.back()) % shardCount, i);
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<FileId> ready;
+        for (size_t begin = 0; begin < order.size(); ) {
+            auto& shard = shards[order[begin].first];
+            std::lock_guard lock(shard.mtx);
+            auto& map = getMap<TKey>(shard);
+            size_t end = begin;
+            for (; end < order.size() && order[end].first == order[begin].first; ++end) {
+                size_t i = order[end].second;
+                auto [it, inserted] = map.try_emplace(std::move(keys[i]), false, files[i]);
+                if (!inserted) {
+                    auto& valuePair = it->second;
+                    if (!valuePair.first) {
+                        valuePair.first = true;
+                        ready.push_back(valuePair.second);
+                    }
+                    ready.push_back(files[i]);
                 }
-                fileQueue.push(value);
-                cv.notify_one();
-            }
-            else {
-                map[key] = { false, value };
             }
+            begin = end;
         }
+        schedule(ready);
     }
 
-    void pushPassthrough(const TValue& value) {
-        {
-            std::lock_guard lock(mtx);
-            fileQueue.push(value);
-        }
-        cv.notify_one();
+    void pushPassthrough(std::span<const FileId> files) {
+        schedule(files);
     }
 
-    bool pop(TValue& out, std::stop_token stopToken) {
-        std::unique_lock lock(mtx);
+    bool pop(FileId& out, std::stop_token stopToken) {
+        std::unique_lock lock(readyMtx);
 
-        cv.wait(lock, stopToken, [this] { return !fileQueue.empty() || finished; });
+        bool popped = false;
+        cv.wait(lock, stopToken, [&] {
+            return (popped = scheduler.tryPop(out)) || (finished && scheduler.empty() && processing == 0);
+            });
+        if (popped)
+            ++processing;
+        return popped && !stopToken.stop_requested();
+    }
 
-        if (fileQueue.empty() || stopToken.stop_requested()) {
-            return false;
+    // Files may be pushed again (pushPassthrough) while processing a popped one, before it is set processed
+    void setProcessed(FileId value) {
+        bool drained;
+        {
+            std::lock_guard lock(readyMtx);
+            scheduler.release(table.device(value));
+            drained = (--processing == 0) && finished && scheduler.empty();
         }
-
-        out = fileQueue.front();
-        fileQueue.pop();
-        return true;
+        if (drained)
+            cv.notify_all();
+        else
+            cv.notify_one();
     }
 
     void setFinished() {
         {
-            std::lock_guard lock(mtx);
+            std::lock_guard lock(readyMtx);
             finished = true;
         }
         cv.notify_all();
     }
 
 private:
-    std::unordered_map<std::uintmax_t, std::pair<bool, TValue>> filesBySize;
-    std::unordered_map<std::string, std::pair<bool, TValue>> filesByName;
-    std::unordered_map<std::pair<std::uintmax_t, std::string>, std::pair<bool, TValue>, HashUtils::pairHash> filesBySizeAndName;
+    static constexpr size_t shardCount = 16;
 
-    std::queue<TValue> fileQueue;
-    std::mutex mtx;
+    // Names are views into the file table
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        std::unordered_map<std::uintmax_t, std::pair<bool, FileId>> filesBySize;
+        std::unordered_map<std::string_view, std::pair<bool, FileId>> filesByName;
+        std::unordered_map<std::pair<std::uintmax_t, std::string_view>, std::pair<bool, FileId>, HashUtils::pairHash> filesBySizeAndName;
+    };
+
+    struct KeyHash {
+        template<typename TKey>
+        size_t operator()(const TKey& key) const {
+            if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string_view>>) {
+                return HashUtils::pairHash{}(key);
+            }
+            else {
+                return std::hash<TKey>{}(key);
+            }
+        }
+    };
+
+    const FileTable& table;
+    std::array<Shard, shardCount> shards;
+
+    IoScheduler<FileId> scheduler;
+    std::mutex readyMtx;
     std::condition_variable_any cv;
     bool finished{ false }; // Indicates that no more elements will be added, but some elements may still be processing
+    size_t processing{ 0 }; // Popped, but not yet set processed
+
+    void schedule(std::span<const FileId> files) {
+        if (files.empty())
+            return;
+
+        // Looked up before locking, the first lookup of a file on a rotational device queries its extents
+        std::vector<std::uint64_t> offsets;
+        offsets.reserve(files.size());
+        for (auto file : files) {
+            offsets.push_back(table.physicalOffset(file));
+        }
+        {
+            std::lock_guard lock(readyMtx);
+            for (size_t i = 0; i < files.size(); ++i) {
+                scheduler.push(files[i], table.device(files[i]), offsets[i]);
+            }
+        }
+        if (files.size() == 1)
+            cv.notify_one();
+        else
+            cv.notify_all();
+    }
 
     template<typename TKey>
-    auto& getMap() {
+    static auto& getMap(Shard& shard) {
         if constexpr (std::is_same_v<TKey, std::uintmax_t>) {
-            return filesBySize;
+            return shard.filesBySize;
         }
-        else if constexpr (std::is_same_v<TKey, std::string>) {
-            return filesByName;
+        else if constexpr (std::is_same_v<TKey, std::string_view>) {
+            return shard.filesByName;
         }
-        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string>>) {
-            return filesBySizeAndName;
+        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string_view>>) {
+            return shard.filesBySizeAndName;
         }
         else {
             static_assert(AlwaysFalse<TKey>::value, "Unsupported key type");
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <span>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <cerrno>
+#endif
+
+// Reusable, page-aligned read buffers of the calling thread. A few slots are available, so a stage can read two
+// files side by side (slots 0 and 1), and a group compare the blocks of all its files (slot 2).
+// A slot only grows, so once warmed up, reading a file allocates nothing.
+// A slot must not be held across a call to another function reading files (they use the slots as well).
+class ReadBuffers {
+public:
+    static constexpr size_t slotCount = 3;
+    static constexpr size_t alignment = 4096;
+
+    static void setDefaultSize(size_t size) {
+        defaultSize.store(std::max<size_t>(size, alignment));
+    }
+
+    static size_t getDefaultSize() {
+        return defaultSize.load(std::memory_order_relaxed);
+    }
+
+    // At least minSize bytes (the default size if 0)
+    static std::span<std::uint8_t> get(size_t slot, size_t minSize = 0) {
+        thread_local Buffer buffers[slotCount];
+        auto& buffer = buffers[slot];
+        size_t size = (minSize == 0) ? getDefaultSize() : minSize;
+        if (buffer.size < size) {
+            size_t capacity = (size + alignment - 1) / alignment * alignment;
+            buffer.data.reset(static_cast<std::uint8_t*>(::operator new(capacity, std::align_val_t{ alignment })));
+            buffer.size = capacity;
+        }
+        return { buffer.data.get(), size };
+    }
+
+private:
+    struct AlignedDelete {
+        void operator()(std::uint8_t* p) const {
+            ::operator delete(p, std::align_val_t{ alignment });
+        }
+    };
+
+    struct Buffer {
+        std::unique_ptr<std::uint8_t, AlignedDelete> data;
+        size_t size{ 0 };
+    };
+
+    static inline std::atomic<size_t> defaultSize{ 65536 };
+};
+
+// Reads the content of a file through a raw descriptor with positioned reads (pread), without the iostream layer.
+// Reads return the number of bytes read, which is less than requested only at the end of the file, or -1 on error.
+//
+// The views (viewAt, next) let the caller look at the content without copying it: if enabled (see setMapping), large
+// files on local filesystems are memory-mapped, in windows if larger than the window size, and the view points into
+// the mapping. Anything else is read into the given buffer. A view is valid until the next call on the reader.
+// Mapping is off by default: a file truncated while mapped faults (SIGBUS) where the view is used, which kills the
+// process, where a positioned read only fails for that file.
+//
+// Every file is read once for a scan, so by default the reader keeps it out of the page cache (see CachePolicy):
+// the pages read are dropped as it goes, and the cache footprint stays bounded however much is read.
+class FileReader {
+public:
+    enum class CachePolicy {
+        Keep,   // Leave the page cache to the kernel
+        Drop,   // Drop the pages read (POSIX_FADV_DONTNEED)
+        Direct  // Read around the page cache (O_DIRECT) where the reads are aligned, drop the rest
+    };
+
+    static void setCachePolicy(CachePolicy policy) {
+        cachePolicy.store(policy);
+    }
+
+    // Files of at least threshold bytes are mapped (0: never), windowSize bytes at a time at most
+    static void setMapping(std::uint64_t threshold, size_t windowSize) {
+        mapThreshold.store(threshold);
+        mapWindowSize.store(std::max<size_t>(windowSize, 1 << 20));
+    }
+
+#ifdef __linux__
+
+    explicit FileReader(const std::filesystem::path& path) : policy(cachePolicy.load(std::memory_order_relaxed)) {
+        if (policy == CachePolicy::Direct) {
+            fd = open(path, O_DIRECT);
+            if (fd >= 0)
+                direct = true;
+            else
+                policy = CachePolicy::Drop; // Not supported by the filesystem (e.g. tmpfs)
+        }
+        if (fd < 0)
+            fd = open(path, 0);
+    }
+
+    ~FileReader() {
+        unmap();
+        if (fd >= 0) {
+            if (policy != CachePolicy::Keep && readEnd > droppedUntil)
+                ::posix_fadvise(fd, static_cast<off_t>(droppedUntil), static_cast<off_t>(readEnd - droppedUntil), POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // -1 if unknown
+    std::int64_t size() const {
+        struct stat st;
+        return (::fstat(fd, &st) == 0) ? static_cast<std::int64_t>(st.st_size) : -1;
+    }
+
+    std::ptrdiff_t readAt(void* buffer, size_t count, std::uint64_t offset) {
+        auto* out = static_cast<std::uint8_t*>(buffer);
+        size_t total = 0;
+
+        if (policy == CachePolicy::Direct) {
+            // The whole blocks of an aligned read go around the page cache, the rest (unaligned reads, the tail of
+            // a read) through it
+            bool aligned = reinterpret_cast<std::uintptr_t>(out) % directAlignment == 0 && offset % directAlignment == 0;
+            size_t blocks = aligned ? count / directAlignment * directAlignment : 0;
+            if (blocks > 0) {
+                if (!setDirect(true))
+                    return -1;
+                auto n = readFully(out, blocks, offset, true);
+                if (n < 0)
+                    return -1;
+                total = static_cast<size_t>(n);
+                if (total < blocks)
+                    return static_cast<std::ptrdiff_t>(total); // End of the file
+            }
+            if (total == count)
+                return static_cast<std::ptrdiff_t>(total);
+            if (!setDirect(false))
+                return -1;
+        }
+
+        auto n = readFully(out + total, count - total, offset + total, false);
+        if (n < 0)
+            return -1;
+        total += static_cast<size_t>(n);
+        if (policy != CachePolicy::Keep)
+            dropRead(offset + total);
+        return static_cast<std::ptrdiff_t>(total);
+    }
+
+    // Sets data to count bytes of the file from offset (fewer at the end of the file), and returns their number, or -1 on error.
+    // The buffer is only used if the file is not mapped, it has to hold count bytes.
+    std::ptrdiff_t viewAt(const std::uint8_t*& data, size_t count, std::uint64_t offset, std::span<std::uint8_t> buffer) {
+        if (access == Access::Undecided)
+            decideAccess();
+
+        if (access == Access::Stream) {
+            data = buffer.data();
+            return readAt(buffer.data(), count, offset);
+        }
+
+        if (offset >= fileSize)
+            return 0;
+        count = static_cast<size_t>(std::min<std::uint64_t>(count, fileSize - offset));
+        if (offset < mapOffset || offset + count > mapOffset + mapLength) {
+            if (!map(offset, count)) {
+                // Not mappable after all, read it instead
+                access = Access::Stream;
+                data = buffer.data();
+                return readAt(buffer.data(), count, offset);
+            }
+        }
+        data = static_cast<const std::uint8_t*>(mapBase) + (offset - mapOffset);
+        return static_cast<std::ptrdiff_t>(count);
+    }
+
+#else
+
+    explicit FileReader(const std::filesystem::path& path) : file(path, std::ios::binary) {}
+
+    bool isOpen() const {
+        return file.is_open();
+    }
+
+    std::int64_t size() {
+        file.clear();
+        file.seekg(0, std::ios::end);
+        auto end = file.tellg();
+        return (end == std::streampos(-1)) ? -1 : static_cast<std::int64_t>(end);
+    }
+
+    std::ptrdiff_t readAt(void* buffer, size_t count, std::uint64_t offset) {
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(static_cast<char*>(buffer), static_cast<std::streamsize>(count));
+        if (file.bad())
+            return -1;
+        return static_cast<std::ptrdiff_t>(file.gcount());
+    }
+
+    std::ptrdiff_t viewAt(const std::uint8_t*& data, size_t count, std::uint64_t offset, std::span<std::uint8_t> buffer) {
+        data = buffer.data();
+        return readAt(buffer.data(), count, offset);
+    }
+
+#endif
+
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+
+    // Sequential reading from the start of the file
+    std::ptrdiff_t read(void* buffer, size_t count) {
+        if (position == 0)
+            adviseSequential();
+        auto n = readAt(buffer, count, position);
+        if (n > 0)
+            position += static_cast<std::uint64_t>(n);
+        return n;
+    }
+
+    // Sequential viewing from the start of the file
+    std::ptrdiff_t next(const std::uint8_t*& data, size_t count, std::span<std::uint8_t> buffer) {
+        if (position == 0)
+            adviseSequential();
+        auto n = viewAt(data, count, position, buffer);
+        if (n > 0)
+            position += static_cast<std::uint64_t>(n);
+        return n;
+    }
+
+private:
+    static inline std::atomic<std::uint64_t> mapThreshold{ 0 };
+    static inline std::atomic<size_t> mapWindowSize{ 256 << 20 };
+    static inline std::atomic<CachePolicy> cachePolicy{ CachePolicy::Drop };
+
+#ifdef __linux__
+    enum class Access { Undecided, Stream, Map };
+
+    static constexpr size_t directAlignment = 4096; // Covers the logical block size of any device
+    static constexpr std::uint64_t dropInterval = 8 << 20;
+
+    int fd{ -1 };
+    CachePolicy policy;
+    bool direct{ false }; // O_DIRECT currently set on the descriptor
+    std::uint64_t readEnd{ 0 }; // The furthest read so far
+    std::uint64_t droppedUntil{ 0 };
+    Access access{ Access::Undecided };
+    std::uint64_t fileSize{ 0 };
+    void* mapBase{ nullptr };
+    std::uint64_t mapOffset{ 0 };
+    size_t mapLength{ 0 };
+
+    static int open(const std::filesystem::path& path, int flags) {
+        int result;
+        do {
+            result = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | flags);
+        } while (result < 0 && errno == EINTR);
+        return result;
+    }
+
+    // With O_DIRECT a short read is the end of the file, reading on from an unaligned offset would fail
+    std::ptrdiff_t readFully(std::uint8_t* out, size_t count, std::uint64_t offset, bool stopAtShortRead) {
+        size_t total = 0;
+        while (total < count) {
+            ssize_t n = ::pread(fd, out + total, count - total, static_cast<off_t>(offset + total));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (n == 0)
+                break;
+            total += static_cast<size_t>(n);
+            if (stopAtShortRead && total % directAlignment != 0)
+                break;
+        }
+        return static_cast<std::ptrdiff_t>(total);
+    }
+
+    // O_DIRECT is a status flag of the open file, so it can be switched for the unaligned reads
+    bool setDirect(bool enable) {
+        if (direct == enable)
+            return true;
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) < 0)
+            return false;
+        direct = enable;
+        return true;
+    }
+
+    // Drops the pages read so far once there are enough of them, the rest is dropped when the file is closed
+    void dropRead(std::uint64_t end) {
+        readEnd = std::max(readEnd, end);
+        if (readEnd - droppedUntil >= dropInterval) {
+            ::posix_fadvise(fd, static_cast<off_t>(droppedUntil), static_cast<off_t>(readEnd - droppedUntil), POSIX_FADV_DONTNEED);
+            droppedUntil = readEnd;
+        }
+    }
+
+    void adviseSequential() {
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // Only regular files on local filesystems are mapped: a mapping of a file on a network or FUSE mount can fault
+    // (SIGBUS) when the server goes away, and pseudo files (proc, sys) report no real size.
+    void decideAccess() {
+        access = Access::Stream;
+        if (policy == CachePolicy::Direct)
+            return; // A mapping reads through the page cache
+        auto threshold = mapThreshold.load(std::memory_order_relaxed);
+        struct stat st;
+        if (threshold == 0 || ::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || static_cast<std::uint64_t>(st.st_size) < threshold)
+            return;
+
+        struct statfs fsInfo;
+        if (::fstatfs(fd, &fsInfo) != 0)
+            return;
+        switch (static_cast<std::uint32_t>(fsInfo.f_type)) {
+        case 0x6969:        // NFS
+        case 0x517B:        // SMB
+        case 0xFF534D42:    // CIFS
+        case 0xFE534D42:    // SMB2
+        case 0x65735546:    // FUSE
+        case 0x00C36400:    // Ceph
+        case 0x9FA0:        // proc
+        case 0x62656572:    // sysfs
+            return;
+        default:
+            break;
+        }
+
+        fileSize = static_cast<std::uint64_t>(st.st_size);
+        access = Access::Map;
+    }
+
+    // Maps a window covering [offset, offset + count), which is within the file
+    bool map(std::uint64_t offset, size_t count) {
+        unmap();
+        static const std::uint64_t pageSize = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+        std::uint64_t begin = offset / pageSize * pageSize;
+        std::uint64_t length = std::max<std::uint64_t>(mapWindowSize.load(std::memory_order_relaxed), offset + count - begin);
+        length = std::min(length, fileSize - begin);
+
+        void* base = ::mmap(nullptr, static_cast<size_t>(length), PROT_READ, MAP_SHARED, fd, static_cast<off_t>(begin));
+        if (base == MAP_FAILED)
+            return false;
+        ::madvise(base, static_cast<size_t>(length), MADV_SEQUENTIAL);
+
+        mapBase = base;
+        mapOffset = begin;
+        mapLength = static_cast<size_t>(length);
+        return true;
+    }
+
+    void unmap() {
+        if (mapBase) {
+            ::munmap(mapBase, mapLength);
+            if (policy != CachePolicy::Keep)
+                ::posix_fadvise(fd, static_cast<off_t>(mapOffset), static_cast<off_t>(mapLength), POSIX_FADV_DONTNEED);
+            mapBase = nullptr;
+            mapLength = 0;
+        }
+    }
+#else
+    std::ifstream file;
+
+    void adviseSequential() {}
+#endif
+    std::uint64_t position{ 0 };
+};
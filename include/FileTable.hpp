@@ -0,0 +1,160 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <span>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include "FileEntry.hpp"
+#include "DeviceUtils.hpp"
+
+using FileId = std::uint32_t;
+
+// The files found by a scan, each stored once and referred to by a 32-bit ID in every later stage.
+// A file is its directory ID plus its name, the names live in a shared arena, and the directory paths are interned.
+// The metadata columns are kept apart (struct of arrays), in chunks which never move once allocated:
+// an ID handed over through a queue can be read without locking, while the collectors keep adding files.
+class FileTable {
+public:
+    using DirectoryId = std::uint32_t;
+
+    FileTable() {
+        chunks.reserve(maxChunks);
+        directoryChunks.reserve(maxChunks);
+    }
+
+    // Only a scan reading the file contents orders its reads by physical offset (see physicalOffset)
+    void setResolvesPhysicalOffsets(bool resolve) {
+        resolvesPhysicalOffsets = resolve;
+    }
+
+    DirectoryId addDirectory(const std::filesystem::path& path) {
+        std::lock_guard lock(mtx);
+        DirectoryId id = directoryCount;
+        if (id % chunkSize == 0)
+            directoryChunks.push_back(std::make_unique<std::filesystem::path[]>(chunkSize));
+        directoryChunks[id / chunkSize][id % chunkSize] = path;
+        ++directoryCount;
+        return id;
+    }
+
+    // Adds the files of a directory with their metadata, the paths of the entries are not used.
+    // Returns the ID of the first one, the others follow in order.
+    FileId add(DirectoryId directory, std::span<const std::string> names, std::span<const FileEntry> files) {
+        std::lock_guard lock(mtx);
+        FileId first = fileCount.load(std::memory_order_relaxed);
+        if (files.size() > maxFiles - first)
+            throw std::runtime_error("Too many files to scan");
+
+        for (size_t n = 0; n < files.size(); ++n) {
+            FileId id = first + static_cast<FileId>(n);
+            if (id % chunkSize == 0)
+                chunks.push_back(std::make_unique<Chunk>());
+
+            auto& chunk = *chunks[id / chunkSize];
+            size_t i = id % chunkSize;
+            chunk.directories[i] = directory;
+            chunk.names[i] = intern(names[n]);
+            chunk.sizes[i] = files[n].size;
+            chunk.devices[i] = files[n].device;
+            chunk.inodes[i] = files[n].inode;
+            chunk.mtimesNs[i] = files[n].mtimeNs;
+            chunk.physicalOffsets[i].store(unresolved, std::memory_order_relaxed);
+        }
+        fileCount.store(first + static_cast<FileId>(files.size()), std::memory_order_release);
+        return first;
+    }
+
+    size_t count() const {
+        return fileCount.load(std::memory_order_acquire);
+    }
+
+    std::filesystem::path path(FileId id) const {
+        auto name = this->name(id);
+        return directoryPath(chunkOf(id).directories[id % chunkSize]) /
+            std::u8string_view(reinterpret_cast<const char8_t*>(name.data()), name.size());
+    }
+
+    std::string_view name(FileId id) const { return chunkOf(id).names[id % chunkSize]; }
+    std::uintmax_t size(FileId id) const { return chunkOf(id).sizes[id % chunkSize]; }
+    std::uint64_t device(FileId id) const { return chunkOf(id).devices[id % chunkSize]; }
+    std::uint64_t inode(FileId id) const { return chunkOf(id).inodes[id % chunkSize]; }
+    std::int64_t mtimeNs(FileId id) const { return chunkOf(id).mtimesNs[id % chunkSize]; }
+
+    // Start of the first extent of the file on disk on rotational devices, 0 elsewhere. Queried on the first call,
+    // so that only the files which get read pay for it (see DeviceUtils::getPhysicalOffset).
+    std::uint64_t physicalOffset(FileId id) const {
+        auto& offset = chunkOf(id).physicalOffsets[id % chunkSize];
+        auto value = offset.load(std::memory_order_relaxed);
+        if (value == unresolved) {
+            value = 0;
+            if (resolvesPhysicalOffsets && DeviceUtils::getDeviceClass(device(id)) == DeviceUtils::DeviceClass::Rotational)
+                value = DeviceUtils::getPhysicalOffset(path(id));
+            offset.store(value, std::memory_order_relaxed); // Racing callers store the same value
+        }
+        return value;
+    }
+
+    // A standalone copy, for the interfaces working on single files (hash cache, watch index)
+    FileEntry entry(FileId id) const {
+        const auto& chunk = chunkOf(id);
+        size_t i = id % chunkSize;
+        return { path(id), chunk.sizes[i], chunk.devices[i], chunk.inodes[i], chunk.mtimesNs[i] };
+    }
+
+private:
+    static constexpr size_t chunkSize = 65536;
+    static constexpr size_t maxChunks = 65536;
+    static constexpr size_t maxFiles = chunkSize * maxChunks - 1; // The IDs have to fit into 32 bits
+    static constexpr size_t arenaBlockSize = 1 << 20;
+    static constexpr std::uint64_t unresolved = ~std::uint64_t{ 0 };
+
+    struct Chunk {
+        DirectoryId directories[chunkSize];
+        std::string_view names[chunkSize]; // Into the arena
+        std::uintmax_t sizes[chunkSize];
+        std::uint64_t devices[chunkSize];
+        std::uint64_t inodes[chunkSize];
+        std::int64_t mtimesNs[chunkSize];
+        mutable std::atomic<std::uint64_t> physicalOffsets[chunkSize]; // Resolved lazily
+    };
+
+    // Reserved up front, so appending a chunk never moves the pointers readers are looking at
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::vector<std::unique_ptr<std::filesystem::path[]>> directoryChunks;
+    std::atomic<FileId> fileCount{ 0 };
+    DirectoryId directoryCount{ 0 };
+    bool resolvesPhysicalOffsets{ false };
+
+    std::vector<std::unique_ptr<char[]>> arena;
+    size_t arenaUsed{ 0 };
+    std::mutex mtx;
+
+    const Chunk& chunkOf(FileId id) const {
+        return *chunks[id / chunkSize];
+    }
+
+    const std::filesystem::path& directoryPath(DirectoryId id) const {
+        return directoryChunks[id / chunkSize][id % chunkSize];
+    }
+
+    std::string_view intern(std::string_view name) {
+        if (arena.empty() || name.size() > arenaBlockSize - arenaUsed) {
+            // Names longer than a block get a block of their own
+            arena.push_back(std::make_unique<char[]>(std::max(name.size(), arenaBlockSize)));
+            arenaUsed = 0;
+        }
+        char* out = arena.back().get() + arenaUsed;
+        std::memcpy(out, name.data(), name.size());
+        arenaUsed = std::min(arenaUsed + name.size(), arenaBlockSize); // A block of its own is full at once
+        return { out, name.size() };
+    }
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <cerrno>
+#endif
+
+#include "DirectoryUtils.hpp"
+
+// Reports changes of regular files and directories below the watched directories, based on inotify.
+// Directories can be added from several threads (e.g., by the collectors while the initial scan is running),
+// the events are consumed by a single thread.
+class FileWatcher {
+public:
+    struct Event {
+        enum class Type {
+            FileChanged,        // Created, written, or moved into a watched directory
+            FileRemoved,        // Deleted or moved away
+            DirectoryAdded,     // Created or moved into a watched directory, its content is not reported
+            DirectoryRemoved,   // Deleted or moved away, its content is not reported
+            Overflow            // The kernel dropped events, the index may be out of date
+        } type;
+        std::filesystem::path path;
+    };
+
+#ifdef __linux__
+
+    FileWatcher() {
+        fd = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Failed to initialize inotify: ") + std::strerror(errno));
+    }
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    ~FileWatcher() {
+        ::close(fd);
+    }
+
+    bool addDirectory(const std::filesystem::path& dir) {
+        int wd = ::inotify_add_watch(fd, dir.c_str(), watchMask);
+        if (wd < 0)
+            return false;
+
+        std::lock_guard lock(mtx);
+        directories[wd] = dir;
+        return true;
+    }
+
+    // Stops watching the directory and every directory below it.
+    void removeDirectory(const std::filesystem::path& dir) {
+        std::lock_guard lock(mtx);
+        for (auto it = directories.begin(); it != directories.end(); ) {
+            if (DirectoryUtils::isWithin(it->second, dir)) {
+                ::inotify_rm_watch(fd, it->first);
+                it = directories.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    // Blocks until events are available or a stop is requested, then returns the pending events.
+    bool wait(std::vector<Event>& events, std::stop_token st) {
+        events.clear();
+        while (!st.stop_requested()) {
+            pollfd pfd{ fd, POLLIN, 0 };
+            int ret = ::poll(&pfd, 1, pollIntervalMs);
+            if (ret < 0 && errno != EINTR)
+                throw std::runtime_error(std::string("Failed to wait for inotify events: ") + std::strerror(errno));
+            if (ret <= 0)
+                continue;
+
+            readEvents(events);
+            if (!events.empty())
+                return true;
+        }
+        return false;
+    }
+
+private:
+    static constexpr uint32_t watchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR;
+    static constexpr int pollIntervalMs = 500;
+
+    int fd{ -1 };
+    std::unordered_map<int, std::filesystem::path> directories;
+    std::mutex mtx;
+    alignas(inotify_event) char buffer[65536];
+
+    void readEvents(std::vector<Event>& events) {
+        while (true) {
+            ssize_t len = ::read(fd, buffer, sizeof(buffer));
+            if (len <= 0)
+                return;
+
+            std::lock_guard lock(mtx);
+            for (ssize_t pos = 0; pos < len; ) {
+                auto* ev = reinterpret_cast<const inotify_event*>(buffer + pos);
+                pos += sizeof(inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    events.push_back({ Event::Type::Overflow, {} });
+                    continue;
+                }
+                if (ev->mask & IN_IGNORED) {
+                    directories.erase(ev->wd);
+                    continue;
+                }
+
+                auto it = directories.find(ev->wd);
+                if (it == directories.end() || ev->len == 0)
+                    continue;
+
+                auto path = it->second / ev->name;
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        events.push_back({ Event::Type::DirectoryAdded, path });
+                    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                        events.push_back({ Event::Type::DirectoryRemoved, path });
+                }
+                else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    events.push_back({ Event::Type::FileChanged, path });
+                }
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    events.push_back({ Event::Type::FileRemoved, path });
+                }
+            }
+        }
+    }
+
+#else
+
+    FileWatcher() {
+        throw std::runtime_error("Watch mode is not supported on this platform");
+    }
+
+    bool addDirectory(const std::filesystem::path&) {
+        return false;
+    }
+
+    void removeDirectory(const std::filesystem::path&) {}
+
+    bool wait(std::vector<Event>&, std::stop_token) {
+        return false;
+    }
+
+#endif
+};
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+#include "FileEntry.hpp"
+#include "HashUtils.hpp"
+
+// Persistent, memory-mapped cache of file hashes, so that re-scanning an unchanged tree needs no content I/O.
+// Files are identified by (device, inode, size, mtime): any modification yields a new key, so entries never need
+// to be invalidated, stale ones are simply dropped when the table is grown.
+// The file is an open addressing hash table with linear probing, guarded by an exclusive lock against other processes.
+class HashCache {
+public:
+    enum class ChunkMode : uint8_t { None = 0, First = 1, Last = 2, Sparse = 3 }; // Sparse: HashUtils::hashSparseChunks, by block size
+
+    explicit HashCache(const std::filesystem::path& cacheFile) : path(cacheFile) {
+#ifdef _WIN32
+        throw std::runtime_error("The hash cache is not supported on this platform");
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open hash cache: " + path.string() + " (" + std::strerror(errno) + ")");
+
+        if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Hash cache is in use by another process: " + path.string());
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !map(static_cast<size_t>(st.st_size)) || !isValid()) {
+            unmap();
+            if (::ftruncate(fd, 0) != 0 || !create(fd, initialCapacity)) {
+                ::close(fd);
+                throw std::runtime_error("Failed to initialize hash cache: " + path.string());
+            }
+            if (!map(fileSize(initialCapacity))) {
+                ::close(fd);
+                throw std::runtime_error("Failed to map hash cache: " + path.string());
+            }
+        }
+
+        ++header->generation;
+#endif
+    }
+
+    HashCache(const HashCache&) = delete;
+    HashCache& operator=(const HashCache&) = delete;
+
+    ~HashCache() {
+#ifndef _WIN32
+        unmap();
+        if (fd >= 0)
+            ::close(fd);
+#endif
+    }
+
+    bool getChunkHash(const FileEntry& file, ChunkMode mode, uint64_t hashSize, uint64_t& out) {
+        std::lock_guard lock(mtx);
+        Entry* e = find(file, false);
+        if (!e || mode == ChunkMode::None || !(e->flags & chunkFlag(mode)) || e->chunks[chunkSlot(mode)].hashSize != hashSize)
+            return false;
+
+        e->generation = header->generation;
+        out = e->chunks[chunkSlot(mode)].hash;
+        return true;
+    }
+
+    void putChunkHash(const FileEntry& file, ChunkMode mode, uint64_t hashSize, uint64_t hash) {
+        std::lock_guard lock(mtx);
+        if (mode == ChunkMode::None)
+            return;
+        if (Entry* e = find(file, true)) {
+            e->chunks[chunkSlot(mode)] = { hash, hashSize };
+            e->flags |= chunkFlag(mode);
+        }
+    }
+
+    bool getFullHash(const FileEntry& file, XXH128_hash_t& out) {
+        std::lock_guard lock(mtx);
+        Entry* e = find(file, false);
+        if (!e || !(e->flags & flagFull))
+            return false;
+
+        e->generation = header->generation;
+        out.low64 = e->fullHashLow;
+        out.high64 = e->fullHashHigh;
+        return true;
+    }
+
+    void putFullHash(const FileEntry& file, const XXH128_hash_t& hash) {
+        std::lock_guard lock(mtx);
+        if (Entry* e = find(file, true)) {
+            e->fullHashLow = hash.low64;
+            e->fullHashHigh = hash.high64;
+            e->flags |= flagFull;
+        }
+    }
+
+private:
+    static constexpr char magic[8] = { 'A', 'N', 'T', 'H', 'C', 'A', 'C', 'H' };
+    static constexpr uint32_t version = 3; // 2: full hashes of files larger than a tree segment are tree digests (HashUtils::hashFile)
+                                           // 3: a slot per chunk mode
+    static constexpr uint64_t initialCapacity = 1 << 16; // Must be a power of two
+    static constexpr uint32_t keptGenerations = 8; // Entries not used in this many runs are dropped when the table grows
+
+    static constexpr uint8_t flagUsed = 1;
+    static constexpr uint8_t flagFull = 2;
+    static constexpr uint8_t flagFirst = 4; // The chunk flags follow in the order of ChunkMode
+    static constexpr size_t chunkModeCount = 3;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entrySize;
+        uint64_t capacity;
+        uint64_t count;
+        uint32_t generation;
+        uint8_t reserved[28];
+    };
+
+    struct Chunk {
+        uint64_t hash;
+        uint64_t hashSize;
+    };
+
+    // The cascade hashes the first, the last and the sparse chunks of a file in turn, each has its own slot
+    struct Entry {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t mtimeNs;
+        Chunk chunks[chunkModeCount]; // By chunkSlot
+        uint64_t fullHashLow;
+        uint64_t fullHashHigh;
+        uint32_t generation;
+        uint8_t flags;
+        uint8_t reserved[3];
+    };
+
+    static_assert(sizeof(Header) == 64);
+    static_assert(sizeof(Entry) == 104);
+
+    std::filesystem::path path;
+    std::mutex mtx;
+    int fd{ -1 };
+    void* mapping{ nullptr };
+    size_t mappingSize{ 0 };
+    Header* header{ nullptr };
+    Entry* entries{ nullptr };
+
+    static size_t chunkSlot(ChunkMode mode) {
+        return static_cast<size_t>(mode) - 1;
+    }
+
+    static uint8_t chunkFlag(ChunkMode mode) {
+        return static_cast<uint8_t>(flagFirst << chunkSlot(mode));
+    }
+
+    static size_t fileSize(uint64_t capacity) {
+        return sizeof(Header) + capacity * sizeof(Entry);
+    }
+
+    static bool sameKey(const Entry& e, const FileEntry& file) {
+        return e.device == file.device && e.inode == file.inode && e.size == file.size && e.mtimeNs == file.mtimeNs;
+    }
+
+    static uint64_t slotHash(uint64_t device, uint64_t inode, uint64_t size, int64_t mtimeNs) {
+        const uint64_t key[4] = { device, inode, size, static_cast<uint64_t>(mtimeNs) };
+        return XXH3_64bits(key, sizeof(key));
+    }
+
+    bool isValid() const {
+        return mappingSize >= sizeof(Header) &&
+            std::memcmp(header->magic, magic, sizeof(magic)) == 0 &&
+            header->version == version &&
+            header->entrySize == sizeof(Entry) &&
+            header->capacity != 0 && (header->capacity & (header->capacity - 1)) == 0 &&
+            mappingSize >= fileSize(header->capacity);
+    }
+
+    Entry* find(const FileEntry& file, bool insert) {
+        if (!header)
+            return nullptr;
+
+        if (insert && (header->count + 1) * 10 > header->capacity * 7 && !grow())
+            return nullptr;
+
+        uint64_t mask = header->capacity - 1;
+        for (uint64_t i = slotHash(file.device, file.inode, file.size, file.mtimeNs) & mask; ; i = (i + 1) & mask) {
+            Entry& e = entries[i];
+            if (!(e.flags & flagUsed)) {
+                if (!insert)
+                    return nullptr;
+
+                std::memset(&e, 0, sizeof(e));
+                e.device = file.device;
+                e.inode = file.inode;
+                e.size = file.size;
+                e.mtimeNs = file.mtimeNs;
+                e.flags = flagUsed;
+                e.generation = header->generation;
+                ++header->count;
+                return &e;
+            }
+            if (sameKey(e, file)) {
+                e.generation = header->generation;
+                return &e;
+            }
+        }
+    }
+
+#ifdef _WIN32
+
+    bool grow() {
+        return false;
+    }
+
+#else
+
+    bool map(size_t size) {
+        if (size < sizeof(Header))
+            return false;
+
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+
+        mapping = p;
+        mappingSize = size;
+        header = static_cast<Header*>(p);
+        entries = reinterpret_cast<Entry*>(static_cast<char*>(p) + sizeof(Header));
+        return true;
+    }
+
+    void unmap() {
+        if (mapping)
+            ::munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+        header = nullptr;
+        entries = nullptr;
+    }
+
+    static bool create(int file, uint64_t capacity) {
+        if (::ftruncate(file, static_cast<off_t>(fileSize(capacity))) != 0)
+            return false;
+
+        Header h{};
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.entrySize = sizeof(Entry);
+        h.capacity = capacity;
+        return ::pwrite(file, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h));
+    }
+
+    // Rehashes the live entries into a table of double size, written to a new file which then replaces the old one.
+    bool grow() {
+        uint64_t capacity = header->capacity * 2;
+        auto tmpPath = path;
+        tmpPath += ".tmp";
+
+        int newFd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (newFd < 0)
+            return false;
+
+        size_t newSize = fileSize(capacity);
+        void* p = create(newFd, capacity) ? ::mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, newFd, 0) : MAP_FAILED;
+        if (p == MAP_FAILED) {
+            ::close(newFd);
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+
+        auto* newHeader = static_cast<Header*>(p);
+        auto* newEntries = reinterpret_cast<Entry*>(static_cast<char*>(p) + sizeof(Header));
+        newHeader->generation = header->generation;
+
+        uint64_t mask = capacity - 1;
+        for (uint64_t i = 0; i < header->capacity; ++i) {
+            const Entry& e = entries[i];
+            if (!(e.flags & flagUsed) || e.generation + keptGenerations < header->generation)
+                continue;
+
+            uint64_t j = slotHash(e.device, e.inode, e.size, e.mtimeNs) & mask;
+            while (newEntries[j].flags & flagUsed)
+                j = (j + 1) & mask;
+            newEntries[j] = e;
+            ++newHeader->count;
+        }
+
+        ::flock(newFd, LOCK_EX | LOCK_NB);
+        if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            ::munmap(p, newSize);
+            ::close(newFd);
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+
+        unmap();
+        ::close(fd);
+        fd = newFd;
+        mapping = p;
+        mappingSize = newSize;
+        header = newHeader;
+        entries = newEntries;
+        return true;
+    }
+
+#endif
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#include "FileTable.hpp"
+
+// Fingerprints the files of a colliding bucket in stages of increasing cost: first block, last block, sparse samples,
+// and finally a full streaming hash. A file only moves on to the next stage while its bucket still collides, i.e.
+// another file agrees with it on every stage so far, so the bytes read follow the actual ambiguity of the files.
+// Files of a bucket share the size, so they run through the same stages (see firstStage and nextStage).
+class HashCascade {
+public:
+    enum class Stage : std::uint8_t { First, Last, Sparse, Full };
+    static constexpr size_t stageCount = 4;
+    static constexpr size_t sparseSampleCount = 16;
+
+    // Where a file stands: the stage to run next, and the key of its bucket so far (base key and fingerprints)
+    struct Progress {
+        Stage stage{ Stage::First };
+        std::string key;
+    };
+
+    struct StageStats {
+        std::uint64_t files{ 0 };       // Fingerprinted at this stage
+        std::uint64_t eliminated{ 0 };  // Found unique at this stage, not looked at any further
+        std::uint64_t bytesRead{ 0 };
+    };
+
+    explicit HashCascade(size_t blockSize) : blockSize(blockSize) {}
+
+    // Stages are skipped when the earlier ones already cover the file (small files), or when they would read
+    // a large part of it anyway (sparse samples of a not that large file).
+    Stage firstStage(std::uintmax_t size) const {
+        return (size <= blockSize) ? Stage::Full : Stage::First;
+    }
+
+    Stage nextStage(Stage stage, std::uintmax_t size) const {
+        switch (stage) {
+        case Stage::First:
+            return (size <= 2 * blockSize) ? Stage::Full : Stage::Last;
+        case Stage::Last:
+            return (size <= 4 * sparseSampleCount * blockSize) ? Stage::Full : Stage::Sparse;
+        default:
+            return Stage::Full;
+        }
+    }
+
+    // Bytes a stage reads of a file
+    std::uint64_t bytesOf(Stage stage, std::uintmax_t size) const {
+        switch (stage) {
+        case Stage::First:
+        case Stage::Last:
+            return std::min<std::uintmax_t>(size, blockSize);
+        case Stage::Sparse:
+            return std::min<std::uintmax_t>(size, sparseSampleCount * blockSize);
+        default:
+            return size;
+        }
+    }
+
+    size_t getBlockSize() const {
+        return blockSize;
+    }
+
+    // The progress of a file escalated earlier. Returns false for a file which has not been through any stage yet.
+    bool take(FileId file, Progress& out) {
+        std::lock_guard lock(mtx);
+        auto it = escalated.find(file);
+        if (it == escalated.end())
+            return false;
+        out = std::move(it->second);
+        escalated.erase(it);
+        return true;
+    }
+
+    // Records the result of a stage, progress.key holding the fingerprint of it already.
+    // The files whose bucket collides now (the first one waiting in it, and every later one) are added to out:
+    // they have to be pushed again for their next stage. After the full hash stage nothing is escalated any more,
+    // it is only recorded for the statistics.
+    void record(FileId file, std::uintmax_t size, Progress progress, std::vector<FileId>& out) {
+        auto stage = static_cast<size_t>(progress.stage);
+        auto next = nextStage(progress.stage, size);
+        countStage(progress.stage, size);
+
+        std::lock_guard lock(mtx);
+        auto& buckets = stageBuckets[stage];
+        auto [it, inserted] = buckets.try_emplace(progress.key, false, file);
+        if (inserted)
+            return;
+
+        auto& [collided, waiting] = it->second;
+        if (progress.stage == Stage::Full) {
+            collided = true;
+            return;
+        }
+        if (!collided) {
+            collided = true;
+            escalated[waiting] = { next, progress.key };
+            out.push_back(waiting);
+        }
+        progress.stage = next;
+        escalated[file] = std::move(progress);
+        out.push_back(file);
+    }
+
+    // Not thread-safe against record(), call it once the cascade is done
+    std::array<StageStats, stageCount> getStats() const {
+        std::array<StageStats, stageCount> stats;
+        for (size_t i = 0; i < stageCount; ++i) {
+            stats[i].files = counters[i].files.load();
+            stats[i].bytesRead = counters[i].bytesRead.load();
+            for (const auto& [key, bucket] : stageBuckets[i]) {
+                if (!bucket.first)
+                    ++stats[i].eliminated;
+            }
+        }
+        return stats;
+    }
+
+    static const char* stageName(Stage stage) {
+        switch (stage) {
+        case Stage::First: return "first block";
+        case Stage::Last: return "last block";
+        case Stage::Sparse: return "sparse samples";
+        default: return "full hash";
+        }
+    }
+
+private:
+    struct Counters {
+        std::atomic<std::uint64_t> files{ 0 };
+        std::atomic<std::uint64_t> bytesRead{ 0 };
+    };
+
+    size_t blockSize;
+    std::array<std::unordered_map<std::string, std::pair<bool, FileId>>, stageCount> stageBuckets; // Collided, first file
+    std::unordered_map<FileId, Progress> escalated;
+    std::array<Counters, stageCount> counters;
+    std::mutex mtx;
+
+    void countStage(Stage stage, std::uintmax_t size) {
+        auto& counter = counters[static_cast<size_t>(stage)];
+        counter.files.fetch_add(1, std::memory_order_relaxed);
+        counter.bytesRead.fetch_add(bytesOf(stage, size), std::memory_order_relaxed);
+    }
+};
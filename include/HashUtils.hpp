@@ -1,11 +1,22 @@
 #pragma once
 
 #include <filesystem>
-#include <fstream>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <stdexcept>
+#include <span>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#define XXH_STATIC_LINKING_ONLY // XXH3_state_t on the stack for streaming hashes
 #include "xxhash.h"
 
+#include "FileReader.hpp"
+#include "WorkerPool.hpp"
+
 namespace HashUtils {
 
     constexpr std::size_t goldenRatio =
@@ -42,35 +53,172 @@ namespace HashUtils {
         }
     };
 
+    // Serializes a key (integers, strings, and pairs or tuples of them) into a byte string, so keys of any type
+    // can share one container. Strings are length prefixed, so the concatenation stays unambiguous.
+    template<typename TKey>
+    inline void appendKey(std::string& out, const TKey& key) {
+        if constexpr (std::is_integral_v<TKey>) {
+            out.append(reinterpret_cast<const char*>(&key), sizeof(key));
+        }
+        else if constexpr (std::is_convertible_v<const TKey&, std::string_view>) {
+            std::string_view str = key;
+            appendKey(out, str.size());
+            out.append(str);
+        }
+        else {
+            std::apply([&out](const auto&... parts) { (appendKey(out, parts), ...); }, key);
+        }
+    }
+
     struct directoryEntryHash {
         size_t operator()(const std::filesystem::directory_entry& entry) const noexcept {
             return std::hash<std::filesystem::path>{}(entry.path());
         }
     };
 
-    inline uint64_t hashFromFileChunk(const std::filesystem::directory_entry& entry, std::size_t byteCount, bool fromStart = true)
+    inline uint64_t hashFromFileChunk(const std::filesystem::path& path, std::size_t byteCount, bool fromStart = true)
     {
-        if (!entry.is_regular_file())
-            throw std::invalid_argument("Not a regular file.");
-
-        std::ifstream file(entry.path(), std::ios::binary);
-        if (!file)
+        FileReader file(path);
+        if (!file.isOpen())
             throw std::runtime_error("Failed to open file.");
 
-        const std::uintmax_t file_size = entry.file_size();
-        if (file_size < byteCount)
-            byteCount = static_cast<std::int32_t>(file_size);
-
+        std::uint64_t offset = 0;
         if (!fromStart) {
-            file.seekg(-static_cast<std::streamoff>(byteCount), std::ios::end);
+            const std::int64_t fileSize = file.size();
+            if (fileSize < 0)
+                throw std::runtime_error("Failed to determine file size.");
+
+            if (static_cast<std::uintmax_t>(fileSize) < byteCount)
+                byteCount = static_cast<std::size_t>(fileSize);
+
+            offset = static_cast<std::uint64_t>(fileSize) - byteCount;
         }
 
-        std::vector<uint8_t> buffer(byteCount);
-        file.read(reinterpret_cast<char*>(buffer.data()), byteCount);
-        if (!file)
+        // Reading from the start needs no file size: a file shorter than byteCount simply yields fewer bytes.
+        auto buffer = ReadBuffers::get(0, byteCount);
+        auto bytesRead = file.readAt(buffer.data(), byteCount, offset);
+        if (bytesRead < 0)
             throw std::runtime_error("Failed to read file content.");
 
-        return XXH3_64bits(buffer.data(), byteCount);
+        return XXH3_64bits(buffer.data(), static_cast<std::size_t>(bytesRead));
+    }
+
+    // XXH3-64 of sampleCount blocks of blockSize bytes, spread evenly over the file (at fixed fractions of its size).
+    // Tells apart large files which only differ somewhere in the middle, at a fraction of the cost of a full read.
+    inline uint64_t hashSparseChunks(const std::filesystem::path& path, std::uintmax_t fileSize, std::size_t blockSize, std::size_t sampleCount)
+    {
+        FileReader file(path);
+        if (!file.isOpen())
+            throw std::runtime_error("Failed to open file.");
+
+        auto buffer = ReadBuffers::get(0, blockSize);
+        XXH3_state_t state;
+        XXH3_64bits_reset(&state);
+        for (std::size_t i = 1; i <= sampleCount; ++i) {
+            std::uintmax_t offset = fileSize / (sampleCount + 1) * i;
+            offset -= offset % blockSize;
+            auto bytesRead = file.readAt(buffer.data(), blockSize, offset);
+            if (bytesRead < 0)
+                throw std::runtime_error("Failed to read file content.");
+            XXH3_64bits_update(&state, buffer.data(), static_cast<std::size_t>(bytesRead)); // A short read at the end of the file is fine
+        }
+        return XXH3_64bits_digest(&state);
+    }
+
+    // Files larger than this are hashed as a tree: a digest per segment, and the digest of those, so the segments
+    // can be read in parallel. The digest of a file only depends on its content, never on how it was read,
+    // but changing this changes the digests of the larger files (see HashCache::version).
+    constexpr std::uint64_t treeSegmentSize = 64 << 20;
+
+    inline std::size_t treeSegmentCount(std::uint64_t fileSize) {
+        return static_cast<std::size_t>((fileSize + treeSegmentSize - 1) / treeSegmentSize);
+    }
+
+    // The root of the tree: the digests of the segments in order, seeded with the file size
+    inline XXH128_hash_t combineSegmentDigests(std::span<const XXH128_hash_t> segments, std::uint64_t fileSize)
+    {
+        XXH3_state_t state;
+        XXH3_128bits_reset_withSeed(&state, fileSize);
+        for (const auto& segment : segments) {
+            XXH128_canonical_t canonical;
+            XXH128_canonicalFromHash(&canonical, segment);
+            XXH3_128bits_update(&state, canonical.digest, sizeof(canonical.digest));
+        }
+        return XXH3_128bits_digest(&state);
+    }
+
+    // XXH3-128 of exactly length bytes of the file from offset
+    inline XXH128_hash_t hashFileRange(FileReader& file, std::uint64_t offset, std::uint64_t length, std::size_t bufferSize = ReadBuffers::getDefaultSize())
+    {
+        auto buffer = ReadBuffers::get(0, bufferSize);
+        XXH3_state_t state;
+        XXH3_128bits_reset(&state);
+        for (std::uint64_t end = offset + length; offset < end; ) {
+            const std::uint8_t* data = nullptr;
+            auto count = static_cast<std::size_t>(std::min<std::uint64_t>(bufferSize, end - offset));
+            auto bytesRead = file.viewAt(data, count, offset, buffer);
+            if (bytesRead < 0)
+                throw std::runtime_error("Failed to read file content.");
+            if (static_cast<std::size_t>(bytesRead) < count)
+                throw std::runtime_error("File shrank while being read.");
+            XXH3_128bits_update(&state, data, count);
+            offset += count;
+        }
+        return XXH3_128bits_digest(&state);
+    }
+
+    // XXH3-128 digest of the whole file content, read as a stream, or in segments as a tree if larger than one.
+    // Given a pool, the segments are spread over its workers.
+    inline XXH128_hash_t hashFile(const std::filesystem::path& path, WorkerPool* pool = nullptr, std::size_t bufferSize = ReadBuffers::getDefaultSize())
+    {
+        FileReader file(path);
+        if (!file.isOpen())
+            throw std::runtime_error("Failed to open file.");
+
+        auto fileSize = file.size();
+        if (fileSize > 0 && static_cast<std::uint64_t>(fileSize) > treeSegmentSize) {
+            auto size = static_cast<std::uint64_t>(fileSize);
+            std::vector<XXH128_hash_t> segments(treeSegmentCount(size));
+            std::atomic<bool> failed{ false };
+            // Runs on the workers as well, nothing may be thrown out of it
+            auto hashSegments = [&](std::size_t begin, std::size_t end) {
+                try {
+                    FileReader segmentFile(path);
+                    if (!segmentFile.isOpen())
+                        throw std::runtime_error("Failed to open file.");
+                    for (auto i = begin; i < end && !failed.load(std::memory_order_relaxed); ++i) {
+                        auto offset = i * treeSegmentSize;
+                        segments[i] = hashFileRange(segmentFile, offset, std::min(treeSegmentSize, size - offset), bufferSize);
+                    }
+                }
+                catch (const std::exception&) {
+                    failed.store(true);
+                }
+            };
+
+            if (pool)
+                pool->parallelFor(segments.size(), 1, hashSegments);
+            else
+                hashSegments(0, segments.size());
+            if (failed.load())
+                throw std::runtime_error("Failed to read file content.");
+            return combineSegmentDigests(segments, size);
+        }
+
+        auto buffer = ReadBuffers::get(0, bufferSize);
+        XXH3_state_t state;
+        XXH3_128bits_reset(&state);
+        while (true) {
+            const std::uint8_t* data;
+            auto bytesRead = file.next(data, bufferSize, buffer);
+            if (bytesRead < 0)
+                throw std::runtime_error("Failed to read file content.");
+            XXH3_128bits_update(&state, data, static_cast<std::size_t>(bytesRead));
+            if (static_cast<std::size_t>(bytesRead) < bufferSize)
+                break; // End of the file
+        }
+
+        return XXH3_128bits_digest(&state);
     }
 
-}
\ No newline at end of file
+}
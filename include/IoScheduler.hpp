@@ -0,0 +1,153 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "DeviceUtils.hpp"
+
+// Number of reads in flight per device, limited by device class: a spinning disk serving several threads at once
+// spends its time seeking, while solid state and network storage profit from parallel requests.
+// Not thread-safe, the owning queue calls it under its own lock.
+class DeviceSlots {
+public:
+    struct Limits {
+        int rotational{ 1 };
+        int solidState{ 0 }; // 0: no limit
+        int other{ 0 };
+    };
+
+    void setLimits(const Limits& newLimits) {
+        limits = newLimits;
+        for (auto& [device, state] : states) {
+            state.limit = limitOf(state.deviceClass);
+        }
+    }
+
+    bool hasCapacity(std::uint64_t device) {
+        auto& state = get(device);
+        return state.limit <= 0 || state.inFlight < state.limit;
+    }
+
+    void acquire(std::uint64_t device) {
+        ++get(device).inFlight;
+    }
+
+    void release(std::uint64_t device) {
+        auto& state = get(device);
+        if (state.inFlight > 0)
+            --state.inFlight;
+    }
+
+    bool isRotational(std::uint64_t device) {
+        return get(device).deviceClass == DeviceUtils::DeviceClass::Rotational;
+    }
+
+private:
+    struct State {
+        DeviceUtils::DeviceClass deviceClass;
+        int limit;
+        int inFlight{ 0 };
+    };
+
+    Limits limits;
+    std::unordered_map<std::uint64_t, State> states;
+
+    int limitOf(DeviceUtils::DeviceClass deviceClass) const {
+        switch (deviceClass) {
+        case DeviceUtils::DeviceClass::Rotational: return limits.rotational;
+        case DeviceUtils::DeviceClass::SolidState: return limits.solidState;
+        default: return limits.other;
+        }
+    }
+
+    State& get(std::uint64_t device) {
+        auto it = states.find(device);
+        if (it == states.end()) {
+            auto deviceClass = DeviceUtils::getDeviceClass(device);
+            it = states.emplace(device, State{ deviceClass, limitOf(deviceClass) }).first;
+        }
+        return it->second;
+    }
+};
+
+// Pending reads, queued per device. Devices are served round-robin within their concurrency limits.
+// On rotational devices the reads are ordered by physical offset and taken in one-directional sweeps (C-SCAN),
+// so the head moves across the disk instead of seeking back and forth between the files of the threads.
+// Not thread-safe, the owning queue calls it under its own lock.
+template<typename TValue>
+class IoScheduler {
+public:
+    void setLimits(const DeviceSlots::Limits& limits) {
+        slots.setLimits(limits);
+    }
+
+    void push(const TValue& value, std::uint64_t device, std::uint64_t physicalOffset) {
+        auto [it, inserted] = queues.try_emplace(device);
+        auto& queue = it->second;
+        if (inserted) {
+            queue.rotational = slots.isRotational(device);
+            devices.push_back(device);
+        }
+
+        if (queue.rotational)
+            queue.sweep.emplace(physicalOffset, value);
+        else
+            queue.fifo.push_back(value);
+        ++count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    // Takes the next read of a device with free capacity and occupies a slot of it, until release() is called.
+    bool tryPop(TValue& out) {
+        for (size_t i = 0; i < devices.size(); ++i) {
+            size_t index = (nextDevice + i) % devices.size();
+            std::uint64_t device = devices[index];
+            auto& queue = queues[device];
+            if ((queue.fifo.empty() && queue.sweep.empty()) || !slots.hasCapacity(device))
+                continue;
+
+            if (queue.rotational) {
+                auto it = queue.sweep.lower_bound(queue.head);
+                if (it == queue.sweep.end())
+                    it = queue.sweep.begin(); // Wrap around to the start of the disk
+                queue.head = it->first;
+                out = std::move(it->second);
+                queue.sweep.erase(it);
+            }
+            else {
+                out = std::move(queue.fifo.front());
+                queue.fifo.pop_front();
+            }
+
+            slots.acquire(device);
+            --count;
+            nextDevice = index + 1;
+            return true;
+        }
+        return false;
+    }
+
+    void release(std::uint64_t device) {
+        slots.release(device);
+    }
+
+private:
+    struct DeviceQueue {
+        bool rotational{ false };
+        std::uint64_t head{ 0 };
+        std::deque<TValue> fifo;
+        std::multimap<std::uint64_t, TValue> sweep;
+    };
+
+    DeviceSlots slots;
+    std::unordered_map<std::uint64_t, DeviceQueue> queues;
+    std::vector<std::uint64_t> devices;
+    size_t nextDevice{ 0 };
+    size_t count{ 0 };
+};
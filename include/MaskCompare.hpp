@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ANTSEEK_MASK_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define ANTSEEK_MASK_NEON 1
+#include <arm_neon.h>
+#endif
+
+// The same kernel is built for several instruction sets within one binary, each function enables its own
+#if defined(ANTSEEK_MASK_X86) && (defined(__GNUC__) || defined(__clang__))
+#define ANTSEEK_TARGET(isa) __attribute__((target(isa)))
+#else
+#define ANTSEEK_TARGET(isa)
+#endif
+
+// Compares data to a reference under a bit mask (bit i of mask[i / 64] set: byte i has to be equal), 64 bytes at a time.
+// Each kernel builds the 64-bit mask of the differing bytes of a block and tests it against the reference mask,
+// returning on the first block with a mismatch. Blocks without mask bits are not read.
+// The kernel is picked once for the running CPU, see get().
+namespace MaskCompare {
+
+    using Kernel = bool (*)(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size);
+
+    namespace detail {
+
+        // Bit i set for each differing byte i of the 8 bytes (SWAR)
+        inline std::uint64_t diffBits8(const std::uint8_t* a, const std::uint8_t* b) {
+            std::uint64_t x, y;
+            std::memcpy(&x, a, 8);
+            std::memcpy(&y, b, 8);
+            x ^= y;
+            constexpr std::uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+            std::uint64_t high = (((x & low7) + low7) | x) & ~low7; // Top bit of each nonzero byte
+            return ((high >> 7) * 0x0102040810204080ULL) >> 56; // The multiplication gathers byte k into bit 56 + k
+        }
+
+        inline std::uint64_t diffBitsScalar(const std::uint8_t* a, const std::uint8_t* b) {
+            std::uint64_t bits = 0;
+            for (unsigned w = 0; w < 8; ++w) {
+                bits |= diffBits8(a + 8 * w, b + 8 * w) << (8 * w);
+            }
+            return bits;
+        }
+
+        // The blocks of the reference are visited by every kernel the same way, diffBits(data, reference) of a full block.
+        // The last, partial block is copied to zero padded blocks first: the data may end right after the compared bytes.
+        template<typename TDiffBits>
+        inline bool compareBlocks(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size, TDiffBits&& diffBits) {
+            std::size_t fullBlocks = size >> 6;
+            for (std::size_t b = 0; b < fullBlocks; ++b) {
+                if (mask[b] != 0 && (diffBits(data + (b << 6), reference + (b << 6)) & mask[b]) != 0)
+                    return false;
+            }
+
+            std::size_t tail = size & 63;
+            if (tail == 0 || mask[fullBlocks] == 0)
+                return true;
+
+            alignas(64) std::uint8_t dataBlock[64]{};
+            alignas(64) std::uint8_t referenceBlock[64]{};
+            std::memcpy(dataBlock, data + (fullBlocks << 6), tail);
+            std::memcpy(referenceBlock, reference + (fullBlocks << 6), tail);
+            return (diffBits(dataBlock, referenceBlock) & mask[fullBlocks]) == 0;
+        }
+
+        inline bool compareScalar(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size) {
+            return compareBlocks(data, reference, mask, size, diffBitsScalar);
+        }
+
+#ifdef ANTSEEK_MASK_X86
+
+        ANTSEEK_TARGET("sse2")
+        inline std::uint64_t diffBitsSse2(const std::uint8_t* a, const std::uint8_t* b) {
+            std::uint64_t equal = 0;
+            for (unsigned i = 0; i < 4; ++i) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + 16 * i));
+                __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + 16 * i));
+                equal |= static_cast<std::uint64_t>(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)))) << (16 * i);
+            }
+            return ~equal;
+        }
+
+        ANTSEEK_TARGET("sse2")
+        inline bool compareSse2(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size) {
+            return compareBlocks(data, reference, mask, size, diffBitsSse2);
+        }
+
+        ANTSEEK_TARGET("avx2")
+        inline std::uint64_t diffBitsAvx2(const std::uint8_t* a, const std::uint8_t* b) {
+            __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+            __m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+            __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + 32));
+            __m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 32));
+            auto low = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0)));
+            auto high = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1)));
+            return ~((static_cast<std::uint64_t>(high) << 32) | low);
+        }
+
+        ANTSEEK_TARGET("avx2")
+        inline bool compareAvx2(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size) {
+            return compareBlocks(data, reference, mask, size, diffBitsAvx2);
+        }
+
+        // The tail is a masked load here, the bytes past the end are not touched
+        ANTSEEK_TARGET("avx512f,avx512bw")
+        inline bool compareAvx512(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size) {
+            std::size_t blocks = (size + 63) >> 6;
+            for (std::size_t b = 0; b < blocks; ++b) {
+                if (mask[b] == 0)
+                    continue;
+                std::size_t left = size - (b << 6);
+                __mmask64 load = (left >= 64) ? ~0ULL : ((1ULL << left) - 1);
+                __m512i x = _mm512_maskz_loadu_epi8(load, data + (b << 6));
+                __m512i y = _mm512_maskz_loadu_epi8(load, reference + (b << 6));
+                if ((_mm512_cmpneq_epi8_mask(x, y) & mask[b]) != 0)
+                    return false;
+            }
+            return true;
+        }
+
+        struct CpuFeatures {
+            bool avx2{ false };
+            bool avx512bw{ false };
+        };
+
+        // CPUID, and XGETBV for the register state saved by the OS
+        inline CpuFeatures detectCpu() {
+            CpuFeatures features;
+#ifdef _MSC_VER
+            int regs[4];
+            __cpuid(regs, 0);
+            if (regs[0] < 7)
+                return features;
+            __cpuid(regs, 1);
+            bool osxsave = (regs[2] & (1 << 27)) != 0;
+            bool avx = (regs[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx)
+                return features;
+            auto xcr0 = _xgetbv(0);
+            __cpuidex(regs, 7, 0);
+            features.avx2 = (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+            features.avx512bw = (xcr0 & 0xe6) == 0xe6 && (regs[1] & (1 << 16)) != 0 && (regs[1] & (1 << 30)) != 0;
+#else
+            __builtin_cpu_init();
+            features.avx2 = __builtin_cpu_supports("avx2");
+            features.avx512bw = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+            return features;
+        }
+
+#endif
+
+#ifdef ANTSEEK_MASK_NEON
+
+        // Per byte bit weights, the pairwise additions below gather 64 compare results into a 64-bit mask
+        inline std::uint64_t diffBitsNeon(const std::uint8_t* a, const std::uint8_t* b) {
+            static const std::uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+            uint8x16_t w = vld1q_u8(weights);
+            uint8x16_t t0 = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), w);
+            uint8x16_t t1 = vandq_u8(vceqq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)), w);
+            uint8x16_t t2 = vandq_u8(vceqq_u8(vld1q_u8(a + 32), vld1q_u8(b + 32)), w);
+            uint8x16_t t3 = vandq_u8(vceqq_u8(vld1q_u8(a + 48), vld1q_u8(b + 48)), w);
+            uint8x16_t sum = vpaddq_u8(vpaddq_u8(t0, t1), vpaddq_u8(t2, t3));
+            sum = vpaddq_u8(sum, sum);
+            return ~vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+        }
+
+        inline bool compareNeon(const std::uint8_t* data, const std::uint8_t* reference, const std::uint64_t* mask, std::size_t size) {
+            return compareBlocks(data, reference, mask, size, diffBitsNeon);
+        }
+
+#endif
+
+        inline Kernel select() {
+#ifdef ANTSEEK_MASK_X86
+            auto features = detectCpu();
+            if (features.avx512bw)
+                return compareAvx512;
+            if (features.avx2)
+                return compareAvx2;
+            return compareSse2;
+#elif defined(ANTSEEK_MASK_NEON)
+            return compareNeon;
+#else
+            return compareScalar;
+#endif
+        }
+    }
+
+    // The fastest kernel for the running CPU, selected on the first call
+    inline Kernel get() {
+        static const Kernel kernel = detail::select();
+        return kernel;
+    }
+}
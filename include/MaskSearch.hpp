@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+#include "MaskCompare.hpp"
+
+// Finds a reference with joker bytes (mask bit cleared) in data. The longest run of the reference without jokers is
+// the anchor: its occurrences are located first, with a Horspool skip table (or memchr for a very short anchor), and
+// the whole reference is compared under its mask only where the anchor matched. With an anchor of n bytes most of
+// the data is skipped up to n bytes at a time instead of being compared at every offset. The skips go by the last two
+// bytes under the anchor (a byte pair is much rarer than a byte in a long anchor, so the skips are longer).
+// Build it once per reference, the reference and the mask have to outlive it.
+class MaskSearcher {
+public:
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    // Below this anchor length the skips are too short to pay off, memchr for the first byte is faster
+    static constexpr std::size_t minSkipAnchor = 4;
+
+    // IMPORTANT: Bits in the last element of mask that correspond to positions beyond the end of 'reference' must NOT be set.
+    MaskSearcher(std::span<const std::uint8_t> reference, std::span<const std::uint64_t> mask)
+        : reference(reference), mask(mask), compare(MaskCompare::get()) {
+        findAnchor(reference.size(), mask, anchorOffset, anchorLength);
+
+        // Shift by the byte pair ending the window: to its last occurrence in the anchor (the final pair excluded)
+        if (anchorLength >= minSkipAnchor) {
+            const std::uint8_t* anchor = reference.data() + anchorOffset;
+            skip.assign(1 << 16, static_cast<std::uint32_t>(anchorLength - 1));
+            for (std::size_t i = 0; i + 2 < anchorLength; ++i) {
+                skip[pairAt(anchor + i)] = static_cast<std::uint32_t>(anchorLength - 2 - i);
+            }
+        }
+    }
+
+    // The longest run of set mask bits, length 0 if every byte is a joker
+    static void findAnchor(std::size_t size, std::span<const std::uint64_t> mask, std::size_t& offset, std::size_t& length) {
+        offset = 0;
+        length = 0;
+        std::size_t runStart = 0;
+        for (std::size_t i = 0; i <= size; ++i) {
+            bool masked = i < size && ((mask[i >> 6] >> (i & 63)) & 1);
+            if (masked)
+                continue;
+            if (i - runStart > length) {
+                offset = runStart;
+                length = i - runStart;
+            }
+            runStart = i + 1;
+        }
+    }
+
+    // Offset of the first match in the data, npos if there is none
+    std::size_t find(const std::uint8_t* data, std::size_t size) const {
+        const auto refSize = reference.size();
+        if (size < refSize)
+            return npos;
+        if (anchorLength == 0)
+            return 0; // Only jokers, matches anywhere
+
+        // Anchor positions in the data: the reference starts anchorOffset bytes before
+        std::size_t first = anchorOffset;
+        std::size_t last = size - refSize + anchorOffset;
+        const std::uint8_t* anchor = reference.data() + anchorOffset;
+
+        if (anchorLength < minSkipAnchor) {
+            std::size_t pos = first;
+            while (pos <= last) {
+                auto* hit = static_cast<const std::uint8_t*>(std::memchr(data + pos, anchor[0], last - pos + 1));
+                if (!hit)
+                    return npos;
+                pos = static_cast<std::size_t>(hit - data);
+                if (verify(data, pos - anchorOffset))
+                    return pos - anchorOffset;
+                ++pos;
+            }
+            return npos;
+        }
+
+        const std::uint32_t anchorLast = pairAt(anchor + anchorLength - 2);
+        std::size_t pos = first;
+        while (pos <= last) {
+            std::uint32_t pair = pairAt(data + pos + anchorLength - 2);
+            if (pair == anchorLast && std::memcmp(data + pos, anchor, anchorLength - 2) == 0 && verify(data, pos - anchorOffset))
+                return pos - anchorOffset;
+            pos += skip[pair];
+        }
+        return npos;
+    }
+
+private:
+    std::span<const std::uint8_t> reference;
+    std::span<const std::uint64_t> mask;
+    MaskCompare::Kernel compare;
+    std::size_t anchorOffset{ 0 };
+    std::size_t anchorLength{ 0 };
+    std::vector<std::uint32_t> skip;
+
+    static std::uint32_t pairAt(const std::uint8_t* p) {
+        return (static_cast<std::uint32_t>(p[0]) << 8) | p[1];
+    }
+
+    bool verify(const std::uint8_t* data, std::size_t start) const {
+        return compare(data + start, reference.data(), mask.data(), reference.size());
+    }
+};
@@ -0,0 +1,440 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <cerrno>
+#endif
+
+#if defined(__linux__) && defined(ANTSEEK_HAVE_IO_URING)
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "FileEntry.hpp"
+#include "DirectoryUtils.hpp"
+#include "WorkerPool.hpp"
+
+// Engines resolving the metadata (size, device, inode, mtime) of the matching files of one directory as a batch.
+// Sync issues one fstatat after the other, which is the cheapest choice on local disks. On high-latency mounts
+// (NFS, FUSE, ...) the batch engines keep many requests in flight, so the scan is no longer bound by latency * file count.
+namespace MetadataUtils {
+
+    namespace fs = std::filesystem;
+
+    enum class Engine {
+        Sync,
+        IoUring, // Falls back to ThreadPool when io_uring is not available
+        ThreadPool
+    };
+
+    struct Request {
+        const char* name{ nullptr }; // Relative to the directory, NUL terminated
+        FileEntry* file{ nullptr };
+        bool resolved{ false };
+    };
+
+#ifdef __linux__
+
+    inline void fromStat(const struct stat& st, FileEntry& file) {
+        file.size = static_cast<std::uintmax_t>(st.st_size);
+        file.device = static_cast<std::uint64_t>(st.st_dev);
+        file.inode = static_cast<std::uint64_t>(st.st_ino);
+        file.mtimeNs = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    inline bool statAt(int dirFd, Request& req) {
+        struct stat st;
+        if (::fstatat(dirFd, req.name, &st, 0) != 0)
+            return false;
+
+        fromStat(st, *req.file);
+        req.resolved = true;
+        return true;
+    }
+
+#endif
+
+    // Takes over the metadata the directory reader already had to query to classify the entry (symbolic links, DT_UNKNOWN).
+    inline bool fromEntry(const DirectoryUtils::Entry& entry, FileEntry& file) {
+#ifdef __linux__
+        if (entry.hasStat) {
+            fromStat(entry.st, file);
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // Queries the metadata of a single file by its full path. Returns false if it is not a regular file (anymore).
+    inline bool statFile(FileEntry& file) {
+#ifdef __linux__
+        struct stat st;
+        if (::stat(file.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            return false;
+
+        fromStat(st, file);
+        return true;
+#else
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(file.path, ec))
+            return false;
+
+        file.size = std::filesystem::file_size(file.path, ec);
+        return !ec;
+#endif
+    }
+
+    class Resolver {
+    public:
+        virtual ~Resolver() = default;
+
+        // Resolves every not yet resolved request of the directory. Requests which fail stay unresolved.
+        virtual void resolve(const DirectoryUtils::DirectoryReader& dir, std::span<Request> requests) = 0;
+    };
+
+    class SyncResolver : public Resolver {
+    public:
+        void resolve(const DirectoryUtils::DirectoryReader& dir, std::span<Request> requests) override {
+            for (auto& req : requests) {
+                if (req.resolved)
+                    continue;
+#ifdef __linux__
+                statAt(dir.fd(), req);
+#else
+                std::error_code ec;
+                req.file->size = fs::file_size(req.file->path, ec);
+                if (ec)
+                    continue;
+                req.file->mtimeNs = fs::last_write_time(req.file->path, ec).time_since_epoch() / std::chrono::nanoseconds(1);
+                req.resolved = !ec;
+#endif
+            }
+        }
+    };
+
+#ifdef __linux__
+
+    // Spreads the fstatat calls of a directory over a shared pool of helper threads.
+    class ThreadPoolResolver : public Resolver {
+    public:
+        explicit ThreadPoolResolver(WorkerPool& workerPool) : pool(workerPool) {}
+
+        void resolve(const DirectoryUtils::DirectoryReader& dir, std::span<Request> requests) override {
+            int dirFd = dir.fd();
+            pool.parallelFor(requests.size(), chunkSize, [dirFd, requests](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    if (!requests[i].resolved)
+                        statAt(dirFd, requests[i]);
+                }
+                });
+        }
+
+    private:
+        static constexpr size_t chunkSize = 8;
+        WorkerPool& pool;
+    };
+
+#endif
+
+#if defined(__linux__) && defined(ANTSEEK_HAVE_IO_URING)
+
+    // Minimal io_uring wrapper built directly on the syscalls, so no liburing is needed.
+    // A ring has a single submitter: every collector thread owns its own instance.
+    class IoUring {
+    public:
+        explicit IoUring(unsigned entries) {
+            io_uring_params params{};
+            fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "io_uring_setup failed");
+
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+            sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sqRing == MAP_FAILED) {
+                sqRing = nullptr;
+                release();
+                throw std::system_error(errno, std::generic_category(), "io_uring sq ring mmap failed");
+            }
+
+            if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                cqRing = sqRing;
+            }
+            else {
+                cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if (cqRing == MAP_FAILED) {
+                    cqRing = nullptr;
+                    release();
+                    throw std::system_error(errno, std::generic_category(), "io_uring cq ring mmap failed");
+                }
+            }
+
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqesMap = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqesMap == MAP_FAILED) {
+                release();
+                throw std::system_error(errno, std::generic_category(), "io_uring sqe mmap failed");
+            }
+            sqes = static_cast<io_uring_sqe*>(sqesMap);
+
+            auto* sq = static_cast<char*>(sqRing);
+            sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sqEntries = params.sq_entries;
+            sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+            auto* cq = static_cast<char*>(cqRing);
+            cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        }
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        ~IoUring() {
+            release();
+        }
+
+        unsigned capacity() const {
+            return sqEntries;
+        }
+
+        // Returns a cleared submission entry, or nullptr if the submission queue is full.
+        io_uring_sqe* getSqe() {
+            unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (sqLocalTail - head >= sqEntries)
+                return nullptr;
+
+            unsigned idx = sqLocalTail & sqMask;
+            sqArray[idx] = idx;
+            ++sqLocalTail;
+            ++unsubmitted;
+
+            io_uring_sqe* sqe = &sqes[idx];
+            std::memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        // Submits the prepared entries and waits until at least waitFor completions are available.
+        // Returns a negative errno value on failure.
+        int submitAndWait(unsigned waitFor) {
+            __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+            while (true) {
+                long ret = ::syscall(__NR_io_uring_enter, fd, unsubmitted, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+                if (ret >= 0) {
+                    unsubmitted -= static_cast<unsigned>(ret);
+                    return 0;
+                }
+                if (errno != EINTR)
+                    return -errno;
+            }
+        }
+
+        // Waits until at least waitFor completions are available, without submitting anything.
+        // Returns a negative errno value on failure.
+        int wait(unsigned waitFor) {
+            while (true) {
+                long ret = ::syscall(__NR_io_uring_enter, fd, 0u, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret >= 0)
+                    return 0;
+                if (errno != EINTR)
+                    return -errno;
+            }
+        }
+
+        // Calls fn(userData, result) for every available completion.
+        template<typename TFunc>
+        unsigned drain(TFunc&& fn) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            unsigned count = 0;
+            for (; head != tail; ++head, ++count) {
+                const io_uring_cqe& cqe = cqes[head & cqMask];
+                fn(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            completed += count;
+            return count;
+        }
+
+        // The entries taken by the kernel whose completions have not been drained yet: it may still write to their buffers
+        unsigned inKernel() const {
+            return __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) - completed;
+        }
+
+    private:
+        int fd{ -1 };
+        void* sqRing{ nullptr };
+        void* cqRing{ nullptr };
+        size_t sqRingSize{ 0 };
+        size_t cqRingSize{ 0 };
+        io_uring_sqe* sqes{ nullptr };
+        size_t sqesSize{ 0 };
+
+        unsigned* sqHead{ nullptr };
+        unsigned* sqTail{ nullptr };
+        unsigned* sqArray{ nullptr };
+        unsigned sqMask{ 0 };
+        unsigned sqEntries{ 0 };
+        unsigned sqLocalTail{ 0 };
+        unsigned unsubmitted{ 0 };
+        unsigned completed{ 0 }; // Counts along with the submission queue head
+
+        unsigned* cqHead{ nullptr };
+        unsigned* cqTail{ nullptr };
+        unsigned cqMask{ 0 };
+        io_uring_cqe* cqes{ nullptr };
+
+        void release() {
+            if (sqes)
+                ::munmap(sqes, sqesSize);
+            if (cqRing && cqRing != sqRing)
+                ::munmap(cqRing, cqRingSize);
+            if (sqRing)
+                ::munmap(sqRing, sqRingSize);
+            if (fd >= 0)
+                ::close(fd);
+            sqes = nullptr;
+            sqRing = cqRing = nullptr;
+            fd = -1;
+        }
+    };
+
+    // Submits statx for a whole directory's worth of files and keeps up to queueDepth of them in flight.
+    // Requests which the kernel rejects (e.g., no IORING_OP_STATX support) are retried with a plain fstatat.
+    class IoUringResolver : public Resolver {
+    public:
+        static constexpr unsigned queueDepth = 256;
+
+        IoUringResolver() : ring(queueDepth) {}
+
+        void resolve(const DirectoryUtils::DirectoryReader& dir, std::span<Request> requests) override {
+            int dirFd = dir.fd();
+            if (broken) {
+                fallback.resolve(dir, requests);
+                return;
+            }
+
+            if (statxBuffers.size() < requests.size())
+                statxBuffers.resize(requests.size());
+
+            auto complete = [&](std::uint64_t index, int res) {
+                auto& req = requests[index];
+                if (res == 0) {
+                    const auto& stx = statxBuffers[index];
+                    req.file->size = stx.stx_size;
+                    req.file->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+                    req.file->inode = stx.stx_ino;
+                    req.file->mtimeNs = static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+                    req.resolved = true;
+                }
+                else {
+                    statAt(dirFd, req);
+                }
+            };
+
+            size_t next = 0;
+            size_t inFlight = 0;
+            while (next < requests.size() || inFlight > 0) {
+                for (; next < requests.size() && inFlight < ring.capacity(); ++next) {
+                    if (requests[next].resolved)
+                        continue;
+
+                    io_uring_sqe* sqe = ring.getSqe();
+                    if (!sqe)
+                        break;
+
+                    sqe->opcode = IORING_OP_STATX;
+                    sqe->fd = dirFd;
+                    sqe->addr = reinterpret_cast<std::uint64_t>(requests[next].name);
+                    sqe->len = STATX_SIZE | STATX_INO | STATX_MTIME;
+                    sqe->off = reinterpret_cast<std::uint64_t>(&statxBuffers[next]);
+                    sqe->statx_flags = 0;
+                    sqe->user_data = next;
+                    ++inFlight;
+                }
+
+                if (inFlight == 0)
+                    break;
+
+                if (ring.submitAndWait(1) < 0) {
+                    // The ring is not used any more. The requests the kernel took still write into the statx buffers
+                    // and read the names, which the caller reuses after the return: they are reaped first.
+                    broken = true;
+                    while (ring.inKernel() > 0) {
+                        if (ring.drain(complete) == 0 && ring.wait(1) < 0)
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    fallback.resolve(dir, requests);
+                    return;
+                }
+
+                inFlight -= ring.drain(complete);
+            }
+        }
+
+    private:
+        IoUring ring;
+        std::vector<struct statx> statxBuffers;
+        SyncResolver fallback;
+        bool broken{ false };
+    };
+
+#endif
+
+    inline bool isIoUringAvailable() {
+#if defined(__linux__) && defined(ANTSEEK_HAVE_IO_URING)
+        try {
+            IoUring probe(1);
+            return true;
+        }
+        catch (const std::system_error&) {
+            return false;
+        }
+#else
+        return false;
+#endif
+    }
+
+    // Creates the resolver of one collector thread. The pool is only used by the ThreadPool engine.
+    inline std::unique_ptr<Resolver> createResolver(Engine engine, WorkerPool* pool) {
+        switch (engine) {
+#if defined(__linux__) && defined(ANTSEEK_HAVE_IO_URING)
+        case Engine::IoUring:
+            return std::make_unique<IoUringResolver>();
+#endif
+#ifdef __linux__
+        case Engine::ThreadPool:
+            if (pool)
+                return std::make_unique<ThreadPoolResolver>(*pool);
+            break;
+#endif
+        default:
+            break;
+        }
+        return std::make_unique<SyncResolver>();
+    }
+
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <span>
+#include <queue>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include "MaskCompare.hpp"
+#include "MaskSearch.hpp"
+
+// Finds any number of references with joker bytes in data in a single pass (Aho-Corasick). Each reference is looked
+// for by an anchor, the start of its longest run without jokers (at most maxAnchorLength bytes). The anchors of all
+// references make one automaton: a deterministic transition table, so each byte of the data costs one table lookup
+// whatever the number of references. Where an anchor ends, its references are compared under their masks.
+// Build it once for the references, their content and masks have to outlive it. The tables of a built searcher can be
+// stored, and a searcher made on them again without building (see ReferenceDb).
+class MultiMaskSearcher {
+public:
+    struct Pattern {
+        std::span<const std::uint8_t> data;
+        std::span<const std::uint64_t> mask;
+    };
+
+    struct Anchor {
+        std::uint64_t offset{ 0 };
+        std::uint64_t length{ 0 };
+    };
+
+    // Everything built from the patterns, these have to outlive a searcher made on them
+    struct Tables {
+        std::span<const Anchor> anchors;                    // Per pattern
+        std::span<const std::uint32_t> jokersOnly;          // Patterns without an anchor
+        std::span<const std::uint32_t> transitions;         // State * 256 + byte, outputFlag set if the state has outputs
+        std::span<const std::uint32_t> outputOffsets;       // Per state and one more: where its outputs start in outputPatterns
+        std::span<const std::uint32_t> outputPatterns;      // Patterns whose anchor ends in the state
+    };
+
+    // Keeps the table small (states * 256 entries): longer anchors rarely have more false hits
+    static constexpr std::size_t maxAnchorLength = 16;
+
+    // Tags the transitions to states with outputs
+    static constexpr std::uint32_t outputFlag = 0x80000000u;
+
+    // IMPORTANT: Bits in the last element of each mask that correspond to positions beyond the end of the data must NOT be set.
+    explicit MultiMaskSearcher(std::vector<Pattern> patternList)
+        : patterns(std::move(patternList)), compare(MaskCompare::get()) {
+        anchorStorage.resize(patterns.size());
+        std::vector<std::vector<std::uint32_t>> children(1, std::vector<std::uint32_t>(256, 0));
+        std::vector<std::vector<std::uint32_t>> outputs(1);
+
+        for (std::uint32_t p = 0; p < patterns.size(); ++p) {
+            auto& anchor = anchorStorage[p];
+            std::size_t offset, length;
+            MaskSearcher::findAnchor(patterns[p].data.size(), patterns[p].mask, offset, length);
+            anchor.offset = offset;
+            anchor.length = std::min(length, maxAnchorLength);
+            if (anchor.length == 0) {
+                jokersOnlyStorage.push_back(p);
+                continue;
+            }
+
+            // Trie of the anchors, 0 is the root and no state goes back to it by a trie edge
+            std::uint32_t state = 0;
+            for (std::size_t i = 0; i < anchor.length; ++i) {
+                auto c = patterns[p].data[anchor.offset + i];
+                if (children[state][c] == 0) {
+                    children[state][c] = static_cast<std::uint32_t>(children.size());
+                    children.emplace_back(256, 0);
+                    outputs.emplace_back();
+                }
+                state = children[state][c];
+            }
+            outputs[state].push_back(p);
+        }
+
+        // Breadth first: the failure state (longest proper suffix in the trie) is known for every shallower state,
+        // the missing transitions are taken from it, and its outputs are merged in
+        std::size_t stateCount = children.size();
+        auto& transitions = transitionStorage;
+        transitions.assign(stateCount * 256, 0);
+        std::vector<std::uint32_t> failure(stateCount, 0);
+        std::queue<std::uint32_t> queue;
+        for (unsigned c = 0; c < 256; ++c) {
+            auto child = children[0][c];
+            transitions[c] = child;
+            if (child != 0)
+                queue.push(child);
+        }
+        while (!queue.empty()) {
+            auto state = queue.front();
+            queue.pop();
+            const auto& fail = outputs[failure[state]];
+            outputs[state].insert(outputs[state].end(), fail.begin(), fail.end());
+
+            for (unsigned c = 0; c < 256; ++c) {
+                auto child = children[state][c];
+                auto next = transitions[static_cast<std::size_t>(failure[state]) * 256 + c];
+                if (child != 0) {
+                    failure[child] = next;
+                    transitions[static_cast<std::size_t>(state) * 256 + c] = child;
+                    queue.push(child);
+                }
+                else {
+                    transitions[static_cast<std::size_t>(state) * 256 + c] = next;
+                }
+            }
+        }
+
+        // The states with outputs are tagged in the transitions to them, the scan only looks at the outputs then
+        for (auto& next : transitions) {
+            if (!outputs[next].empty())
+                next |= outputFlag;
+        }
+
+        outputOffsetStorage.reserve(stateCount + 1);
+        for (const auto& output : outputs) {
+            outputOffsetStorage.push_back(static_cast<std::uint32_t>(outputPatternStorage.size()));
+            outputPatternStorage.insert(outputPatternStorage.end(), output.begin(), output.end());
+        }
+        outputOffsetStorage.push_back(static_cast<std::uint32_t>(outputPatternStorage.size()));
+
+        tables = { anchorStorage, jokersOnlyStorage, transitionStorage, outputOffsetStorage, outputPatternStorage };
+        setMaxSize();
+    }
+
+    // A searcher on tables built earlier for the same patterns
+    MultiMaskSearcher(std::vector<Pattern> patternList, const Tables& builtTables)
+        : patterns(std::move(patternList)), compare(MaskCompare::get()), tables(builtTables) {
+        setMaxSize();
+    }
+
+    MultiMaskSearcher(const MultiMaskSearcher&) = delete;
+    MultiMaskSearcher& operator=(const MultiMaskSearcher&) = delete;
+
+    const Tables& getTables() const {
+        return tables;
+    }
+
+    // The longest pattern, consecutive windows of the data have to overlap by one byte less than it
+    std::size_t getMaxSize() const {
+        return maxSize;
+    }
+
+    // Sets found[p] for each pattern p found in the data. Patterns already set are not looked for, the scan ends
+    // once all are set. Returns the number of patterns newly found.
+    size_t find(const std::uint8_t* data, std::size_t size, std::vector<char>& found) const {
+        size_t remaining = static_cast<size_t>(std::count(found.begin(), found.end(), 0));
+        size_t newlyFound = 0;
+        if (remaining == 0)
+            return 0;
+        auto setFound = [&](std::uint32_t p) {
+            found[p] = 1;
+            ++newlyFound;
+            return --remaining == 0;
+        };
+
+        for (auto p : tables.jokersOnly) {
+            if (!found[p] && patterns[p].data.size() <= size && setFound(p))
+                return newlyFound;
+        }
+
+        // Each step is a load depending on the previous one: the data is split in lanes scanned side by side, so the
+        // loads of the lanes overlap. A lane starts an anchor length early to catch the anchors ending in it.
+        std::size_t laneSize = size / laneCount;
+        std::size_t warmUp = maxAnchorLength - 1;
+        if (laneSize <= warmUp) {
+            scan(data, size, 0, size, found, setFound);
+            return newlyFound;
+        }
+
+        std::array<std::size_t, laneCount> positions;
+        std::array<std::uint32_t, laneCount> states{};
+        for (std::size_t lane = 0; lane < laneCount; ++lane) {
+            positions[lane] = (lane == 0) ? 0 : lane * laneSize - warmUp;
+        }
+        // The first lane has no warm-up, it runs on as far into the second one instead
+        const std::uint32_t* transitions = tables.transitions.data();
+        std::size_t steps = laneSize + warmUp;
+        for (std::size_t step = 0; step < steps; ++step) {
+            for (std::size_t lane = 0; lane < laneCount; ++lane) {
+                std::size_t i = positions[lane] + step;
+                auto next = transitions[static_cast<std::size_t>(states[lane]) * 256 + data[i]];
+                states[lane] = next & ~outputFlag;
+                if ((next & outputFlag) && checkOutputs(data, size, i, states[lane], found, setFound))
+                    return newlyFound;
+            }
+        }
+
+        // The rest of the last lane (size not a multiple of the lane count)
+        std::size_t tail = laneCount * laneSize;
+        if (tail < size) {
+            scan(data, size, tail, size, found, setFound, states[laneCount - 1]);
+        }
+        return newlyFound;
+    }
+
+private:
+    static constexpr std::size_t laneCount = 8;
+
+    std::vector<Pattern> patterns;
+    std::size_t maxSize{ 0 };
+    MaskCompare::Kernel compare;
+    Tables tables;
+
+    // The tables of a searcher built here
+    std::vector<Anchor> anchorStorage;
+    std::vector<std::uint32_t> jokersOnlyStorage;
+    std::vector<std::uint32_t> transitionStorage;
+    std::vector<std::uint32_t> outputOffsetStorage;
+    std::vector<std::uint32_t> outputPatternStorage;
+
+    void setMaxSize() {
+        for (const auto& pattern : patterns) {
+            maxSize = std::max(maxSize, pattern.data.size());
+        }
+    }
+
+    // Compares the patterns whose anchor ends at i in the state, true once every pattern is found
+    template<typename TSetFound>
+    bool checkOutputs(const std::uint8_t* data, std::size_t size, std::size_t i, std::uint32_t state, const std::vector<char>& found, TSetFound& setFound) const {
+        for (auto k = tables.outputOffsets[state]; k < tables.outputOffsets[state + 1]; ++k) {
+            auto p = tables.outputPatterns[k];
+            if (found[p])
+                continue;
+            const auto& anchor = tables.anchors[p];
+            std::size_t before = anchor.offset + anchor.length - 1;
+            if (i < before)
+                continue;
+            std::size_t start = i - before;
+            const auto& pattern = patterns[p];
+            if (start + pattern.data.size() > size)
+                continue; // Found in the next window
+            if (compare(data + start, pattern.data.data(), pattern.mask.data(), pattern.data.size()) && setFound(p))
+                return true;
+        }
+        return false;
+    }
+
+    // A single lane from begin to end
+    template<typename TSetFound>
+    void scan(const std::uint8_t* data, std::size_t size, std::size_t begin, std::size_t end, const std::vector<char>& found, TSetFound& setFound, std::uint32_t state = 0) const {
+        const std::uint32_t* transitions = tables.transitions.data();
+        for (std::size_t i = begin; i < end; ++i) {
+            auto next = transitions[static_cast<std::size_t>(state) * 256 + data[i]];
+            state = next & ~outputFlag;
+            if ((next & outputFlag) && checkOutputs(data, size, i, state, found, setFound))
+                return;
+        }
+    }
+};
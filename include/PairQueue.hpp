@@ -1,88 +1,143 @@
 #pragma once
 
 #include <vector>
-#include <deque>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_map>
-#include <unordered_set>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <algorithm>
+#include <span>
 
 #include "HashUtils.hpp"
+#include "IoScheduler.hpp"
+#include "FileTable.hpp"
 
-// PairQueue provides a mechanism to collect key/value pairs and generate all possible
-// pairwise combinations of values that share the same key.
-template<typename TValue>
+// PairQueue collects key/value pairs, and hands out the values sharing a key to be sorted into classes of equal content.
+// A bucket becomes a task once it is complete: a comparer takes a whole bucket and reads its files together (see
+// CompareUtils::compareGroup). With groups (see setGroupKey) a bucket is complete as soon as its group is, so the
+// comparers start while other files are still being hashed, otherwise all buckets wait for setFinished().
+// Buckets of a single value need no comparison and are dropped.
+// Tasks are handed out per device (see IoScheduler), and have to be returned with setProcessed() once done.
+// Files are passed by ID, names in the keys are views into the file table.
 class PairQueue {
 public:
-    template<typename TKey>
-    void push(TKey key, const TValue& value, bool justCollect = false) {
-        {
-            std::lock_guard lock(mtx);
-            auto& map = getMap<TKey>();
+    explicit PairQueue(const FileTable& fileTable) : table(fileTable) {}
 
-            if (!justCollect) {
-                auto range = map.equal_range(key);
-                for (auto it = range.first; it != range.second; ++it) {
-                    pairQueue.push_back({ value, it->second });
-                }
-            }
+    struct Bucket {
+        std::vector<FileId> files; // Guarded by the queue until it is scheduled
+        bool scheduled{ false };
+    };
+
+    struct Task {
+        Bucket* bucket{ nullptr };
+    };
+
+    void setDeviceLimits(const DeviceSlots::Limits& limits) {
+        std::lock_guard lock(mtx);
+        scheduler.setLimits(limits);
+    }
 
-            map.insert({ key, value });
+    // The files of a group share the key of the file queue (size and/or name), every key pushed has to include it.
+    // A group is complete once the collectors are done (setCollected) and each of its files has settled: been hashed
+    // for the last time, its value pushed or dropped (see settle). Its buckets can get no more values then.
+    void setGroupKey(bool bySize, bool byName) {
+        std::lock_guard lock(mtx);
+        grouping = true;
+        groupBySize = bySize;
+        groupByName = byName;
+    }
 
-            busy = false;
+    // Files handed to the hash stage by the collectors
+    void addToGroups(std::span<const FileId> files) {
+        std::lock_guard lock(mtx);
+        if (!grouping)
+            return;
+        for (auto file : files) {
+            ++groups[groupKey(file)].total;
         }
-        cv.notify_one();
     }
 
-    void pushPassthrough(const TValue& value) {
+    // count files of the group of file have settled (negative: some settled before are being hashed again)
+    void settle(FileId file, std::ptrdiff_t count = 1) {
+        bool scheduled = false;
         {
             std::lock_guard lock(mtx);
+            if (!grouping)
+                return;
+            auto& group = groups[groupKey(file)];
+            group.settled += count;
+            scheduled = collected && scheduleComplete(group);
+        }
+        if (scheduled)
+            cv.notify_all();
+    }
 
-            for (auto& e : files) {
-                pairQueue.push_back({ value, e });
+    // No more files will be added to the groups
+    void setCollected() {
+        bool scheduled = false;
+        {
+            std::lock_guard lock(mtx);
+            collected = true;
+            for (auto& [key, group] : groups) {
+                scheduled = scheduleComplete(group) || scheduled;
             }
-
-            files.push_back(value);
-            busy = false;
         }
-        cv.notify_one();
+        if (scheduled)
+            cv.notify_all();
     }
 
-    bool pop(std::pair<TValue, TValue>& out, std::stop_token stopToken) {
-        std::unique_lock lock(mtx);
+    // With justCollect the value is only recorded for buildGroupedList(), no content comparison is scheduled
+    template<typename TKey>
+    void push(TKey key, FileId value, bool justCollect = false) {
+        std::lock_guard lock(mtx);
+        if (justCollect) {
+            getMap<TKey>().insert({ key, value });
+            return;
+        }
 
-        while (true) {
-            cv.wait(lock, stopToken, [this] { return (!busy && (!pairQueue.empty() || finished)); });
+        // Keys are serialized, so all key types share one bucket map
+        std::string bucketKey;
+        HashUtils::appendKey(bucketKey, key);
+        auto& bucket = buckets[bucketKey];
+        if (grouping && bucket.files.empty()) {
+            groups[groupKey(value)].buckets.push_back(&bucket);
+        }
+        bucket.files.push_back(value);
+    }
 
-            if (pairQueue.empty() || stopToken.stop_requested()) {
-                return false;
-            }
+    void pushPassthrough(FileId value) {
+        std::lock_guard lock(mtx);
+        passthroughBucket.files.push_back(value);
+    }
 
-            for (auto it = pairQueue.begin(); it != pairQueue.end(); ++it) {
-                const auto& [a, b] = *it;
-                if (busyMainElements.count(a) == 0 && busyMainElements.count(b) == 0) {
-                    out = *it;
-                    busyMainElements.insert(a);
-                    pairQueue.erase(it);
-                    return true;
-                }
-            }
-            busy = true;
-        }
+    bool pop(Task& out, std::stop_token stopToken) {
+        std::unique_lock lock(mtx);
+        bool popped = false;
+        cv.wait(lock, stopToken, [&] { return (popped = scheduler.tryPop(out)) || (finished && scheduler.empty()); });
+        return popped && !stopToken.stop_requested();
     }
 
-    void setProcessed(const std::pair<TValue, TValue>& task) {
+    void setProcessed(const Task& task) {
         {
             std::lock_guard lock(mtx);
-            busyMainElements.erase(task.first);
-            busy = false;
+            scheduler.release(table.device(task.bucket->files.front()));
         }
-        cv.notify_all();
+        cv.notify_one();
     }
 
+    // No more values will be pushed: the buckets not scheduled yet are, the largest ones first
     void setFinished() {
         {
             std::lock_guard lock(mtx);
+            std::vector<Bucket*> complete;
+            for (auto& [key, bucket] : buckets) {
+                complete.push_back(&bucket);
+            }
+            complete.push_back(&passthroughBucket);
+            scheduleBuckets(complete);
             finished = true;
         }
         cv.notify_all();
@@ -114,42 +169,91 @@ public:
     }
 
 private:
-    std::vector<TValue> files;
-    std::unordered_multimap<std::uintmax_t, TValue> filesBySize;
-    std::unordered_multimap<std::string, TValue> filesByName;
-    std::unordered_multimap<std::pair<std::uintmax_t, std::string>, TValue, HashUtils::pairHash> filesBySizeAndName;
+    const FileTable& table;
+    std::unordered_map<std::string, Bucket> buckets; // By serialized key, node based so the buckets never move
+    Bucket passthroughBucket;
+    IoScheduler<Task> scheduler;
 
-    std::unordered_multimap<uint64_t, TValue> filesByHash;
-    std::unordered_multimap<std::pair<std::uintmax_t, uint64_t>, TValue, HashUtils::pairHash> filesBySizeAndHash;
-    std::unordered_multimap<std::pair<std::string, uint64_t>, TValue, HashUtils::pairHash> filesByNameAndHash;
-    std::unordered_multimap<std::tuple<std::uintmax_t, std::string, uint64_t>, TValue, HashUtils::tupleHash> filesBySizeAndNameAndHash;
+    std::unordered_multimap<std::uintmax_t, FileId> filesBySize;
+    std::unordered_multimap<std::string_view, FileId> filesByName;
+    std::unordered_multimap<std::pair<std::uintmax_t, std::string_view>, FileId, HashUtils::pairHash> filesBySizeAndName;
 
-    std::deque<std::pair<TValue, TValue>> pairQueue;
-    std::unordered_set<TValue> busyMainElements;
+    std::unordered_multimap<uint64_t, FileId> filesByHash;
+    std::unordered_multimap<std::pair<std::uintmax_t, uint64_t>, FileId, HashUtils::pairHash> filesBySizeAndHash;
+    std::unordered_multimap<std::pair<std::string_view, uint64_t>, FileId, HashUtils::pairHash> filesByNameAndHash;
+    std::unordered_multimap<std::tuple<std::uintmax_t, std::string_view, uint64_t>, FileId, HashUtils::tupleHash> filesBySizeAndNameAndHash;
+    std::unordered_multimap<std::string, FileId> filesBySerializedKey; // Keys of any shape, see HashUtils::appendKey
 
-    std::unordered_map<int, std::vector<TValue>> grouped;
+    std::unordered_map<int, std::vector<FileId>> grouped;
     std::unordered_map<std::uintmax_t, int> groupsBySize;
-    std::unordered_map<std::string, int> groupsByName;
-    std::unordered_map<std::pair<std::uintmax_t, std::string>, int, HashUtils::pairHash> groupsBySizeAndName;
+    std::unordered_map<std::string_view, int> groupsByName;
+    std::unordered_map<std::pair<std::uintmax_t, std::string_view>, int, HashUtils::pairHash> groupsBySizeAndName;
     std::unordered_map<uint64_t, int> groupsByHash;
     std::unordered_map<std::pair<std::uintmax_t, uint64_t>, int, HashUtils::pairHash> groupsBySizeAndHash;
-    std::unordered_map<std::pair<std::string, uint64_t>, int, HashUtils::pairHash> groupsByNameAndHash;
-    std::unordered_map<std::tuple<std::uintmax_t, std::string, uint64_t>, int, HashUtils::tupleHash> groupsBySizeAndNameAndHash;
+    std::unordered_map<std::pair<std::string_view, uint64_t>, int, HashUtils::pairHash> groupsByNameAndHash;
+    std::unordered_map<std::tuple<std::uintmax_t, std::string_view, uint64_t>, int, HashUtils::tupleHash> groupsBySizeAndNameAndHash;
+    std::unordered_map<std::string, int> groupsBySerializedKey;
+
+    struct Group {
+        size_t total{ 0 };
+        std::ptrdiff_t settled{ 0 };
+        std::vector<Bucket*> buckets;
+    };
+    std::unordered_map<std::string, Group> groups; // By serialized file queue key
+    bool grouping{ false };
+    bool groupBySize{ false };
+    bool groupByName{ false };
+    bool collected{ false };
 
     std::mutex mtx;
     std::condition_variable_any cv;
     bool finished{ false }; // Indicates that no more elements will be added, but some elements may still be processing
-    bool busy{ false }; // Indicates that each element pair in the queue has at least one member currently under processing.
+
+    std::string groupKey(FileId file) const {
+        std::string key;
+        if (groupBySize)
+            HashUtils::appendKey(key, table.size(file));
+        if (groupByName)
+            HashUtils::appendKey(key, table.name(file));
+        return key;
+    }
+
+    // Schedules the buckets of the group if it is complete, true if any was
+    bool scheduleComplete(Group& group) {
+        if (group.total == 0 || group.settled != static_cast<std::ptrdiff_t>(group.total) || group.buckets.empty())
+            return false;
+        bool any = scheduleBuckets(group.buckets);
+        group.buckets.clear();
+        return any;
+    }
+
+    // The buckets of more than one value not scheduled yet, the largest ones first
+    bool scheduleBuckets(std::span<Bucket* const> candidates) {
+        std::vector<Bucket*> complete;
+        for (auto* bucket : candidates) {
+            if (!bucket->scheduled && bucket->files.size() > 1)
+                complete.push_back(bucket);
+        }
+        std::sort(complete.begin(), complete.end(), [this](const Bucket* a, const Bucket* b) {
+            return table.size(a->files.front()) * a->files.size() > table.size(b->files.front()) * b->files.size();
+            });
+        for (auto* bucket : complete) {
+            bucket->scheduled = true;
+            auto first = bucket->files.front();
+            scheduler.push({ bucket }, table.device(first), table.physicalOffset(first));
+        }
+        return !complete.empty();
+    }
 
     template<typename TKey>
     auto& getMap() {
         if constexpr (std::is_same_v<TKey, std::uintmax_t>) {
             return filesBySize;
         }
-        else if constexpr (std::is_same_v<TKey, std::string>) {
+        else if constexpr (std::is_same_v<TKey, std::string_view>) {
             return filesByName;
         }
-        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string>>) {
+        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string_view>>) {
             return filesBySizeAndName;
         }
         else if constexpr (std::is_same_v<TKey, uint64_t>) {
@@ -158,12 +262,15 @@ private:
         else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, uint64_t>>) {
             return filesBySizeAndHash;
         }
-        else if constexpr (std::is_same_v<TKey, std::pair<std::string, uint64_t>>) {
+        else if constexpr (std::is_same_v<TKey, std::pair<std::string_view, uint64_t>>) {
             return filesByNameAndHash;
         }
-        else if constexpr (std::is_same_v<TKey, std::tuple<std::uintmax_t, std::string, uint64_t>>) {
+        else if constexpr (std::is_same_v<TKey, std::tuple<std::uintmax_t, std::string_view, uint64_t>>) {
             return filesBySizeAndNameAndHash;
         }
+        else if constexpr (std::is_same_v<TKey, std::string>) {
+            return filesBySerializedKey;
+        }
         else {
             static_assert(AlwaysFalse<TKey>::value, "Unsupported key type");
         }
@@ -174,10 +281,10 @@ private:
         if constexpr (std::is_same_v<TKey, std::uintmax_t>) {
             return groupsBySize;
         }
-        else if constexpr (std::is_same_v<TKey, std::string>) {
+        else if constexpr (std::is_same_v<TKey, std::string_view>) {
             return groupsByName;
         }
-        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string>>) {
+        else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, std::string_view>>) {
             return groupsBySizeAndName;
         }
         else if constexpr (std::is_same_v<TKey, uint64_t>) {
@@ -186,12 +293,15 @@ private:
         else if constexpr (std::is_same_v<TKey, std::pair<std::uintmax_t, uint64_t>>) {
             return groupsBySizeAndHash;
         }
-        else if constexpr (std::is_same_v<TKey, std::pair<std::string, uint64_t>>) {
+        else if constexpr (std::is_same_v<TKey, std::pair<std::string_view, uint64_t>>) {
             return groupsByNameAndHash;
         }
-        else if constexpr (std::is_same_v<TKey, std::tuple<std::uintmax_t, std::string, uint64_t>>) {
+        else if constexpr (std::is_same_v<TKey, std::tuple<std::uintmax_t, std::string_view, uint64_t>>) {
             return groupsBySizeAndNameAndHash;
         }
+        else if constexpr (std::is_same_v<TKey, std::string>) {
+            return groupsBySerializedKey;
+        }
         else {
             static_assert(AlwaysFalse<TKey>::value, "Unsupported key type");
         }
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <span>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+#include "MultiMaskSearch.hpp"
+
+// Compiled reference files: their content, joker masks and the tables of their searcher in one file, so that a scan
+// maps it and starts matching right away, instead of reading every reference and building the searcher again.
+// The file is mapped read-only and shared, concurrent scans with the same database share its pages in the page cache.
+// Layout: the header, then the sections it points to, each 64-byte aligned. Everything is in the byte order of the
+// machine which compiled it.
+class ReferenceDb {
+public:
+    struct Reference {
+        std::string_view path;
+        std::span<const std::uint8_t> data;
+        std::span<const std::uint64_t> mask;
+    };
+
+    // Writes the references and the tables of their searcher, to a temporary file first which then replaces the database
+    static void write(const std::filesystem::path& file, const std::vector<std::string>& paths,
+        const std::vector<MultiMaskSearcher::Pattern>& patterns, const MultiMaskSearcher::Tables& tables, std::span<const std::uint8_t> jokerBytes) {
+        auto tmpPath = file;
+        tmpPath += ".tmp";
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out)
+            throw std::runtime_error("Failed to create reference database: " + tmpPath.string());
+
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.referenceCount = static_cast<std::uint32_t>(patterns.size());
+        std::uint64_t offset = sizeof(Header);
+
+        // The records and paths go first, with the offsets of the content sections known up front
+        std::vector<Record> records(patterns.size());
+        std::string pathBlob;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            records[i].pathOffset = pathBlob.size();
+            records[i].pathLength = paths[i].size();
+            pathBlob += paths[i];
+        }
+        auto place = [&offset](Section& section, std::uint64_t count, std::uint64_t elementSize) {
+            offset = align(offset);
+            section = { offset, count };
+            offset += count * elementSize;
+        };
+        place(header.records, records.size(), sizeof(Record));
+        place(header.paths, pathBlob.size(), 1);
+        place(header.jokerBytes, jokerBytes.size(), 1);
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            offset = align(offset);
+            records[i].dataOffset = offset;
+            records[i].size = patterns[i].data.size();
+            offset += patterns[i].data.size();
+            offset = align(offset);
+            records[i].maskOffset = offset;
+            records[i].maskCount = patterns[i].mask.size();
+            offset += patterns[i].mask.size_bytes();
+        }
+        for (auto& record : records) {
+            record.pathOffset += header.paths.offset;
+        }
+        place(header.anchors, tables.anchors.size(), sizeof(MultiMaskSearcher::Anchor));
+        place(header.jokersOnly, tables.jokersOnly.size(), sizeof(std::uint32_t));
+        place(header.transitions, tables.transitions.size(), sizeof(std::uint32_t));
+        place(header.outputOffsets, tables.outputOffsets.size(), sizeof(std::uint32_t));
+        place(header.outputPatterns, tables.outputPatterns.size(), sizeof(std::uint32_t));
+        header.fileSize = offset;
+
+        std::uint64_t written = 0;
+        auto put = [&](const void* data, std::uint64_t size) {
+            static const char padding[sectionAlignment]{};
+            auto aligned = align(written);
+            out.write(padding, static_cast<std::streamsize>(aligned - written));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            written = aligned + size;
+        };
+        put(&header, sizeof(header));
+        put(records.data(), records.size() * sizeof(Record));
+        put(pathBlob.data(), pathBlob.size());
+        put(jokerBytes.data(), jokerBytes.size());
+        for (const auto& pattern : patterns) {
+            put(pattern.data.data(), pattern.data.size());
+            put(pattern.mask.data(), pattern.mask.size_bytes());
+        }
+        put(tables.anchors.data(), tables.anchors.size_bytes());
+        put(tables.jokersOnly.data(), tables.jokersOnly.size_bytes());
+        put(tables.transitions.data(), tables.transitions.size_bytes());
+        put(tables.outputOffsets.data(), tables.outputOffsets.size_bytes());
+        put(tables.outputPatterns.data(), tables.outputPatterns.size_bytes());
+
+        out.close();
+        std::error_code ec;
+        if (!out || written != header.fileSize) {
+            std::filesystem::remove(tmpPath, ec);
+            throw std::runtime_error("Failed to write reference database: " + tmpPath.string());
+        }
+        std::filesystem::rename(tmpPath, file, ec);
+        if (ec) {
+            std::filesystem::remove(tmpPath, ec);
+            throw std::runtime_error("Failed to replace reference database: " + file.string());
+        }
+    }
+
+    explicit ReferenceDb(const std::filesystem::path& file) {
+#ifdef _WIN32
+        throw std::runtime_error("The reference database is not supported on this platform");
+#else
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open reference database: " + file.string() + " (" + std::strerror(errno) + ")");
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+            ::close(fd);
+            throw std::runtime_error("Not a valid reference database: " + file.string());
+        }
+        void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("Failed to map reference database: " + file.string());
+
+        mapping = p;
+        mappingSize = static_cast<size_t>(st.st_size);
+        if (!load()) {
+            ::munmap(mapping, mappingSize);
+            throw std::runtime_error("Not a valid reference database (or of another version): " + file.string());
+        }
+#endif
+    }
+
+    ReferenceDb(const ReferenceDb&) = delete;
+    ReferenceDb& operator=(const ReferenceDb&) = delete;
+
+    ~ReferenceDb() {
+#ifndef _WIN32
+        if (mapping)
+            ::munmap(mapping, mappingSize);
+#endif
+    }
+
+    const std::vector<Reference>& getReferences() const {
+        return references;
+    }
+
+    // The joker bytes the masks were generated with
+    std::span<const std::uint8_t> getJokerBytes() const {
+        return jokerBytes;
+    }
+
+    const MultiMaskSearcher::Tables& getTables() const {
+        return tables;
+    }
+
+private:
+    static constexpr char magic[8] = { 'A', 'N', 'T', 'R', 'E', 'F', 'D', 'B' };
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::uint64_t sectionAlignment = 64;
+
+    struct Section {
+        std::uint64_t offset;
+        std::uint64_t count;
+    };
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t referenceCount;
+        std::uint64_t fileSize;
+        Section records;
+        Section paths;
+        Section jokerBytes;
+        Section anchors;
+        Section jokersOnly;
+        Section transitions;
+        Section outputOffsets;
+        Section outputPatterns;
+        std::uint8_t reserved[40];
+    };
+
+    struct Record {
+        std::uint64_t pathOffset;
+        std::uint64_t pathLength;
+        std::uint64_t dataOffset;
+        std::uint64_t size;
+        std::uint64_t maskOffset;
+        std::uint64_t maskCount;
+    };
+
+    static_assert(sizeof(Header) == 192);
+    static_assert(sizeof(Record) == 48);
+
+    void* mapping{ nullptr };
+    size_t mappingSize{ 0 };
+    std::vector<Reference> references;
+    std::span<const std::uint8_t> jokerBytes;
+    MultiMaskSearcher::Tables tables;
+
+    static std::uint64_t align(std::uint64_t offset) {
+        return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+    }
+
+    // A section as a span, if it lies within the file
+    template<typename T>
+    bool view(std::uint64_t offset, std::uint64_t count, std::span<const T>& out) const {
+        if (offset % alignof(T) != 0 || offset > mappingSize || count > (mappingSize - offset) / sizeof(T))
+            return false;
+        out = { reinterpret_cast<const T*>(static_cast<const char*>(mapping) + offset), static_cast<size_t>(count) };
+        return true;
+    }
+
+    template<typename T>
+    bool view(const Section& section, std::span<const T>& out) const {
+        return view(section.offset, section.count, out);
+    }
+
+    // Checks every offset against the file, and that the searcher tables refer to states and patterns which exist
+    bool load() {
+        const auto& header = *static_cast<const Header*>(mapping);
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version || header.fileSize != mappingSize)
+            return false;
+
+        std::span<const Record> records;
+        std::span<const char> paths;
+        if (!view(header.records, records) || records.size() != header.referenceCount || !view(header.paths, paths) ||
+            !view(header.jokerBytes, jokerBytes) || !view(header.anchors, tables.anchors) || !view(header.jokersOnly, tables.jokersOnly) ||
+            !view(header.transitions, tables.transitions) || !view(header.outputOffsets, tables.outputOffsets) ||
+            !view(header.outputPatterns, tables.outputPatterns))
+            return false;
+
+        for (const auto& record : records) {
+            Reference reference;
+            std::span<const char> path;
+            if (!view(record.pathOffset, record.pathLength, path) || !view(record.dataOffset, record.size, reference.data) ||
+                !view(record.maskOffset, record.maskCount, reference.mask) || reference.mask.size() < (record.size + 63) / 64)
+                return false;
+            reference.path = { path.data(), path.size() };
+            references.push_back(reference);
+        }
+
+        size_t stateCount = tables.transitions.size() / 256;
+        if (tables.anchors.size() != references.size() || stateCount == 0 || tables.transitions.size() % 256 != 0 ||
+            tables.outputOffsets.size() != stateCount + 1 || tables.outputOffsets.back() != tables.outputPatterns.size())
+            return false;
+        for (auto next : tables.transitions) {
+            if ((next & ~MultiMaskSearcher::outputFlag) >= stateCount)
+                return false;
+        }
+        for (size_t state = 0; state < stateCount; ++state) {
+            if (tables.outputOffsets[state] > tables.outputOffsets[state + 1])
+                return false;
+        }
+        for (auto pattern : tables.outputPatterns) {
+            if (pattern >= references.size())
+                return false;
+        }
+        for (auto pattern : tables.jokersOnly) {
+            if (pattern >= references.size())
+                return false;
+        }
+        for (size_t i = 0; i < references.size(); ++i) {
+            const auto& anchor = tables.anchors[i];
+            auto size = references[i].data.size();
+            if (anchor.length > MultiMaskSearcher::maxAnchorLength || anchor.offset > size || anchor.length > size - anchor.offset)
+                return false;
+        }
+        return true;
+    }
+};
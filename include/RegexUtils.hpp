@@ -1,18 +1,724 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <regex>
+#include <bitset>
+#include <map>
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <cstdint>
 
 namespace RegexUtils {
 
-    inline bool matchesAnyPattern(const std::string& input, const std::vector<std::regex>& patterns) {
-        for (const auto& p : patterns) {
-            if (std::regex_match(input, p)) {
+    namespace detail {
+
+        using ByteSet = std::bitset<256>;
+
+        struct Node {
+            enum class Type { Set, Concat, Alternation, Repeat, AssertBegin, AssertEnd } type{ Type::Concat };
+            ByteSet set;
+            std::vector<Node> children;
+            int min{ 0 };
+            int max{ 0 }; // -1: unbounded
+
+            Node() = default;
+            Node(Type type, const ByteSet& set = {}) : type(type), set(set) {}
+        };
+
+        inline ByteSet anyByteButNewline() {
+            ByteSet set;
+            set.set();
+            set.reset('\n');
+            set.reset('\r');
+            return set;
+        }
+
+        // Parser for the subset of the ECMAScript grammar (the std::regex default) that describes regular languages.
+        // Anything else (back references, lookaheads, word boundaries, POSIX classes, ...) makes parse() return nothing,
+        // such patterns are left to std::regex. The pattern is expected to be accepted by std::regex already.
+        class Parser {
+        public:
+            explicit Parser(std::string_view pattern) : p(pattern) {}
+
+            std::optional<Node> parse() {
+                Node node;
+                if (!parseDisjunction(node) || pos != p.size())
+                    return std::nullopt;
+                return node;
+            }
+
+        private:
+            static constexpr int maxRepeatCount = 256;
+
+            std::string_view p;
+            size_t pos{ 0 };
+
+            bool atEnd() const {
+                return pos >= p.size();
+            }
+
+            bool isQuantifierStart() const {
+                return !atEnd() && (p[pos] == '*' || p[pos] == '+' || p[pos] == '?' || p[pos] == '{');
+            }
+
+            bool parseDisjunction(Node& out) {
+                Node alternation{ Node::Type::Alternation };
+                while (true) {
+                    Node sequence{ Node::Type::Concat };
+                    if (!parseAlternative(sequence))
+                        return false;
+                    alternation.children.push_back(std::move(sequence));
+                    if (atEnd() || p[pos] != '|')
+                        break;
+                    ++pos;
+                }
+
+                if (alternation.children.size() == 1)
+                    out = std::move(alternation.children.front());
+                else
+                    out = std::move(alternation);
                 return true;
             }
-        }
-        return false;
+
+            bool parseAlternative(Node& sequence) {
+                while (!atEnd() && p[pos] != '|' && p[pos] != ')') {
+                    if (p[pos] == '^' || p[pos] == '$') {
+                        sequence.children.push_back(Node{ p[pos] == '^' ? Node::Type::AssertBegin : Node::Type::AssertEnd });
+                        ++pos;
+                        if (isQuantifierStart())
+                            return false;
+                        continue;
+                    }
+
+                    Node atom;
+                    if (!parseAtom(atom) || !parseQuantifier(atom))
+                        return false;
+                    sequence.children.push_back(std::move(atom));
+                }
+                return true;
+            }
+
+            bool parseAtom(Node& atom) {
+                char c = p[pos++];
+                switch (c) {
+                case '.':
+                    atom = Node{ Node::Type::Set, anyByteButNewline() };
+                    return true;
+                case '(':
+                    if (p.substr(pos, 2) == "?:")
+                        pos += 2;
+                    else if (!atEnd() && p[pos] == '?')
+                        return false; // Lookahead
+                    if (!parseDisjunction(atom) || atEnd() || p[pos] != ')')
+                        return false;
+                    ++pos;
+                    return true;
+                case '[':
+                    atom.type = Node::Type::Set;
+                    return parseClass(atom.set);
+                case '\\':
+                    atom.type = Node::Type::Set;
+                    return parseEscape(atom.set);
+                case ')':
+                case '*':
+                case '+':
+                case '?':
+                case '{':
+                case '|':
+                    return false;
+                default:
+                    atom.type = Node::Type::Set;
+                    atom.set.set(static_cast<unsigned char>(c));
+                    return true;
+                }
+            }
+
+            bool parseNumber(int& out) {
+                size_t start = pos;
+                out = 0;
+                while (!atEnd() && p[pos] >= '0' && p[pos] <= '9' && out <= maxRepeatCount) {
+                    out = out * 10 + (p[pos++] - '0');
+                }
+                return pos != start && out <= maxRepeatCount;
+            }
+
+            bool parseQuantifier(Node& atom) {
+                if (!isQuantifierStart())
+                    return true;
+
+                int min = 0;
+                int max = -1;
+                switch (p[pos++]) {
+                case '*':
+                    break;
+                case '+':
+                    min = 1;
+                    break;
+                case '?':
+                    max = 1;
+                    break;
+                default: // '{'
+                    if (!parseNumber(min))
+                        return false;
+                    max = min;
+                    if (!atEnd() && p[pos] == ',') {
+                        ++pos;
+                        max = -1;
+                        if (!atEnd() && p[pos] != '}' && !parseNumber(max))
+                            return false;
+                    }
+                    if (atEnd() || p[pos] != '}' || (max >= 0 && max < min))
+                        return false;
+                    ++pos;
+                    break;
+                }
+
+                // Lazy quantifiers describe the same language, which is all a full match cares about
+                if (!atEnd() && p[pos] == '?')
+                    ++pos;
+                if (isQuantifierStart())
+                    return false;
+
+                Node repeat{ Node::Type::Repeat };
+                repeat.min = min;
+                repeat.max = max;
+                repeat.children.push_back(std::move(atom));
+                atom = std::move(repeat);
+                return true;
+            }
+
+            static ByteSet rangeSet(unsigned char first, unsigned char last) {
+                ByteSet set;
+                for (int c = first; c <= last; ++c) {
+                    set.set(c);
+                }
+                return set;
+            }
+
+            static ByteSet spaceSet() {
+                ByteSet set;
+                for (char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+                    set.set(static_cast<unsigned char>(c));
+                }
+                return set;
+            }
+
+            static ByteSet wordSet() {
+                ByteSet set = rangeSet('a', 'z') | rangeSet('A', 'Z') | rangeSet('0', '9');
+                set.set('_');
+                return set;
+            }
+
+            static int hexValue(char c) {
+                if (c >= '0' && c <= '9') return c - '0';
+                if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+                return -1;
+            }
+
+            bool parseEscape(ByteSet& set) {
+                if (atEnd())
+                    return false;
+
+                char c = p[pos++];
+                switch (c) {
+                case 'd': set |= rangeSet('0', '9'); return true;
+                case 'D': set |= ~rangeSet('0', '9'); return true;
+                case 'w': set |= wordSet(); return true;
+                case 'W': set |= ~wordSet(); return true;
+                case 's': set |= spaceSet(); return true;
+                case 'S': set |= ~spaceSet(); return true;
+                case 'n': set.set('\n'); return true;
+                case 'r': set.set('\r'); return true;
+                case 't': set.set('\t'); return true;
+                case 'f': set.set('\f'); return true;
+                case 'v': set.set('\v'); return true;
+                case '0':
+                    if (!atEnd() && p[pos] >= '0' && p[pos] <= '9')
+                        return false;
+                    set.set(0);
+                    return true;
+                case 'x':
+                    {
+                        if (pos + 2 > p.size() || hexValue(p[pos]) < 0 || hexValue(p[pos + 1]) < 0)
+                            return false;
+                        set.set(static_cast<size_t>(hexValue(p[pos]) * 16 + hexValue(p[pos + 1])));
+                        pos += 2;
+                        return true;
+                    }
+                default:
+                    // Other letters and digits are back references, word boundaries, \c, \u, ...
+                    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+                        return false;
+                    set.set(static_cast<unsigned char>(c));
+                    return true;
+                }
+            }
+
+            // A single class member, with its character if it is a single one (-1 otherwise)
+            bool parseClassAtom(ByteSet& set, int& single) {
+                if (atEnd())
+                    return false;
+
+                if (p[pos] == '\\') {
+                    ++pos;
+                    if (!parseEscape(set))
+                        return false;
+                }
+                else {
+                    if (p[pos] == '[' && pos + 1 < p.size() && (p[pos + 1] == ':' || p[pos + 1] == '.' || p[pos + 1] == '='))
+                        return false; // POSIX class, collating element or equivalence class
+                    set.set(static_cast<unsigned char>(p[pos++]));
+                }
+
+                single = -1;
+                if (set.count() == 1) {
+                    for (int c = 0; c < 256; ++c) {
+                        if (set.test(c)) single = c;
+                    }
+                }
+                return true;
+            }
+
+            bool parseClass(ByteSet& set) {
+                bool negate = !atEnd() && p[pos] == '^';
+                if (negate)
+                    ++pos;
+                if (atEnd() || p[pos] == ']')
+                    return false; // Empty class, or a leading ']', which engines treat differently
+
+                while (true) {
+                    if (atEnd())
+                        return false;
+                    if (p[pos] == ']') {
+                        ++pos;
+                        break;
+                    }
+
+                    ByteSet first;
+                    int firstChar;
+                    if (!parseClassAtom(first, firstChar))
+                        return false;
+
+                    if (pos + 1 < p.size() && p[pos] == '-' && p[pos + 1] != ']') {
+                        ++pos;
+                        ByteSet last;
+                        int lastChar;
+                        if (!parseClassAtom(last, lastChar))
+                            return false;
+                        // std::regex compares range bounds as (signed) char, only ASCII ranges agree with byte ranges
+                        if (firstChar < 0 || lastChar < 0 || firstChar > lastChar || lastChar >= 0x80)
+                            return false;
+                        set |= rangeSet(static_cast<unsigned char>(firstChar), static_cast<unsigned char>(lastChar));
+                    }
+                    else {
+                        set |= first;
+                    }
+                }
+
+                if (negate)
+                    set.flip();
+                return true;
+            }
+        };
+
+        // Thompson NFA of one or more patterns, all leading to a single match state.
+        class Nfa {
+        public:
+            struct State {
+                enum class Kind { Set, Split, AssertBegin, AssertEnd, Match } kind;
+                int set{ -1 };
+                int out{ -1 };
+                std::vector<int> outs; // Split only
+
+                State(Kind kind, int set = -1, int out = -1, std::vector<int> outs = {}) : kind(kind), set(set), out(out), outs(std::move(outs)) {}
+            };
+
+            std::vector<State> states;
+            std::vector<ByteSet> sets;
+            int start{ -1 };
+
+            // Returns false if the automaton would get too large (large bounded repeats)
+            bool build(const std::vector<const Node*>& patterns) {
+                int match = add({ State::Kind::Match });
+                State split{ State::Kind::Split };
+                for (const auto* node : patterns) {
+                    int s = emit(*node, match);
+                    if (s < 0)
+                        return false;
+                    split.outs.push_back(s);
+                }
+                start = add(std::move(split));
+                return start >= 0;
+            }
+
+        private:
+            static constexpr size_t maxStates = 8192;
+
+            int add(State state) {
+                if (states.size() >= maxStates)
+                    return -1;
+                states.push_back(std::move(state));
+                return static_cast<int>(states.size() - 1);
+            }
+
+            // Emits the states of the node, leading to next, and returns its entry state
+            int emit(const Node& node, int next) {
+                if (next < 0)
+                    return -1;
+
+                switch (node.type) {
+                case Node::Type::Set:
+                    sets.push_back(node.set);
+                    return add({ State::Kind::Set, static_cast<int>(sets.size() - 1), next });
+                case Node::Type::Concat:
+                    for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
+                        next = emit(*it, next);
+                    }
+                    return next;
+                case Node::Type::Alternation:
+                    {
+                        State split{ State::Kind::Split };
+                        for (const auto& child : node.children) {
+                            int s = emit(child, next);
+                            if (s < 0)
+                                return -1;
+                            split.outs.push_back(s);
+                        }
+                        return add(std::move(split));
+                    }
+                case Node::Type::AssertBegin:
+                    return add({ State::Kind::AssertBegin, -1, next });
+                case Node::Type::AssertEnd:
+                    return add({ State::Kind::AssertEnd, -1, next });
+                case Node::Type::Repeat:
+                    {
+                        const Node& child = node.children.front();
+                        int current = next;
+                        if (node.max < 0) {
+                            int loop = add({ State::Kind::Split });
+                            int body = emit(child, loop);
+                            if (body < 0)
+                                return -1;
+                            states[loop].outs = { body, next };
+                            current = loop;
+                        }
+                        else {
+                            for (int i = node.min; i < node.max && current >= 0; ++i) {
+                                int body = emit(child, current);
+                                current = (body < 0) ? -1 : add({ State::Kind::Split, -1, -1, { body, next } });
+                            }
+                        }
+                        for (int i = 0; i < node.min && current >= 0; ++i) {
+                            current = emit(child, current);
+                        }
+                        return current;
+                    }
+                }
+                return -1;
+            }
+        };
+
+        // Table driven DFA built from the NFA by subset construction, over classes of equivalent bytes.
+        class Dfa {
+        public:
+            // Returns nothing if the DFA would exceed maxStates
+            static std::optional<Dfa> build(const Nfa& nfa, size_t maxStates) {
+                Dfa dfa;
+                dfa.computeByteClasses(nfa);
+
+                std::map<std::pair<std::vector<int>, bool>, uint32_t> ids;
+                std::vector<std::vector<int>> pending;
+
+                // State 0 is the dead state
+                ids[{ {}, false }] = 0;
+                dfa.accepting.push_back(false);
+                dfa.table.resize(dfa.classCount, 0);
+
+                auto stateOf = [&](std::vector<int> seeds, bool atStart) -> std::optional<uint32_t> {
+                    auto [set, accept] = closure(nfa, seeds, atStart);
+                    auto [it, inserted] = ids.try_emplace({ set, accept }, static_cast<uint32_t>(dfa.accepting.size()));
+                    if (inserted) {
+                        if (dfa.accepting.size() >= maxStates)
+                            return std::nullopt;
+                        dfa.accepting.push_back(accept);
+                        dfa.table.resize(dfa.table.size() + dfa.classCount, 0);
+                        pending.push_back(std::move(set));
+                    }
+                    return it->second;
+                };
+
+                auto start = stateOf({ nfa.start }, true);
+                if (!start)
+                    return std::nullopt;
+                dfa.start = *start;
+
+                // States are numbered in the order they are queued, so pending[i] is state i + 1
+                for (size_t i = 0; i < pending.size(); ++i) {
+                    uint32_t id = static_cast<uint32_t>(i + 1);
+                    for (int cls = 0; cls < dfa.classCount; ++cls) {
+                        unsigned char byte = dfa.representative[cls];
+                        std::vector<int> seeds;
+                        for (int s : pending[i]) {
+                            if (nfa.sets[nfa.states[s].set].test(byte))
+                                seeds.push_back(nfa.states[s].out);
+                        }
+                        if (seeds.empty())
+                            continue;
+
+                        auto target = stateOf(std::move(seeds), false);
+                        if (!target)
+                            return std::nullopt;
+                        dfa.table[id * dfa.classCount + cls] = *target;
+                    }
+                }
+                return dfa;
+            }
+
+            bool matches(std::string_view input) const {
+                uint32_t state = start;
+                for (unsigned char c : input) {
+                    state = table[state * classCount + byteClass[c]];
+                    if (state == 0)
+                        return false;
+                }
+                return accepting[state];
+            }
+
+        private:
+            uint8_t byteClass[256]{};
+            unsigned char representative[256]{};
+            int classCount{ 1 };
+            std::vector<uint32_t> table;
+            std::vector<bool> accepting;
+            uint32_t start{ 0 };
+
+            // Bytes which every set of the NFA treats alike share a class
+            void computeByteClasses(const Nfa& nfa) {
+                int classes[256]{};
+                for (const auto& set : nfa.sets) {
+                    std::map<std::pair<int, bool>, int> split;
+                    for (int c = 0; c < 256; ++c) {
+                        classes[c] = split.try_emplace({ classes[c], set.test(c) }, static_cast<int>(split.size())).first->second;
+                    }
+                }
+
+                classCount = 0;
+                for (int c = 255; c >= 0; --c) {
+                    classCount = std::max(classCount, classes[c] + 1);
+                    byteClass[c] = static_cast<uint8_t>(classes[c]);
+                    representative[classes[c]] = static_cast<unsigned char>(c);
+                }
+            }
+
+            // The consuming states reachable without input, and whether the match state is reachable at the end of the input
+            static std::pair<std::vector<int>, bool> closure(const Nfa& nfa, const std::vector<int>& seeds, bool atStart) {
+                std::vector<int> set;
+                bool accept = false;
+                std::vector<uint8_t> visited(nfa.states.size() * 2, 0);
+                std::vector<std::pair<int, bool>> stack; // State, and whether the end of input was asserted on the way
+                for (int s : seeds) {
+                    stack.emplace_back(s, false);
+                }
+
+                while (!stack.empty()) {
+                    auto [s, pastEnd] = stack.back();
+                    stack.pop_back();
+                    auto& seen = visited[s * 2 + (pastEnd ? 1 : 0)];
+                    if (seen)
+                        continue;
+                    seen = 1;
+
+                    const auto& state = nfa.states[s];
+                    switch (state.kind) {
+                    case Nfa::State::Kind::Set:
+                        if (!pastEnd)
+                            set.push_back(s);
+                        break;
+                    case Nfa::State::Kind::Split:
+                        for (int out : state.outs) {
+                            stack.emplace_back(out, pastEnd);
+                        }
+                        break;
+                    case Nfa::State::Kind::AssertBegin:
+                        if (atStart)
+                            stack.emplace_back(state.out, pastEnd);
+                        break;
+                    case Nfa::State::Kind::AssertEnd:
+                        stack.emplace_back(state.out, true);
+                        break;
+                    case Nfa::State::Kind::Match:
+                        accept = true;
+                        break;
+                    }
+                }
+
+                std::sort(set.begin(), set.end());
+                return { std::move(set), accept };
+            }
+        };
+
     }
 
-}
\ No newline at end of file
+    // Matches filenames against a set of regular expressions (ECMAScript syntax, full match), like std::regex_match
+    // over each of them, but in a single pass over the name:
+    //  - literal patterns, and literals with a leading or trailing ".*" (e.g., ".*\.jpg$") are compared directly,
+    //  - all other regular patterns are combined into one DFA,
+    //  - only patterns using non-regular constructs (back references, lookaheads, ...) run through std::regex.
+    class FilenameMatcher {
+    public:
+        FilenameMatcher() = default;
+
+        explicit FilenameMatcher(const std::vector<std::string>& patterns) {
+            std::vector<detail::Node> nodes;
+            std::vector<std::regex> nodeRegexes;
+
+            for (const auto& pattern : patterns) {
+                std::regex regex;
+                try {
+                    regex.assign(pattern);
+                }
+                catch (const std::regex_error&) {
+                    throw std::runtime_error("Invalid regex pattern: " + pattern);
+                }
+
+                auto node = detail::Parser(pattern).parse();
+                if (!node) {
+                    fallbacks.push_back(std::move(regex));
+                }
+                else if (auto literal = toLiteral(*node)) {
+                    literals.push_back(std::move(*literal));
+                }
+                else {
+                    nodes.push_back(std::move(*node));
+                    nodeRegexes.push_back(std::move(regex));
+                }
+            }
+
+            if (nodes.empty())
+                return;
+
+            // One automaton for all patterns if it stays small, otherwise one per pattern
+            std::vector<const detail::Node*> all;
+            for (const auto& node : nodes) {
+                all.push_back(&node);
+            }
+            if (auto dfa = buildDfa(all)) {
+                dfas.push_back(std::move(*dfa));
+                return;
+            }
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (auto dfa = buildDfa({ &nodes[i] }))
+                    dfas.push_back(std::move(*dfa));
+                else
+                    fallbacks.push_back(std::move(nodeRegexes[i]));
+            }
+        }
+
+        bool matches(std::string_view name) const {
+            for (const auto& literal : literals) {
+                if (literal.matches(name))
+                    return true;
+            }
+            for (const auto& dfa : dfas) {
+                if (dfa.matches(name))
+                    return true;
+            }
+            for (const auto& regex : fallbacks) {
+                if (std::regex_match(name.begin(), name.end(), regex))
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        static constexpr size_t maxDfaStates = 4096;
+
+        struct Literal {
+            enum class Kind { Exact, Prefix, Suffix } kind;
+            std::string text;
+
+            bool matches(std::string_view name) const {
+                if (name.size() < text.size())
+                    return false;
+                switch (kind) {
+                case Kind::Exact:
+                    return name == text;
+                case Kind::Prefix:
+                    return name.starts_with(text) && !hasNewline(name.substr(text.size()));
+                case Kind::Suffix:
+                    return name.ends_with(text) && !hasNewline(name.substr(0, name.size() - text.size()));
+                }
+                return false;
+            }
+
+            // What the ".*" part must not contain
+            static bool hasNewline(std::string_view s) {
+                return s.find_first_of("\r\n") != std::string_view::npos;
+            }
+        };
+
+        std::vector<Literal> literals;
+        std::vector<detail::Dfa> dfas;
+        std::vector<std::regex> fallbacks;
+
+        static std::optional<detail::Dfa> buildDfa(const std::vector<const detail::Node*>& nodes) {
+            detail::Nfa nfa;
+            if (!nfa.build(nodes))
+                return std::nullopt;
+            return detail::Dfa::build(nfa, maxDfaStates);
+        }
+
+        static bool isDotStar(const detail::Node& node) {
+            return node.type == detail::Node::Type::Repeat && node.min == 0 && node.max < 0 &&
+                node.children.front().type == detail::Node::Type::Set && node.children.front().set == detail::anyByteButNewline();
+        }
+
+        // Recognizes "^?(.*)?literal(.*)?$?" with at most one of the ".*"
+        static std::optional<Literal> toLiteral(const detail::Node& node) {
+            std::vector<const detail::Node*> items;
+            if (node.type == detail::Node::Type::Concat) {
+                for (const auto& child : node.children) {
+                    items.push_back(&child);
+                }
+            }
+            else {
+                items.push_back(&node);
+            }
+
+            // Anchors at the very ends are implied by a full match
+            size_t first = 0;
+            size_t last = items.size();
+            if (first < last && items[first]->type == detail::Node::Type::AssertBegin)
+                ++first;
+            if (first < last && items[last - 1]->type == detail::Node::Type::AssertEnd)
+                --last;
+
+            bool leadingAny = first < last && isDotStar(*items[first]);
+            if (leadingAny)
+                ++first;
+            bool trailingAny = first < last && isDotStar(*items[last - 1]);
+            if (trailingAny)
+                --last;
+            if (leadingAny && trailingAny)
+                return std::nullopt;
+
+            Literal literal{ leadingAny ? Literal::Kind::Suffix : (trailingAny ? Literal::Kind::Prefix : Literal::Kind::Exact), {} };
+            for (size_t i = first; i < last; ++i) {
+                const auto& item = *items[i];
+                if (item.type != detail::Node::Type::Set || item.set.count() != 1)
+                    return std::nullopt;
+                for (int c = 0; c < 256; ++c) {
+                    if (item.set.test(c))
+                        literal.text.push_back(static_cast<char>(c));
+                }
+            }
+            return literal;
+        }
+    };
+
+}
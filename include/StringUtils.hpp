@@ -6,6 +6,10 @@
 #include <stdexcept>
 #include <cctype>
 #include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
 
 namespace StringUtils {
 
@@ -91,4 +95,42 @@ namespace StringUtils {
         return value * multiplier;
     }
 
+    // Parses a local date and time ("2024-01-31", "2024-01-31 13:45", "2024-01-31T13:45:10"), or an age relative to now
+    // ("90s", "30m", "12h", "7d", "2w"), into nanoseconds since the epoch.
+    inline std::int64_t parseTimeString(const std::string& input) {
+        using namespace std::chrono;
+
+        auto isDigit = [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; };
+        if (input.size() >= 2 && std::all_of(input.begin(), input.end() - 1, isDigit)) {
+            int64_t seconds;
+            switch (std::tolower(static_cast<unsigned char>(input.back()))) {
+            case 's': seconds = 1; break;
+            case 'm': seconds = 60; break;
+            case 'h': seconds = 3600; break;
+            case 'd': seconds = 86400; break;
+            case 'w': seconds = 7 * 86400; break;
+            default: throw std::invalid_argument("Unknown time unit: " + input);
+            }
+            auto age = std::chrono::seconds(std::stoll(input.substr(0, input.size() - 1)) * seconds);
+            return duration_cast<nanoseconds>((system_clock::now() - age).time_since_epoch()).count();
+        }
+
+        std::tm tm{};
+        char separator = 0;
+        int fields = std::sscanf(input.c_str(), "%d-%d-%d%c%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &separator,
+            &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+        if (fields != 3 && !(fields >= 6 && (separator == ' ' || separator == 'T'))) {
+            throw std::invalid_argument("Invalid time value: " + input);
+        }
+
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        std::time_t time = std::mktime(&tm);
+        if (time == static_cast<std::time_t>(-1)) {
+            throw std::invalid_argument("Invalid time value: " + input);
+        }
+        return static_cast<std::int64_t>(time) * 1000000000;
+    }
+
 }
@@ -1,51 +1,114 @@
 #pragma once
 
-#include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
-#include <unordered_set>
+#include <stop_token>
 
-// Thread-safe queue for multi-threaded tree structure processing (e.g., file system traversal)
+// Work-stealing queue for multi-threaded tree structure processing (e.g., file system traversal)
+// Every thread owns a deque: it pushes and pops its own work at the back (LIFO, depth-first) and only touches
+// the front of the other threads' deques (FIFO, oldest and usually largest subtrees) when it has run dry.
+// Threads therefore contend only when stealing, instead of on every push and pop.
 // Calling pop() should only start after at least one element has been pushed into the queue
 // pop() returns false if the queue is empty and all threads have finished their work, meaning the entire processing is complete
 template<typename TValue>
 class TreeQueue {
 public:
     TreeQueue() = delete;
-    TreeQueue(int numThreads) : numberOfThreads(numThreads) {} // It must be aware of the exact number of threads that will be using the queue's pop function.
+    TreeQueue(int numThreads) : numberOfThreads(numThreads), workers(numThreads) {} // It must be aware of the exact number of threads that will be using the queue's pop function.
 
-    void push(const TValue& path) {
+    // Seeds the queue from outside of the worker threads, spreading the elements over the workers' deques.
+    void push(const TValue& value) {
+        push(nextSeedThread++ % numberOfThreads, value);
+    }
+
+    // threadIndex must be the caller's own index in the [0, numThreads) range.
+    void push(int threadIndex, const TValue& value) {
+        auto& worker = workers[threadIndex];
+        pendingTasks.fetch_add(1);
         {
-            std::lock_guard lock(mtx);
-            taskQueue.push(path);
+            std::lock_guard lock(worker.mtx);
+            worker.tasks.push_back(value);
+        }
+        queuedTasks.fetch_add(1);
+
+        if (sleepingThreads.load() > 0) {
+            std::lock_guard lock(sleepMtx);
+            cv.notify_one();
         }
-        cv.notify_one();
     }
 
-    bool pop(TValue& out, std::stop_token stopToken) {
-        std::unique_lock lock(mtx);
-        ++threadsWaitingForTasks;
-        if (threadsWaitingForTasks >= numberOfThreads) {
-            allThreadsCompleted = true;
-            cv.notify_all();
+    // Calling pop() also marks the element returned by the previous pop() of the same thread as processed.
+    bool pop(int threadIndex, TValue& out, std::stop_token stopToken) {
+        auto& worker = workers[threadIndex];
+        if (worker.holdsTask) {
+            worker.holdsTask = false;
+            if (pendingTasks.fetch_sub(1) == 1) {
+                std::lock_guard lock(sleepMtx);
+                cv.notify_all();
+            }
+        }
+
+        while (!stopToken.stop_requested()) {
+            if (popOwn(worker, out) || steal(threadIndex, out)) {
+                worker.holdsTask = true;
+                return true;
+            }
+
+            std::unique_lock lock(sleepMtx);
+            ++sleepingThreads;
+            cv.wait(lock, stopToken, [this] { return queuedTasks.load() > 0 || pendingTasks.load() == 0; });
+            --sleepingThreads;
+
+            if (pendingTasks.load() == 0) {
+                return false;
+            }
         }
-        cv.wait(lock, stopToken, [this] { return !taskQueue.empty() || allThreadsCompleted; });
-        --threadsWaitingForTasks;
+        return false;
+    }
+
+private:
+    struct alignas(64) Worker {
+        std::deque<TValue> tasks;
+        std::mutex mtx;
+        bool holdsTask{ false }; // Only accessed by the owner thread
+    };
+
+    int numberOfThreads;
+    std::vector<Worker> workers;
+    int nextSeedThread{ 0 };
+
+    std::atomic<size_t> pendingTasks{ 0 }; // Pushed elements whose processing has not been finished yet
+    std::atomic<size_t> queuedTasks{ 0 }; // Pushed elements which have not been popped yet
+    std::atomic<int> sleepingThreads{ 0 };
+    std::mutex sleepMtx;
+    std::condition_variable_any cv;
 
-        if (taskQueue.empty() || stopToken.stop_requested()) {
+    bool popOwn(Worker& worker, TValue& out) {
+        std::lock_guard lock(worker.mtx);
+        if (worker.tasks.empty()) {
             return false;
         }
 
-        out = taskQueue.front();
-        taskQueue.pop();
+        out = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        queuedTasks.fetch_sub(1);
         return true;
     }
 
-private:
-    std::queue<TValue> taskQueue;
-    std::mutex mtx;
-    std::condition_variable_any cv;
-    std::atomic<int> threadsWaitingForTasks{ 0 };
-    int numberOfThreads;
-    bool allThreadsCompleted{ false };
-};
\ No newline at end of file
+    bool steal(int threadIndex, TValue& out) {
+        for (int i = 1; i < numberOfThreads; ++i) {
+            auto& victim = workers[(threadIndex + i) % numberOfThreads];
+            std::lock_guard lock(victim.mtx);
+            if (!victim.tasks.empty()) {
+                out = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queuedTasks.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+};
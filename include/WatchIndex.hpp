@@ -0,0 +1,194 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "FileEntry.hpp"
+#include "HashUtils.hpp"
+#include "DirectoryUtils.hpp"
+
+// Incremental duplicate index for watch mode.
+// Files are kept in buckets by their cheap key (size and/or name), and inside a bucket in classes of identical
+// content key (chunk hash and/or full digest). A class with at least two members is a reported group.
+// Content keys are computed lazily, only once a bucket has to be split, so adding, changing or removing a file
+// costs work proportional to its bucket and never to the whole tree. Every membership change of a group is
+// reported through the change callback.
+class WatchIndex {
+public:
+    using BucketKey = std::pair<std::uintmax_t, std::string>;
+
+    struct ContentKey {
+        uint64_t chunkHash{ 0 };
+        XXH128_hash_t digest{};
+
+        bool operator==(const ContentKey& other) const {
+            return chunkHash == other.chunkHash && XXH128_isEqual(digest, other.digest);
+        }
+    };
+
+    std::function<BucketKey(const FileEntry&)> bucketKey;
+    std::function<std::optional<ContentKey>(const FileEntry&)> contentKey; // Empty if the bucket key alone decides
+    std::function<bool(const FileEntry&, const FileEntry&)> verify; // Optional byte-exact check before joining a class
+    std::function<void(bool added, int groupId, const std::filesystem::path& path)> onChange;
+
+    // Seeds a group found by the initial scan, keeping its group ID. Nothing is reported.
+    void seedGroup(int groupId, const std::vector<FileEntry>& files) {
+        if (files.empty())
+            return;
+
+        auto bucket = buckets.try_emplace(bucketKey(files.front())).first;
+        auto& cls = bucket->second.classes.emplace_back();
+        cls.groupId = groupId;
+        nextGroupId = std::max(nextGroupId, groupId + 1);
+        for (const auto& f : files) {
+            cls.members.push_back(f);
+            locations[f.path] = { bucket, std::prev(bucket->second.classes.end()) };
+        }
+    }
+
+    // Seeds a file of the initial scan which is not part of any group. Nothing is reported.
+    void seedFile(const FileEntry& file) {
+        if (locations.contains(file.path))
+            return;
+
+        auto bucket = buckets.try_emplace(bucketKey(file)).first;
+        auto& cls = bucket->second.classes.emplace_back();
+        cls.members.push_back(file);
+        locations[file.path] = { bucket, std::prev(bucket->second.classes.end()) };
+    }
+
+    bool contains(const std::filesystem::path& path) const {
+        return locations.contains(path);
+    }
+
+    void add(const FileEntry& file) {
+        if (isUnchanged(file))
+            return;
+        remove(file.path);
+
+        auto bucket = buckets.try_emplace(bucketKey(file)).first;
+        auto& classes = bucket->second.classes;
+
+        if (!contentKey || classes.empty()) {
+            if (classes.empty())
+                classes.emplace_back();
+            join(bucket, classes.begin(), file);
+            return;
+        }
+
+        auto key = contentKey(file);
+        if (!key) {
+            if (classes.empty())
+                buckets.erase(bucket);
+            return;
+        }
+
+        for (auto it = classes.begin(); it != classes.end(); ++it) {
+            if (!it->key)
+                it->key = contentKey(it->members.front());
+            if (it->key && *it->key == *key && (!verify || verify(it->members.front(), file))) {
+                join(bucket, it, file);
+                return;
+            }
+        }
+
+        auto& cls = classes.emplace_back();
+        cls.key = key;
+        join(bucket, std::prev(classes.end()), file);
+    }
+
+    void remove(const std::filesystem::path& path) {
+        auto loc = locations.find(path);
+        if (loc == locations.end())
+            return;
+
+        auto [bucket, cls] = loc->second;
+        locations.erase(loc);
+
+        auto member = std::find_if(cls->members.begin(), cls->members.end(), [&](const FileEntry& f) { return f.path == path; });
+        if (member != cls->members.end())
+            cls->members.erase(member);
+
+        if (cls->groupId >= 0) {
+            onChange(false, cls->groupId, path);
+            if (cls->members.size() == 1) {
+                onChange(false, cls->groupId, cls->members.front().path);
+                cls->groupId = -1;
+            }
+        }
+
+        if (cls->members.empty()) {
+            bucket->second.classes.erase(cls);
+            if (bucket->second.classes.empty())
+                buckets.erase(bucket);
+        }
+    }
+
+    // Removes every file at or below the directory.
+    void removeDirectory(const std::filesystem::path& dir) {
+        std::vector<std::filesystem::path> paths;
+        for (auto it = locations.lower_bound(dir); it != locations.end() && DirectoryUtils::isWithin(it->first, dir); ++it)
+            paths.push_back(it->first);
+
+        for (const auto& p : paths)
+            remove(p);
+    }
+
+private:
+    struct Class {
+        std::vector<FileEntry> members;
+        std::optional<ContentKey> key;
+        int groupId{ -1 };
+    };
+
+    struct Bucket {
+        std::list<Class> classes;
+    };
+
+    using BucketMap = std::map<BucketKey, Bucket>;
+
+    struct Location {
+        BucketMap::iterator bucket;
+        std::list<Class>::iterator cls;
+    };
+
+    BucketMap buckets;
+    std::map<std::filesystem::path, Location> locations; // Ordered, so the files below a directory are adjacent
+    int nextGroupId{ 0 };
+
+    // True if the file is indexed with the same metadata (e.g., reported both by a directory listing and by its creation event)
+    bool isUnchanged(const FileEntry& file) const {
+        auto loc = locations.find(file.path);
+        if (loc == locations.end())
+            return false;
+
+        const auto& members = loc->second.cls->members;
+        auto member = std::find_if(members.begin(), members.end(), [&](const FileEntry& f) { return f.path == file.path; });
+        return member != members.end() && member->size == file.size && member->mtimeNs == file.mtimeNs &&
+            member->device == file.device && member->inode == file.inode;
+    }
+
+    void join(BucketMap::iterator bucket, std::list<Class>::iterator cls, const FileEntry& file) {
+        cls->members.push_back(file);
+        locations[file.path] = { bucket, cls };
+
+        if (cls->members.size() < 2)
+            return;
+
+        if (cls->groupId < 0) {
+            cls->groupId = nextGroupId++;
+            for (const auto& f : cls->members)
+                onChange(true, cls->groupId, f.path);
+        }
+        else {
+            onChange(true, cls->groupId, file.path);
+        }
+    }
+};
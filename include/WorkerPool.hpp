@@ -0,0 +1,112 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <latch>
+#include <stop_token>
+#include <algorithm>
+#include <exception>
+
+// Fixed-size pool of helper threads for fanning out blocking work (e.g., metadata queries on high-latency mounts).
+// The pool is shared: several threads may call parallelFor() at the same time.
+class WorkerPool {
+public:
+    explicit WorkerPool(int numThreads) {
+        for (int i = 0; i < numThreads; ++i) {
+            threads.emplace_back([this](std::stop_token st) {
+                run(st);
+                });
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    size_t threadCount() const {
+        return threads.size();
+    }
+
+    // Calls fn(begin, end) for consecutive ranges of at most chunkSize elements of [0, count) and returns when all calls have finished.
+    // The calling thread takes part in the work instead of idling while it waits.
+    // If calls throw, the first exception is rethrown once all calls have finished (fn and its state live until then).
+    template<typename TFunc>
+    void parallelFor(size_t count, size_t chunkSize, TFunc&& fn) {
+        size_t chunks = (count + chunkSize - 1) / chunkSize;
+        if (chunks <= 1) {
+            if (count > 0)
+                fn(0, count);
+            return;
+        }
+
+        std::latch done(static_cast<std::ptrdiff_t>(chunks - 1));
+        std::mutex errorMtx;
+        std::exception_ptr error;
+        auto call = [&](size_t begin, size_t end) {
+            try {
+                fn(begin, end);
+            }
+            catch (...) {
+                std::lock_guard lock(errorMtx);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
+        {
+            std::lock_guard lock(mtx);
+            for (size_t c = 1; c < chunks; ++c) {
+                tasks.emplace_back([&call, &done, c, chunkSize, count] {
+                    call(c * chunkSize, std::min(count, (c + 1) * chunkSize));
+                    done.count_down();
+                    });
+            }
+        }
+        cv.notify_all();
+
+        call(0, chunkSize);
+
+        std::function<void()> task;
+        while (!done.try_wait() && tryPop(task)) {
+            task();
+        }
+        done.wait();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable_any cv;
+    std::vector<std::jthread> threads; // Declared last, so the threads are stopped and joined before the queue is destroyed
+
+    bool tryPop(std::function<void()>& out) {
+        std::lock_guard lock(mtx);
+        if (tasks.empty())
+            return false;
+
+        out = std::move(tasks.front());
+        tasks.pop_front();
+        return true;
+    }
+
+    void run(std::stop_token st) {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mtx);
+                cv.wait(lock, st, [this] { return !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
@@ -1,14 +1,26 @@
 #include "AntSeek.hpp"
 
 #include <iostream>
+#include <fstream>
 #include <mutex>
 #include <ranges>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdio>
 
 #include "LoggingUtils.hpp"
 #include "RegexUtils.hpp"
 #include "HashUtils.hpp"
 #include "CompareUtils.hpp"
 #include "StringUtils.hpp"
+#include "DirectoryUtils.hpp"
+#include "MetadataUtils.hpp"
+#include "DeviceUtils.hpp"
+#include "FileReader.hpp"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -20,38 +32,98 @@ void AntSeek::Config::setDirectories(const std::vector<std::string>& strvecDirec
 }
 
 void AntSeek::Config::setFilenamePatterns(const std::vector<std::string>& strvecFilenamePatterns) {
-    filenamePatterns.clear();
-    for (const auto& str : strvecFilenamePatterns) {
-        try {
-            filenamePatterns.emplace_back(str);
-        }
-        catch (const std::regex_error&) {
-            throw std::runtime_error("Invalid regex pattern: " + str);
-        }
-    }
+    filenameMatcher = RegexUtils::FilenameMatcher(strvecFilenamePatterns);
+}
+
+void AntSeek::Config::setExcludedDirectories(const std::vector<std::string>& strvecDirectoryPatterns) {
+    excludedDirectories = RegexUtils::FilenameMatcher(strvecDirectoryPatterns);
+}
+
+bool AntSeek::Config::hasFileFilters() const {
+    return minFileSize > 0 || maxFileSize < std::numeric_limits<std::uintmax_t>::max() ||
+        minMtimeNs > std::numeric_limits<std::int64_t>::min() || maxMtimeNs < std::numeric_limits<std::int64_t>::max();
+}
+
+// The full content hash is the key of the groups, not just a filter in front of the compare stage
+bool AntSeek::Config::hashesFullContent() const {
+    return hashMode == HashMode::Cascade || hashMode == HashMode::Full;
 }
 
 AntSeek::AntSeek(const Config& cfg) : config(cfg) {}
 
 void AntSeek::start(const ThreadConfig& thrCfg) {
-    dirQueue = std::make_unique<TreeQueue<fs::path>>(thrCfg.fileCollectorCount);
+    collectFileMetadata = (config.operationMode == Config::OperationMode::CompareToFile) ||
+        (config.operationMode == Config::OperationMode::AllVsAll && config.matchSize) ||
+        config.hasFileFilters();
 
-    for (const auto& d : config.directories) {
-        if (!fs::exists(d)) {
-            std::cerr << "Directory does not exist: " << d << "\n";
-            continue;
-        }
-        else if (!fs::is_directory(d)) {
-            std::cerr << "Not a directory: " << d << "\n";
-            continue;
+    readsFileContent = (config.operationMode == Config::OperationMode::CompareToFile) ||
+        (config.operationMode == Config::OperationMode::AllVsAll &&
+            (config.hashMode != Config::HashMode::None || config.matchContent != Config::MatchContent::None));
+    collectFileMetadata = collectFileMetadata || readsFileContent; // Device and inode are needed for scheduling and deduplication
+    fileTable.setResolvesPhysicalOffsets(readsFileContent);
+    comparesContent = (config.matchContent != Config::MatchContent::None && config.matchContent != Config::MatchContent::Similar) ||
+        (config.verify && config.hashesFullContent());
+    ReadBuffers::setDefaultSize(thrCfg.bufferSize);
+    FileReader::setMapping(thrCfg.mapThreshold, thrCfg.mapWindowSize);
+    FileReader::setCachePolicy(config.pageCache);
+    fileQueue.setDeviceLimits(thrCfg.deviceReadLimits);
+    hashQueue.setDeviceLimits(thrCfg.deviceReadLimits);
+
+    if (!config.hashCacheFile.empty() && config.operationMode != Config::OperationMode::ListFiles) {
+        hashCache = std::make_unique<HashCache>(config.hashCacheFile);
+        collectFileMetadata = true; // The cache is keyed by the file metadata
+    }
+
+    if (config.hashesFullContent() && config.operationMode != Config::OperationMode::AllVsAll) {
+        throw std::runtime_error("Full content hashing can only be used to compare every file against every other");
+    }
+    if (config.hashMode == Config::HashMode::Cascade) {
+        hashCascade = std::make_unique<HashCascade>(config.hashSize);
+    }
+    if (config.matchContent == Config::MatchContent::Similar) {
+        if (config.operationMode != Config::OperationMode::AllVsAll || config.hashMode != Config::HashMode::None || config.watch) {
+            throw std::runtime_error("Similar content can only be looked for among all files, without hashing or watching");
         }
-        dirQueue->push(d);
+        chunkIndex = std::make_unique<ChunkIndex>();
+    }
+
+    // The buckets of a file queue group are compared as soon as its files are hashed
+    if (config.operationMode == Config::OperationMode::AllVsAll && comparesContent) {
+        hashQueue.setGroupKey(config.matchSize, config.matchFilename);
+    }
+
+    if (config.watch) {
+        fileWatcher = std::make_unique<FileWatcher>();
+        collectFileMetadata = true; // The index keys and caches on the file metadata
+    }
+
+    if (config.metadataEngine == MetadataUtils::Engine::IoUring && !MetadataUtils::isIoUringAvailable()) {
+        LoggingUtils::writeToStderr("[WARNING] io_uring is not available, falling back to the thread pool metadata engine");
+        config.metadataEngine = MetadataUtils::Engine::ThreadPool;
+    }
+    if (collectFileMetadata && config.metadataEngine == MetadataUtils::Engine::ThreadPool) {
+        metadataPool = std::make_unique<WorkerPool>(thrCfg.metadataWorkerCount);
+    }
+    if (config.operationMode == Config::OperationMode::AllVsAll && readsFileContent && thrCfg.segmentWorkerCount > 1) {
+        segmentPool = std::make_unique<WorkerPool>(thrCfg.segmentWorkerCount - 1); // The calling thread works along
+    }
+
+    // The collectors already filter on the reference file, so it has to be loaded before they start
+    if (config.operationMode == Config::OperationMode::CompareToFile) {
+        loadReferences();
+    }
+
+    dirQueue = std::make_unique<TreeQueue<DirectoryTask>>(thrCfg.fileCollectorCount);
+
+    rootDirectories = getRootDirectories();
+    for (const auto& d : rootDirectories) {
+        dirQueue->push({ d, 0 });
     }
 
     activeFileCollectorCount.store(thrCfg.fileCollectorCount);
-    for (auto i = thrCfg.fileCollectorCount; i; --i) {
-        workers.emplace_back([this](std::stop_token st) {
-            this->fileCollectorThread(st);
+    for (int i = 0; i < thrCfg.fileCollectorCount; ++i) {
+        workers.emplace_back([this, i](std::stop_token st) {
+            this->fileCollectorThread(st, i);
             }, stopSource.get_token());
     }
 
@@ -66,7 +138,8 @@ void AntSeek::start(const ThreadConfig& thrCfg) {
                 }, stopSource.get_token());
         }
 
-        if (config.matchContent != Config::MatchContent::None) {
+        if (comparesContent) {
+            setGroupOpenLimit(thrCfg.comparerCount);
             activeComparerCount.store(thrCfg.comparerCount);
             for (auto i = thrCfg.comparerCount; i; --i) {
                 workers.emplace_back([this](std::stop_token st) {
@@ -76,12 +149,6 @@ void AntSeek::start(const ThreadConfig& thrCfg) {
         }
     }
     else if (config.operationMode == Config::OperationMode::CompareToFile) {
-        loadCompareToFile();
-
-        if (config.hashMode != Config::HashMode::None) {
-            referenceFileHash = HashUtils::hashFromFileChunk(fs::directory_entry(config.compareToFile), config.hashSize, config.hashMode == Config::HashMode::First);
-        }
-
         activeComparerCount.store(thrCfg.comparerCount);
         for (auto i = thrCfg.comparerCount; i; --i) {
             workers.emplace_back([this](std::stop_token st) {
@@ -94,6 +161,43 @@ void AntSeek::start(const ThreadConfig& thrCfg) {
     }
 }
 
+// The existing directories to scan, without those which are the same as or inside another one.
+// They keep the spelling they were given with, only the overlap check is done on their canonical form.
+std::vector<fs::path> AntSeek::getRootDirectories() const {
+    std::vector<std::pair<fs::path, fs::path>> roots; // Canonical, original
+    for (const auto& d : config.directories) {
+        if (!fs::exists(d)) {
+            std::cerr << "Directory does not exist: " << d << "\n";
+            continue;
+        }
+        else if (!fs::is_directory(d)) {
+            std::cerr << "Not a directory: " << d << "\n";
+            continue;
+        }
+
+        std::error_code ec;
+        auto canonical = fs::canonical(d, ec);
+        // Without a trailing separator, so the paths below compare as expected against the root
+        auto original = (!d.has_filename() && d.has_relative_path()) ? d.parent_path() : d;
+        roots.emplace_back(ec ? fs::absolute(d).lexically_normal() : canonical, original);
+    }
+
+    // Sorted, a directory comes right before the ones inside it
+    std::stable_sort(roots.begin(), roots.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<fs::path> result;
+    const fs::path* covering = nullptr;
+    for (const auto& [canonical, original] : roots) {
+        if (covering && DirectoryUtils::isWithin(canonical, *covering)) {
+            LoggingUtils::writeToStderr("[WARNING] Skipping directory, it is already covered by another one: " + original.string());
+            continue;
+        }
+        covering = &canonical;
+        result.push_back(original);
+    }
+    return result;
+}
+
 void AntSeek::requestStop() {
     stopSource.request_stop();
 }
@@ -113,55 +217,470 @@ void AntSeek::getStatus() {
 void AntSeek::printResults() {
     waitForFinish();
 
-    if (config.operationMode == Config::OperationMode::ListFiles ||
-        config.operationMode == Config::OperationMode::CompareToFile)
-    {
-        for (const auto& p : results) {
-            std::cout << StringUtils::pathToString(p) << "\n";
+    if (config.operationMode == Config::OperationMode::ListFiles) {
+        for (auto file : results) {
+            std::cout << StringUtils::pathToString(fileTable.path(file)) << "\n";
         }
     }
+    else if (config.operationMode == Config::OperationMode::CompareToFile) {
+        printReferenceMatches();
+    }
+    else if (config.operationMode == Config::OperationMode::AllVsAll && chunkIndex) {
+        printSimilarFiles();
+    }
     else if (config.operationMode == Config::OperationMode::AllVsAll) {
-        if (config.matchContent != Config::MatchContent::None) {
-            auto it = groupHandler.buildGroupedList();
-            for (const auto& [groupId, group] : it) {
-                printGroup(groupId);
-                for (const auto& file : group) {
-                    printLine(groupId, StringUtils::pathToString(file));
+        for (const auto& [groupId, group] : getGroups()) {
+            printGroup(groupId);
+            for (auto file : group) {
+                printLine(groupId, StringUtils::pathToString(fileTable.path(file)));
+            }
+        }
+
+        if (hashCascade) {
+            printCascadeStats();
+        }
+    }
+    else {
+        throw std::runtime_error("Unknown operation mode");
+    }
+}
+
+// How many files each stage of the hash cascade looked at and told apart, on stderr to keep the results parseable
+void AntSeek::printCascadeStats() {
+    auto formatBytes = [](std::uint64_t bytes) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.1f MiB", static_cast<double>(bytes) / (1024 * 1024));
+        return std::string(text);
+    };
+
+    std::uint64_t totalBytes = 0;
+    LoggingUtils::writeToStderr("[INFO] Hash cascade: " + std::to_string(fileTable.count()) + " files scanned");
+    for (size_t i = 0; const auto& stats : hashCascade->getStats()) {
+        auto stage = static_cast<HashCascade::Stage>(i++);
+        if (stats.files == 0) {
+            continue;
+        }
+        totalBytes += stats.bytesRead;
+        LoggingUtils::writeToStderr(std::string("[INFO]   ") + HashCascade::stageName(stage) + ": " +
+            std::to_string(stats.files) + " files hashed, " + std::to_string(stats.eliminated) + " found unique, " +
+            formatBytes(stats.bytesRead) + " read");
+    }
+    LoggingUtils::writeToStderr("[INFO]   total: " + formatBytes(totalBytes) + " read");
+}
+
+// Each pair of similar files is a group of its own, with the bytes they share and the share of the smaller one
+void AntSeek::printSimilarFiles() {
+    size_t skippedChunks = 0;
+    auto pairs = chunkIndex->findSimilar(config.minSimilarity, skippedChunks);
+
+    // Another path of an inode read once has all of its content in common with it
+    fileIdentities.forEachAliased([&](FileId primary, const std::vector<FileId>& aliases) {
+        for (auto alias : aliases) {
+            pairs.push_back({ primary, alias, fileTable.size(primary), 1.0 });
+        }
+        });
+
+    for (int pairId = 0; const auto& pair : pairs) {
+        char share[16];
+        std::snprintf(share, sizeof(share), "%.1f", pair.similarity * 100);
+        auto shared = std::to_string(pair.sharedBytes);
+        for (auto file : { pair.first, pair.second }) {
+            auto path = StringUtils::pathToString(fileTable.path(file));
+            switch (config.outputFormat) {
+            case Config::OutputFormat::Grouped:
+                if (file == pair.first) {
+                    std::cout << "Group ID: " << pairId << " (" << shared << " bytes shared, " << share << "%)\n";
                 }
+                std::cout << "  " << path << "\n";
+                break;
+            case Config::OutputFormat::TSV:
+                std::cout << pairId << "\t" << shared << "\t" << share << "\t" << path << "\n";
+                break;
+            case Config::OutputFormat::Pipe:
+                std::cout << pairId << "|" << shared << "|" << share << "|" << path << "\n";
+                break;
+            default:
+                throw std::runtime_error("Unknown output format");
             }
         }
-        else {
-            auto it = getPairQueueResult() | std::views::filter([](const auto& pair) {
-                return pair.second.size() > 1;
-                });
-            for (const auto& [groupId, group] : it) {
-                printGroup(groupId);
-                for (const auto& file : group) {
-                    printLine(groupId, StringUtils::pathToString(file));
+        ++pairId;
+    }
+
+    if (skippedChunks > 0) {
+        LoggingUtils::writeToStderr("[INFO] " + std::to_string(skippedChunks) + " chunks found in more than " +
+            std::to_string(ChunkIndex::maxFilesPerChunk) + " files were not counted as shared content");
+    }
+}
+
+void AntSeek::watchForChanges() {
+    if (!fileWatcher) {
+        throw std::logic_error("Watch mode is not enabled");
+    }
+    waitForFinish();
+    std::cout.flush();
+
+    WatchIndex index;
+    setupWatchIndex(index);
+
+    // Seed the index with the state the results were printed from, so only changes are reported from now on
+    for (const auto& [groupId, group] : getGroups()) {
+        std::vector<FileEntry> files;
+        for (auto file : group) {
+            files.push_back(fileTable.entry(file));
+        }
+        index.seedGroup(groupId, files);
+    }
+    for (size_t file = 0; file < fileTable.count(); ++file) {
+        index.seedFile(fileTable.entry(static_cast<FileId>(file)));
+    }
+
+    std::vector<FileWatcher::Event> events;
+    while (fileWatcher->wait(events, stopSource.get_token())) {
+        for (const auto& ev : events) {
+            try {
+                switch (ev.type) {
+                case FileWatcher::Event::Type::FileChanged:
+                    {
+                        FileEntry file{ ev.path };
+                        if (config.filenameMatcher.matches(StringUtils::pathToString(ev.path.filename())) &&
+                            MetadataUtils::statFile(file) && passesFileFilters(file)) {
+                            index.add(file);
+                        }
+                        else {
+                            index.remove(ev.path);
+                        }
+                    }
+                    break;
+                case FileWatcher::Event::Type::FileRemoved:
+                    index.remove(ev.path);
+                    break;
+                case FileWatcher::Event::Type::DirectoryAdded:
+                    if (!config.excludedDirectories.matches(StringUtils::pathToString(ev.path.filename())) &&
+                        (config.maxDepth < 0 || getDepth(ev.path) <= config.maxDepth)) {
+                        watchNewDirectory(ev.path, index);
+                    }
+                    break;
+                case FileWatcher::Event::Type::DirectoryRemoved:
+                    fileWatcher->removeDirectory(ev.path);
+                    index.removeDirectory(ev.path);
+                    break;
+                case FileWatcher::Event::Type::Overflow:
+                    LoggingUtils::writeToStderr("[WARNING] Change events were lost, the reported groups may be out of date");
+                    break;
                 }
             }
+            catch (const std::exception& e) {
+                LoggingUtils::writeToStderr(std::string("[ERROR] Failed to process change of: ") + ev.path.string() + " (" + e.what() + ")");
+            }
         }
+        std::cout.flush();
+    }
+}
+
+void AntSeek::setupWatchIndex(WatchIndex& index) {
+    index.bucketKey = [this](const FileEntry& file) {
+        return WatchIndex::BucketKey{
+            config.matchSize ? file.size : 0,
+            config.matchFilename ? StringUtils::pathToString(file.path.filename()) : std::string{} };
+    };
+
+    if (config.hashMode != Config::HashMode::None || config.matchContent != Config::MatchContent::None) {
+        index.contentKey = [this](const FileEntry& file) -> std::optional<WatchIndex::ContentKey> {
+            try {
+                WatchIndex::ContentKey key;
+                if (config.hashMode == Config::HashMode::First || config.hashMode == Config::HashMode::Last) {
+                    key.chunkHash = getChunkHash(file, config.hashMode == Config::HashMode::First);
+                }
+                // The cascade ends with the full hash, its earlier stages only spare reads in a scan
+                if (config.matchContent != Config::MatchContent::None || config.hashesFullContent()) {
+                    key.digest = getFullHash(file);
+                }
+                return key;
+            }
+            catch (const std::exception& e) {
+                LoggingUtils::writeToStderr(std::string("[ERROR] Failed to hash file: ") + file.path.string() + " (" + e.what() + ")");
+                return std::nullopt;
+            }
+        };
+    }
+
+    if (comparesContent) {
+        // Equal digests are only a strong hint, the bytes decide like in the initial scan
+        index.verify = [this](const FileEntry& a, const FileEntry& b) {
+            return CompareUtils::compareFileContents(a.path, b.path, getSegmentPool(a.device)) == CompareUtils::MatchResult::Match;
+        };
+    }
+
+    index.onChange = [this](bool added, int groupId, const fs::path& p) {
+        printChange(added, groupId, StringUtils::pathToString(p));
+    };
+}
+
+// Watches a directory which appeared after the scan, and adds the files it already contains.
+// The watch is set up before listing, so files created meanwhile are reported either way.
+void AntSeek::watchNewDirectory(const fs::path& root, WatchIndex& index) {
+    std::vector<DirectoryTask> pending{ { root, getDepth(root) } };
+    DirectoryUtils::Entry entry;
+
+    while (!pending.empty()) {
+        DirectoryTask current = std::move(pending.back());
+        pending.pop_back();
+
+        fileWatcher->addDirectory(current.path);
+        DirectoryUtils::DirectoryReader dir(current.path);
+        while (dir.next(entry)) {
+            if (entry.type == DirectoryUtils::EntryType::Directory) {
+                if ((config.maxDepth < 0 || current.depth < config.maxDepth) && !config.excludedDirectories.matches(entry.name)) {
+                    pending.push_back({ dir.path(entry), current.depth + 1 });
+                }
+            }
+            else if (entry.type == DirectoryUtils::EntryType::RegularFile &&
+                config.filenameMatcher.matches(entry.name)) {
+                FileEntry file{ dir.path(entry) };
+                if ((MetadataUtils::fromEntry(entry, file) || MetadataUtils::statFile(file)) && passesFileFilters(file)) {
+                    index.add(file);
+                }
+            }
+        }
+    }
+}
+
+// Levels of a directory below the root it was found in
+int AntSeek::getDepth(const fs::path& dir) const {
+    for (const auto& root : rootDirectories) {
+        if (DirectoryUtils::isWithin(dir, root)) {
+            return static_cast<int>(std::distance(dir.begin(), dir.end()) - std::distance(root.begin(), root.end()));
+        }
+    }
+    return 0;
+}
+
+bool AntSeek::passesFileFilters(const FileEntry& file) const {
+    return file.size >= config.minFileSize && file.size <= config.maxFileSize &&
+        file.mtimeNs >= config.minMtimeNs && file.mtimeNs <= config.maxMtimeNs;
+}
+
+// The references and their searcher, from the files given or from a compiled database
+void AntSeek::loadReferences() {
+    if (!config.referenceDbFile.empty()) {
+        loadReferenceDb();
     }
     else {
-        throw std::runtime_error("Unknown operation mode");
+        loadReferenceFiles();
     }
+
+    // Same as HashUtils::hashFromFileChunk of the reference file
+    if (config.hashMode != Config::HashMode::None) {
+        for (size_t i = 0; i < references.size(); ++i) {
+            if (references[i].streamed) {
+                references[i].chunkHash = HashUtils::hashFromFileChunk(references[i].path, config.hashSize, config.hashMode == Config::HashMode::First);
+                continue;
+            }
+            auto data = referencePatterns[i].data;
+            auto count = std::min<size_t>(data.size(), config.hashSize);
+            auto chunk = (config.hashMode == Config::HashMode::First) ? data.first(count) : data.last(count);
+            references[i].chunkHash = XXH3_64bits(chunk.data(), chunk.size());
+        }
+    }
+
+    if (config.matchContent == Config::MatchContent::Find) {
+        if (references.size() == 1) {
+            referenceSearcher = std::make_unique<MaskSearcher>(referencePatterns.front().data, referencePatterns.front().mask);
+        }
+        else if (referenceDb) {
+            multiReferenceSearcher = std::make_unique<MultiMaskSearcher>(referencePatterns, referenceDb->getTables());
+        }
+        else {
+            multiReferenceSearcher = std::make_unique<MultiMaskSearcher>(referencePatterns);
+        }
+    }
+}
+
+// The reference files in the order given, a directory stands for the regular files below it (sorted by path)
+void AntSeek::loadReferenceFiles() {
+    for (const auto& path : config.compareToFiles) {
+        std::error_code ec;
+        if (!fs::is_directory(path, ec)) {
+            loadReference(path);
+            continue;
+        }
+
+        std::vector<fs::path> files;
+        for (auto it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied, ec);
+            !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec)) {
+                files.push_back(it->path());
+            }
+        }
+        if (ec)
+            throw std::runtime_error("Failed to list reference directory: " + StringUtils::pathToString(path) + " (" + ec.message() + ")");
+
+        std::sort(files.begin(), files.end());
+        for (const auto& file : files) {
+            loadReference(file);
+        }
+    }
+    if (references.empty())
+        throw std::runtime_error("No reference files found");
+
+    // The vectors of the references do not move any more, the searchers refer to them
+    for (const auto& reference : references) {
+        referencePatterns.push_back({ reference.data, reference.mask });
+    }
+}
+
+// The content and masks stay in the mapped database, the jokers were applied when it was compiled
+void AntSeek::loadReferenceDb() {
+    referenceDb = std::make_unique<ReferenceDb>(config.referenceDbFile);
+    auto jokerBytes = referenceDb->getJokerBytes();
+    if (!config.jokerBytes.empty() && !std::equal(config.jokerBytes.begin(), config.jokerBytes.end(), jokerBytes.begin(), jokerBytes.end()))
+        throw std::runtime_error("The reference database was compiled with other jokers: " + StringUtils::pathToString(config.referenceDbFile));
+    for (const auto& entry : referenceDb->getReferences()) {
+        Reference reference;
+        reference.path = fs::path(std::string(entry.path));
+        reference.name = StringUtils::pathToString(reference.path.filename());
+        reference.size = entry.data.size();
+        references.push_back(std::move(reference));
+        referencePatterns.push_back({ entry.data, entry.mask });
+    }
+    if (references.empty())
+        throw std::runtime_error("No references in the database: " + StringUtils::pathToString(config.referenceDbFile));
+}
+
+// Writes the reference files with their masks and the tables of their searcher to a database, for later scans
+void AntSeek::compileReferences(const fs::path& file) {
+    loadReferenceFiles();
+    MultiMaskSearcher searcher(referencePatterns);
+
+    std::vector<std::string> paths;
+    for (const auto& reference : references) {
+        paths.push_back(StringUtils::pathToString(reference.path));
+    }
+    ReferenceDb::write(file, paths, referencePatterns, searcher.getTables(), config.jokerBytes);
+    LoggingUtils::writeToStderr("[INFO] " + std::to_string(references.size()) + " references compiled to " + StringUtils::pathToString(file));
 }
 
-void AntSeek::loadCompareToFile() {
-    referenceFileName = StringUtils::pathToString(config.compareToFile.filename());
+void AntSeek::loadReference(const fs::path& path) {
+    Reference reference;
+    reference.path = path;
+    reference.name = StringUtils::pathToString(path.filename());
 
-    std::ifstream file(config.compareToFile, std::ios::binary | std::ios::ate);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
     if (!file)
-        throw std::runtime_error(std::string("Failed to open reference file: ") + referenceFileName);
+        throw std::runtime_error(std::string("Failed to open reference file: ") + reference.name);
 
-    referenceFileSize = file.tellg();
+    reference.size = file.tellg();
     file.seekg(0, std::ios::beg);
 
-    referenceData.resize(referenceFileSize);
-    if (!file.read(reinterpret_cast<char*>(referenceData.data()), referenceFileSize))
-        throw std::runtime_error(std::string("Failed to read reference file: ") + referenceFileName);
+    // Searching needs the whole reference at hand, comparing at the start or the end only a window of it
+    bool compares = config.matchContent == Config::MatchContent::Begin || config.matchContent == Config::MatchContent::End ||
+        config.matchContent == Config::MatchContent::Full;
+    if (compares && reference.size > config.referenceWindowSize) {
+        reference.streamed = std::make_unique<CompareUtils::StreamedReference>(
+            CompareUtils::loadStreamedReference(path, config.jokerBytes, config.referenceWindowSize));
+        streamedReferences.push_back(static_cast<uint32_t>(references.size()));
+        references.push_back(std::move(reference));
+        return;
+    }
+
+    reference.data.resize(reference.size);
+    if (!file.read(reinterpret_cast<char*>(reference.data.data()), reference.size))
+        throw std::runtime_error(std::string("Failed to read reference file: ") + reference.name);
+
+    reference.mask = CompareUtils::generatePatternMask(reference.data, config.jokerBytes);
+    references.push_back(std::move(reference));
+}
+
+// The references loaded are compared in one read, the streamed ones each on its own afterwards
+CompareUtils::MatchResult AntSeek::compareReferences(const fs::path& path, std::vector<char>& found, bool checkEnd) {
+    std::vector<uint32_t> pending;
+    for (auto reference : streamedReferences) {
+        if (!found[reference]) {
+            pending.push_back(reference);
+            found[reference] = 1;
+        }
+    }
+
+    auto res = CompareUtils::MatchResult::NoMatch;
+    if (std::find(found.begin(), found.end(), 0) != found.end()) {
+        res = CompareUtils::compareFileContentsFlexible(path, referencePatterns, found, checkEnd, config.referenceWindowSize);
+    }
+    for (auto reference : pending) {
+        found[reference] = 0;
+        if (CompareUtils::compareFileContentsStreamed(path, *references[reference].streamed, checkEnd, config.referenceWindowSize) == CompareUtils::MatchResult::Match) {
+            found[reference] = 1;
+            res = CompareUtils::MatchResult::Match;
+        }
+    }
+    return res;
+}
+
+// Whether the file passes the filters of the reference, chunkHash is the hash of the file, computed on first use
+bool AntSeek::acceptsReference(const Reference& reference, FileId file, std::optional<uint64_t>& chunkHash) {
+    auto size = fileTable.size(file);
+    if (!((reference.size <= size) &&
+        (config.matchContent != Config::MatchContent::Full || size == reference.size) &&
+        (!config.matchSize || size == reference.size) &&
+        (!config.matchFilename || fileTable.name(file) == reference.name)))
+    {
+        return false;
+    }
+
+    if (config.hashMode == Config::HashMode::None)
+        return true;
+    if (!chunkHash) {
+        chunkHash = getChunkHash(fileTable.entry(file), config.hashMode == Config::HashMode::First);
+    }
+    return *chunkHash == reference.chunkHash;
+}
+
+// A single reference: the matching paths. Several: the paths matching each reference, after the reference.
+void AntSeek::printReferenceMatches() {
+    // Every path of a matching file is a match
+    std::unordered_map<FileId, std::vector<uint32_t>> matched;
+    for (const auto& [file, reference] : referenceMatches) {
+        matched[file].push_back(reference);
+    }
+    fileIdentities.forEachAliased([&](FileId primary, const std::vector<FileId>& aliases) {
+        auto it = matched.find(primary);
+        if (it == matched.end())
+            return;
+        for (auto alias : aliases) {
+            for (auto reference : it->second) {
+                referenceMatches.emplace_back(alias, reference);
+            }
+        }
+        });
+
+    if (references.size() == 1) {
+        for (const auto& [file, reference] : referenceMatches) {
+            std::cout << StringUtils::pathToString(fileTable.path(file)) << "\n";
+        }
+        return;
+    }
 
-    referenceDataMask = CompareUtils::generatePatternMask(referenceData, config.jokerBytes);
+    std::stable_sort(referenceMatches.begin(), referenceMatches.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+    for (size_t i = 0; i < referenceMatches.size(); ++i) {
+        auto reference = referenceMatches[i].second;
+        auto referencePath = StringUtils::pathToString(references[reference].path);
+        auto path = StringUtils::pathToString(fileTable.path(referenceMatches[i].first));
+        switch (config.outputFormat) {
+        case Config::OutputFormat::Grouped:
+            if (i == 0 || referenceMatches[i - 1].second != reference) {
+                std::cout << "Reference: " << referencePath << "\n";
+            }
+            std::cout << "  " << path << "\n";
+            break;
+        case Config::OutputFormat::TSV:
+            std::cout << referencePath << "\t" << path << "\n";
+            break;
+        case Config::OutputFormat::Pipe:
+            std::cout << referencePath << "|" << path << "\n";
+            break;
+        default:
+            throw std::runtime_error("Unknown output format");
+        }
+    }
 }
 
 void AntSeek::printGroup(int groupId) {
@@ -194,14 +713,71 @@ void AntSeek::printLine(int groupId, const std::string& line) {
     }
 }
 
-auto AntSeek::getPairQueueResult() -> std::unordered_map<int, std::vector<fs::path>> {
+void AntSeek::printChange(bool added, int groupId, const std::string& line) {
+    char sign = added ? '+' : '-';
+    switch (config.outputFormat) {
+        case Config::OutputFormat::Grouped:
+            std::cout << sign << " Group ID: " << groupId << "  " << line << "\n";
+            break;
+        case Config::OutputFormat::TSV:
+            std::cout << sign << groupId << "\t" << line << "\n";
+            break;
+        case Config::OutputFormat::Pipe:
+            std::cout << sign << groupId << "|" << line << "\n";
+            break;
+        default:
+            throw std::runtime_error("Unknown output format");
+    }
+}
+
+// Groups with at least two members of an AllVsAll run
+auto AntSeek::getGroups() -> std::vector<std::pair<int, std::vector<FileId>>> {
+    std::vector<std::pair<int, std::vector<FileId>>> groups;
+    if (comparesContent) {
+        for (auto& [groupId, group] : groupHandler.buildGroupedList()) {
+            groups.emplace_back(groupId, group);
+        }
+    }
+    else {
+        for (auto& [groupId, group] : getPairQueueResult()) {
+            groups.emplace_back(groupId, group);
+        }
+    }
+
+    if (fileIdentities.hasAliases()) {
+        // Aliases join the group of their primary, or form a group of their own: they are duplicates by definition
+        std::unordered_map<FileId, size_t> groupOf;
+        int nextGroupId = 0;
+        for (size_t i = 0; i < groups.size(); ++i) {
+            for (auto file : groups[i].second) {
+                groupOf[file] = i;
+            }
+            nextGroupId = std::max(nextGroupId, groups[i].first + 1);
+        }
+
+        fileIdentities.forEachAliased([&](FileId primary, const std::vector<FileId>& aliases) {
+            auto it = groupOf.find(primary);
+            auto& files = (it != groupOf.end()) ? groups[it->second].second :
+                groups.emplace_back(nextGroupId++, std::vector<FileId>{ primary }).second;
+            files.insert(files.end(), aliases.begin(), aliases.end());
+            });
+    }
+
+    std::erase_if(groups, [](const auto& group) { return group.second.size() < 2; });
+    return groups;
+}
+
+auto AntSeek::getPairQueueResult() -> std::unordered_map<int, std::vector<FileId>> {
+    if (config.hashesFullContent()) {
+        return hashQueue.buildGroupedList<std::string>();
+    }
     if (config.hashMode == Config::HashMode::None) {
         if (config.matchFilename) {
             if (config.matchSize) {
-                return hashQueue.buildGroupedList<std::pair<std::uintmax_t, std::string>>();
+                return hashQueue.buildGroupedList<std::pair<std::uintmax_t, std::string_view>>();
             }
             else {
-                return hashQueue.buildGroupedList<std::string>();
+                return hashQueue.buildGroupedList<std::string_view>();
             }
         }
         else if (config.matchSize) {
@@ -212,10 +788,10 @@ auto AntSeek::getPairQueueResult() -> std::unordered_map<int, std::vector<fs::pa
     else {
         if (config.matchFilename) {
             if (config.matchSize) {
-                return hashQueue.buildGroupedList<std::tuple<std::uintmax_t, std::string, uint64_t>>();
+                return hashQueue.buildGroupedList<std::tuple<std::uintmax_t, std::string_view, uint64_t>>();
             }
             else {
-                return hashQueue.buildGroupedList<std::pair<std::string, uint64_t>>();
+                return hashQueue.buildGroupedList<std::pair<std::string_view, uint64_t>>();
             }
         }
         else if (config.matchSize) {
@@ -225,64 +801,162 @@ auto AntSeek::getPairQueueResult() -> std::unordered_map<int, std::vector<fs::pa
     }
 }
 
-void AntSeek::fileCollectorThread(std::stop_token st) {
-    fs::path current;
+uint64_t AntSeek::getChunkHash(const FileEntry& file, bool fromStart) {
+    auto mode = fromStart ? HashCache::ChunkMode::First : HashCache::ChunkMode::Last;
+    uint64_t hash;
+    if (hashCache && hashCache->getChunkHash(file, mode, config.hashSize, hash)) {
+        return hash;
+    }
 
-    while (dirQueue->pop(current, st)) {
+    hash = HashUtils::hashFromFileChunk(file.path, config.hashSize, fromStart);
+    if (hashCache) {
+        hashCache->putChunkHash(file, mode, config.hashSize, hash);
+    }
+    return hash;
+}
+
+uint64_t AntSeek::getSparseHash(const FileEntry& file) {
+    auto blockSize = hashCascade->getBlockSize();
+    uint64_t hash;
+    if (hashCache && hashCache->getChunkHash(file, HashCache::ChunkMode::Sparse, blockSize, hash)) {
+        return hash;
+    }
+
+    hash = HashUtils::hashSparseChunks(file.path, file.size, blockSize, HashCascade::sparseSampleCount);
+    if (hashCache) {
+        hashCache->putChunkHash(file, HashCache::ChunkMode::Sparse, blockSize, hash);
+    }
+    return hash;
+}
+
+XXH128_hash_t AntSeek::getFullHash(const FileEntry& file) {
+    XXH128_hash_t digest;
+    if (hashCache && hashCache->getFullHash(file, digest)) {
+        return digest;
+    }
+
+    digest = HashUtils::hashFile(file.path, getSegmentPool(file.device));
+    if (hashCache) {
+        hashCache->putFullHash(file, digest);
+    }
+    return digest;
+}
+
+void AntSeek::cacheFullHash(const FileEntry& file) {
+    XXH128_hash_t digest;
+    if (hashCache->getFullHash(file, digest)) {
+        return;
+    }
+
+    try {
+        hashCache->putFullHash(file, HashUtils::hashFile(file.path, getSegmentPool(file.device)));
+    }
+    catch (const std::exception& e) {
+        LoggingUtils::writeToStderr(std::string("[ERROR] Failed to hash file: ") + file.path.string() + " (" + e.what() + ")");
+    }
+}
+
+// A group compare keeps the files of a bucket open together: the descriptor limit is raised as far as allowed,
+// and shared by the comparers, leaving a good part to the other stages
+void AntSeek::setGroupOpenLimit(int comparerCount) {
+#ifdef __linux__
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        if (limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+            ::getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        auto perComparer = limit.rlim_cur / (4 * static_cast<rlim_t>(std::max(1, comparerCount)));
+        groupOpenLimit = static_cast<size_t>(std::clamp<rlim_t>(perComparer, 2, 1024));
+    }
+#else
+    (void)comparerCount;
+#endif
+}
+
+// Reading the segments of a file in parallel only makes a disk seek back and forth
+WorkerPool* AntSeek::getSegmentPool(std::uint64_t device) const {
+    if (!segmentPool || DeviceUtils::getDeviceClass(device) == DeviceUtils::DeviceClass::Rotational) {
+        return nullptr;
+    }
+    return segmentPool.get();
+}
+
+void AntSeek::fileCollectorThread(std::stop_token st, int threadIndex) {
+    DirectoryTask task;
+    const fs::path& current = task.path;
+    DirectoryUtils::Entry entry;
+    std::vector<std::string> names;
+    std::vector<FileEntry> files;
+    std::vector<MetadataUtils::Request> requests;
+    std::vector<FileId> ids;
+    auto resolver = MetadataUtils::createResolver(config.metadataEngine, metadataPool.get());
+
+    while (dirQueue->pop(threadIndex, task, st)) {
         try {
-            for (const auto& entry : fs::directory_iterator(current)) {
+            if (fileWatcher) {
+                fileWatcher->addDirectory(current); // Before listing, so no change in between is missed
+            }
+
+            DirectoryUtils::DirectoryReader dir(current);
+            names.clear();
+            files.clear();
+            requests.clear();
+
+            while (dir.next(entry)) {
                 if (st.stop_requested()) return;
 
-                if (entry.is_directory()) {
-                    dirQueue->push(entry.path());
-                }
-                else if (entry.is_regular_file()) {
-                    auto fn = StringUtils::pathToString(entry.path().filename());
-                    if (RegexUtils::matchesAnyPattern(fn, config.filenamePatterns)) {
-
-                        switch (config.operationMode) {
-                            case Config::OperationMode::ListFiles:
-                            {
-                                std::lock_guard lock(results_mtx);
-                                results.push_back(entry.path());
-                            }
-                            break;
-                        case Config::OperationMode::CompareToFile:
-                            {
-                                auto fileSize = entry.file_size();
-                                if ((referenceFileSize <= fileSize) &&
-                                    (config.matchContent != Config::MatchContent::Full || fileSize == referenceFileSize) &&
-                                    (!config.matchSize || fileSize == referenceFileSize) &&
-                                    (!config.matchFilename || fn == referenceFileName) &&
-                                    (config.hashMode == Config::HashMode::None ||
-                                        referenceFileHash == HashUtils::hashFromFileChunk(entry, config.hashSize, config.hashMode == Config::HashMode::First)))
-                                {
-                                    fileQueue.pushPassthrough(entry);
-                                }
-                            }
-                            break;
-                        case Config::OperationMode::AllVsAll:
-                            if (config.matchFilename) {
-                                if (config.matchSize) {
-                                    fileQueue.push(std::make_pair(entry.file_size(), fn), entry);
-                                }
-                                else {
-                                    fileQueue.push(fn, entry);
-                                }
-                            }
-                            else if (config.matchSize) {
-                                fileQueue.push(entry.file_size(), entry);
-                            }
-                            else {
-                                fileQueue.pushPassthrough(entry);
-                            }
-                            break;
-                        default:
-                            throw std::runtime_error("Unknown operation mode");
-                        }
+                if (entry.type == DirectoryUtils::EntryType::Directory) {
+                    // Pruned subtrees are never queued, let alone listed
+                    if ((config.maxDepth < 0 || task.depth < config.maxDepth) && !config.excludedDirectories.matches(entry.name)) {
+                        dirQueue->push(threadIndex, { dir.path(entry), task.depth + 1 });
                     }
                 }
+                else if (entry.type == DirectoryUtils::EntryType::RegularFile && config.filenameMatcher.matches(entry.name)) {
+                    names.emplace_back(entry.name);
+                    files.push_back({ dir.path(entry) });
+                    requests.push_back({ nullptr, nullptr, MetadataUtils::fromEntry(entry, files.back()) });
+                }
+            }
+
+            if (files.empty()) {
+                continue;
             }
+
+            // The metadata of the whole directory is resolved in one batch, after the listing is complete
+            for (size_t i = 0; i < files.size(); ++i) {
+                requests[i].name = names[i].c_str();
+                requests[i].file = &files[i];
+            }
+            if (collectFileMetadata) {
+                resolver->resolve(dir, requests);
+            }
+
+            // The files kept are moved to the front, and added to the table and the queue as one batch
+            size_t kept = 0;
+            for (size_t i = 0; i < files.size(); ++i) {
+                if (collectFileMetadata && !requests[i].resolved) {
+                    LoggingUtils::writeToStderr("[ERROR] Failed to get metadata of file: " + files[i].path.string());
+                    continue;
+                }
+                if (!passesFileFilters(files[i])) {
+                    continue;
+                }
+                if (kept != i) {
+                    names[kept] = std::move(names[i]);
+                    files[kept] = std::move(files[i]);
+                }
+                ++kept;
+            }
+            if (kept == 0) {
+                continue;
+            }
+
+            names.resize(kept);
+            files.resize(kept);
+            auto first = fileTable.add(fileTable.addDirectory(current), names, files);
+            collectFiles(first, kept, ids);
         }
         catch (const std::exception& e) {
             // TODO: skip?, log?
@@ -293,51 +967,146 @@ void AntSeek::fileCollectorThread(std::stop_token st) {
 
     if (activeFileCollectorCount.fetch_sub(1) == 1) {
         fileQueue.setFinished();
+        hashQueue.setCollected();
+    }
+}
+
+// Hands the files of a directory, IDs first to first + count - 1, to the next stage
+void AntSeek::collectFiles(FileId first, size_t count, std::vector<FileId>& ids) {
+    ids.clear();
+    for (FileId file = first; file < first + count; ++file) {
+        // Reading the same inode through several paths would only find it equal to itself
+        if (readsFileContent && !fileIdentities.claim(file, fileTable.device(file), fileTable.inode(file),
+            config.matchFilename ? fileTable.name(file) : std::string_view{})) {
+            continue;
+        }
+
+        if (config.operationMode == Config::OperationMode::CompareToFile) {
+            std::optional<uint64_t> chunkHash;
+            std::vector<uint32_t> candidates;
+            for (uint32_t reference = 0; reference < references.size(); ++reference) {
+                if (acceptsReference(references[reference], file, chunkHash)) {
+                    candidates.push_back(reference);
+                }
+            }
+            if (candidates.empty())
+                continue;
+            if (candidates.size() < references.size()) {
+                std::lock_guard lock(results_mtx);
+                referenceCandidates[file] = std::move(candidates);
+            }
+        }
+        ids.push_back(file);
+    }
+
+    switch (config.operationMode) {
+    case Config::OperationMode::ListFiles:
+        {
+            std::lock_guard lock(results_mtx);
+            results.insert(results.end(), ids.begin(), ids.end());
+        }
+        break;
+    case Config::OperationMode::CompareToFile:
+        fileQueue.pushPassthrough(ids);
+        break;
+    case Config::OperationMode::AllVsAll:
+        hashQueue.addToGroups(ids);
+        if (config.matchFilename) {
+            if (config.matchSize) {
+                fileQueue.push(ids, [this](FileId file) { return std::make_pair(fileTable.size(file), fileTable.name(file)); });
+            }
+            else {
+                fileQueue.push(ids, [this](FileId file) { return fileTable.name(file); });
+            }
+        }
+        else if (config.matchSize) {
+            fileQueue.push(ids, [this](FileId file) { return fileTable.size(file); });
+        }
+        else {
+            fileQueue.pushPassthrough(ids);
+        }
+        break;
+    default:
+        throw std::runtime_error("Unknown operation mode");
     }
 }
 
 void AntSeek::hashCalculatorThread(std::stop_token st) {
-    fs::directory_entry current;
-    bool justCollect = (config.matchContent == Config::MatchContent::None);
+    FileId current;
+    bool justCollect = !comparesContent;
+    std::vector<FileId> escalated;
+    std::string key;
+    std::vector<ContentChunker::Chunk> chunks;
 
     while (fileQueue.pop(current, st)) {
         if (st.stop_requested()) return;
 
-        if (config.hashMode == Config::HashMode::None) {
+        if (chunkIndex) {
+            indexChunks(current, chunks);
+            fileQueue.setProcessed(current);
+            continue;
+        }
+
+        if (hashCascade) {
+            runCascadeStage(current, justCollect, escalated);
+            fileQueue.setProcessed(current);
+            continue;
+        }
+
+        auto fn = fileTable.name(current);
+        auto size = fileTable.size(current);
+        if (config.hashMode == Config::HashMode::Full) {
+            // Every candidate is read exactly once, the groups are formed by the digest
+            try {
+                auto digest = getFullHash(fileTable.entry(current));
+                key.clear();
+                if (config.matchFilename) {
+                    HashUtils::appendKey(key, std::make_tuple(size, fn, digest.low64, digest.high64));
+                }
+                else {
+                    HashUtils::appendKey(key, std::make_tuple(size, digest.low64, digest.high64));
+                }
+                hashQueue.push(key, current, justCollect);
+            }
+            catch (const std::exception& e) {
+                LoggingUtils::writeToStderr(std::string("[ERROR] Failed to hash file: ") + fileTable.path(current).string() + " (" + e.what() + ")");
+            }
+        }
+        else if (config.hashMode == Config::HashMode::None) {
             if (config.matchFilename) {
-                auto fn = StringUtils::pathToString(current.path().filename());
                 if (config.matchSize) {
-                    hashQueue.push(std::make_pair(current.file_size(), fn), current.path(), justCollect);
+                    hashQueue.push(std::make_pair(size, fn), current, justCollect);
                 }
                 else {
-                    hashQueue.push(fn, current.path(), justCollect);
+                    hashQueue.push(fn, current, justCollect);
                 }
             }
             else if (config.matchSize) {
-                hashQueue.push(current.file_size(), current.path(), justCollect);
+                hashQueue.push(size, current, justCollect);
             }
             else {
-                hashQueue.pushPassthrough(current.path());
+                hashQueue.pushPassthrough(current);
             }
         }
         else {
-            uint64_t hash = HashUtils::hashFromFileChunk(current, config.hashSize, config.hashMode == Config::HashMode::First);
+            uint64_t hash = getChunkHash(fileTable.entry(current), config.hashMode == Config::HashMode::First);
             if (config.matchFilename) {
-                auto fn = StringUtils::pathToString(current.path().filename());
                 if (config.matchSize) {
-                    hashQueue.push(std::make_tuple(current.file_size(), fn, hash), current.path(), justCollect);
+                    hashQueue.push(std::make_tuple(size, fn, hash), current, justCollect);
                 }
                 else {
-                    hashQueue.push(std::make_pair(fn, hash), current.path(), justCollect);
+                    hashQueue.push(std::make_pair(fn, hash), current, justCollect);
                 }
             }
             else if (config.matchSize) {
-                hashQueue.push(std::make_pair(current.file_size(), hash), current.path(), justCollect);
+                hashQueue.push(std::make_pair(size, hash), current, justCollect);
             }
             else {
-                hashQueue.push(hash, current.path(), justCollect);
+                hashQueue.push(hash, current, justCollect);
             }
         }
+        hashQueue.settle(current);
+        fileQueue.setProcessed(current);
     }
 
     if (activeHashCalculatorCount.fetch_sub(1) == 1) {
@@ -345,26 +1114,146 @@ void AntSeek::hashCalculatorThread(std::stop_token st) {
     }
 }
 
-void AntSeek::compareContentThread(std::stop_token st) {
-    std::pair<fs::path, fs::path> current;
+// Runs the next stage of the hash cascade on a file. After the full hash it moves on to the compare stage,
+// before that it is pushed to the file queue again if its bucket still collides.
+void AntSeek::runCascadeStage(FileId current, bool justCollect, std::vector<FileId>& escalated) {
+    auto size = fileTable.size(current);
+    HashCascade::Progress progress;
+    if (!hashCascade->take(current, progress)) {
+        // The key of the file queue bucket the file comes from
+        progress.stage = hashCascade->firstStage(size);
+        if (config.matchFilename) {
+            HashUtils::appendKey(progress.key, std::make_pair(size, fileTable.name(current)));
+        }
+        else {
+            HashUtils::appendKey(progress.key, size);
+        }
+    }
 
-    while (hashQueue.pop(current, st)) {
-        if (st.stop_requested()) return;
+    auto file = fileTable.entry(current);
+    try {
+        switch (progress.stage) {
+        case HashCascade::Stage::First:
+            HashUtils::appendKey(progress.key, getChunkHash(file, true));
+            break;
+        case HashCascade::Stage::Last:
+            HashUtils::appendKey(progress.key, getChunkHash(file, false));
+            break;
+        case HashCascade::Stage::Sparse:
+            HashUtils::appendKey(progress.key, getSparseHash(file));
+            break;
+        case HashCascade::Stage::Full:
+            {
+                auto digest = getFullHash(file);
+                HashUtils::appendKey(progress.key, std::make_pair(digest.low64, digest.high64));
+            }
+            break;
+        }
+    }
+    catch (const std::exception& e) {
+        LoggingUtils::writeToStderr(std::string("[ERROR] Failed to hash file: ") + file.path.string() + " (" + e.what() + ")");
+        hashQueue.settle(current);
+        return;
+    }
 
-        if (groupHandler.shouldItProcess(current.first, current.second)) {
-            switch (CompareUtils::compareFileContents(current.first, current.second)) {
-            case CompareUtils::MatchResult::Match:
-                groupHandler.addSame(current.first, current.second);
-                break;
-            case CompareUtils::MatchResult::NoMatch:
-                groupHandler.addDifferent(current.first, current.second);
-                break;
-            case CompareUtils::MatchResult::Error:
-                LoggingUtils::writeToStderr("[ERROR] Error comparing files: " + current.first.string() + " and " + current.second.string());
-                break;
+    escalated.clear();
+    if (progress.stage == HashCascade::Stage::Full) {
+        hashQueue.push(progress.key, current, justCollect);
+    }
+    hashCascade->record(current, size, std::move(progress), escalated);
+
+    // The file settles unless it goes on to its next stage, and a file escalated along with it settled before
+    bool again = std::find(escalated.begin(), escalated.end(), current) != escalated.end();
+    auto settled = (again ? 0 : 1) - static_cast<std::ptrdiff_t>(escalated.size() - (again ? 1 : 0));
+    hashQueue.settle(current, settled);
+    fileQueue.pushPassthrough(escalated);
+}
+
+// Chunks a file in one pass and adds its chunk fingerprints to the index
+void AntSeek::indexChunks(FileId current, std::vector<ContentChunker::Chunk>& chunks) {
+    auto path = fileTable.path(current);
+    chunks.clear();
+    try {
+        ContentChunker::chunkFile(path, chunks);
+    }
+    catch (const std::exception& e) {
+        LoggingUtils::writeToStderr(std::string("[ERROR] Failed to chunk file: ") + path.string() + " (" + e.what() + ")");
+        return;
+    }
+    chunkIndex->add(current, chunks);
+}
+
+// Sorts a bucket into classes of equal content, reading its files together (see CompareUtils::compareGroup).
+// With a hash cache, the files with a cached digest are not read: the first one of each digest is compared with
+// the files to read, the others follow it. Every file read gets its digest cached.
+void AntSeek::compareGroup(const std::vector<FileId>& files) {
+    // Verifying files grouped by their digest, the digests agree by definition
+    bool useCache = hashCache && !(config.verify && config.hashesFullContent());
+    std::vector<FileId> toRead;
+    size_t uncached = 0;
+    if (useCache) {
+        std::unordered_map<std::pair<uint64_t, uint64_t>, FileId, HashUtils::pairHash> firstByDigest;
+        for (auto file : files) {
+            XXH128_hash_t digest;
+            if (!hashCache->getFullHash(fileTable.entry(file), digest)) {
+                ++uncached;
+            }
+            else if (auto [it, inserted] = firstByDigest.try_emplace({ digest.low64, digest.high64 }, file); !inserted) {
+                groupHandler.addSame(it->second, file);
+                continue;
+            }
+            toRead.push_back(file);
+        }
+        if (uncached == 0) {
+            return;
+        }
+    }
+    else {
+        toRead = files;
+    }
+
+    std::vector<fs::path> paths;
+    for (auto file : toRead) {
+        paths.push_back(fileTable.path(file));
+    }
+    auto result = CompareUtils::compareGroup(paths, useCache, getSegmentPool(fileTable.entry(toRead.front()).device), groupOpenLimit);
+
+    std::vector<bool> decided(toRead.size(), false);
+    for (size_t c = 0; c < result.classes.size(); ++c) {
+        const auto& members = result.classes[c];
+        for (auto i : members) {
+            if (i != members.front()) {
+                groupHandler.addSame(toRead[members.front()], toRead[i]);
+            }
+            if (useCache) {
+                hashCache->putFullHash(fileTable.entry(toRead[i]), result.digests[c]);
+            }
+            decided[i] = true;
+        }
+    }
+    for (auto i : result.failed) {
+        LoggingUtils::writeToStderr("[ERROR] Error comparing file: " + paths[i].string());
+        decided[i] = true;
+    }
+
+    if (useCache) {
+        // Digest the unique candidates in full once, so the next run can tell them apart without reading them
+        for (size_t i = 0; i < toRead.size(); ++i) {
+            if (!decided[i]) {
+                cacheFullHash(fileTable.entry(toRead[i]));
             }
         }
-        hashQueue.setProcessed(current);
+    }
+}
+
+void AntSeek::compareContentThread(std::stop_token st) {
+    PairQueue::Task task;
+
+    while (hashQueue.pop(task, st)) {
+        if (st.stop_requested()) return;
+
+        compareGroup(task.bucket->files);
+        hashQueue.setProcessed(task);
     }
 
     if (activeComparerCount.fetch_sub(1) == 1) {
@@ -373,29 +1262,64 @@ void AntSeek::compareContentThread(std::stop_token st) {
 }
 
 void AntSeek::compareContentFlexibleThread(std::stop_token st) {
-    fs::directory_entry current;
+    FileId current;
+    std::vector<uint32_t> candidates;
+    std::vector<char> found;
 
     while (fileQueue.pop(current, st)) {
         if (st.stop_requested()) return;
 
-        CompareUtils::MatchResult res;
+        // The references the file may match are looked for, the others count as found already
+        candidates.clear();
+        {
+            std::lock_guard lock(results_mtx);
+            auto it = referenceCandidates.find(current);
+            if (it != referenceCandidates.end()) {
+                candidates = std::move(it->second);
+                referenceCandidates.erase(it);
+            }
+        }
+        if (candidates.empty()) {
+            for (uint32_t reference = 0; reference < references.size(); ++reference) {
+                candidates.push_back(reference);
+            }
+        }
+        found.assign(references.size(), 1);
+        for (auto reference : candidates) {
+            found[reference] = 0;
+        }
+
+        auto path = fileTable.path(current);
+        auto res = CompareUtils::MatchResult::NoMatch;
         switch (config.matchContent) {
             case Config::MatchContent::Begin:
             case Config::MatchContent::Full:
-                res = CompareUtils::compareFileContentsFlexible(current, referenceData, referenceDataMask, false);
-                break;
             case Config::MatchContent::End:
-                res = CompareUtils::compareFileContentsFlexible(current, referenceData, referenceDataMask, true);
+                res = compareReferences(path, found, config.matchContent == Config::MatchContent::End);
                 break;
             case Config::MatchContent::Find:
-                res = CompareUtils::searchInFileContentsFlexible(current, referenceData, referenceDataMask);
+                if (referenceSearcher) {
+                    res = CompareUtils::searchInFileContentsFlexible(path, *referenceSearcher, references.front().size);
+                    found[0] = (res == CompareUtils::MatchResult::Match);
+                }
+                else {
+                    res = CompareUtils::searchInFileContentsFlexible(path, *multiReferenceSearcher, found);
+                }
+                break;
+            case Config::MatchContent::None:
+            case Config::MatchContent::Similar: // AllVsAll only
                 break;
         }
 
         if (res == CompareUtils::MatchResult::Match) {
             std::lock_guard lock(results_mtx);
-            results.push_back(current);
+            for (auto reference : candidates) {
+                if (found[reference]) {
+                    referenceMatches.emplace_back(current, reference);
+                }
+            }
         }
+        fileQueue.setProcessed(current);
     }
 
     if (activeComparerCount.fetch_sub(1) == 1) {
@@ -19,18 +19,44 @@ constexpr const char* ArgOpt_match_hash = "--match-hash";
 constexpr const char* ArgOpt_compare_content = "--compare-content";
 constexpr const char* ArgOpt_compare_to = "--compare-to";
 constexpr const char* ArgOpt_set_joker = "--set-joker";
+constexpr const char* ArgOpt_compile = "--compile";
+constexpr const char* ArgOpt_reference_db = "--reference-db";
+constexpr const char* ArgOpt_reference_window = "--reference-window";
 constexpr const char* ArgOpt_compare_everything = "--compare-everything";
 constexpr const char* ArgOpt_output_format = "--output-format";
+constexpr const char* ArgOpt_metadata_engine = "--metadata-engine";
+constexpr const char* ArgOpt_page_cache = "--page-cache";
+constexpr const char* ArgOpt_mmap = "--mmap";
+constexpr const char* ArgOpt_hash_cache = "--hash-cache";
+constexpr const char* ArgOpt_watch = "--watch";
+constexpr const char* ArgOpt_verify = "--verify";
+constexpr const char* ArgOpt_exclude_dirs = "--exclude-dirs";
+constexpr const char* ArgOpt_max_depth = "--max-depth";
+constexpr const char* ArgOpt_min_size = "--min-size";
+constexpr const char* ArgOpt_max_size = "--max-size";
+constexpr const char* ArgOpt_newer_than = "--newer-than";
+constexpr const char* ArgOpt_older_than = "--older-than";
 constexpr const char* ArgOpt_help = "--help";
 constexpr const char* ArgOpt_version = "--version";
 
 constexpr const char* ArgVal_match_hash_first = "first";
 constexpr const char* ArgVal_match_hash_last = "last";
+constexpr const char* ArgVal_match_hash_cascade = "cascade";
+constexpr const char* ArgVal_match_hash_full = "full";
 
 constexpr const char* ArgVal_compare_content_full = "full";
 constexpr const char* ArgVal_compare_content_begin = "begin";
 constexpr const char* ArgVal_compare_content_end = "end";
 constexpr const char* ArgVal_compare_content_find = "find";
+constexpr const char* ArgVal_compare_content_similar = "similar";
+
+constexpr const char* ArgVal_metadata_engine_sync = "sync";
+constexpr const char* ArgVal_metadata_engine_uring = "uring";
+constexpr const char* ArgVal_metadata_engine_threads = "threads";
+
+constexpr const char* ArgVal_page_cache_keep = "keep";
+constexpr const char* ArgVal_page_cache_drop = "drop";
+constexpr const char* ArgVal_page_cache_direct = "direct";
 
 constexpr const char* ArgOpt_output_format_pipe = "pipe";
 constexpr const char* ArgOpt_output_format_tsv = "tsv";
@@ -52,18 +78,57 @@ int main(int argc, char* argv[]) {
             << ArgOpt_output_format << " <pipe|tsv|grouped>         Output format (default: pipe)\n"
             << ArgOpt_directories << " <dir1> <dir2> ...            Directories to process\n"
             << ArgOpt_filenames << " <pattern1> <pattern2> ...      Filename patterns to match (expects C++ regex syntax)\n"
+            << ArgOpt_exclude_dirs << " <pattern1> <pattern2> ...   Directory name patterns not to descend into (e.g. \"\\.git\" \"node_modules\")\n"
+            << ArgOpt_max_depth << " <n>                            Directory levels to descend below the given directories (0: no subdirectories)\n"
+            << ArgOpt_min_size << " <size>                          Skip files smaller than this (e.g. 1M)\n"
+            << ArgOpt_max_size << " <size>                          Skip files larger than this\n"
+            << ArgOpt_newer_than << " <time>                        Skip files modified before this (e.g. 2024-01-31, \"2024-01-31 13:45\", 7d)\n"
+            << ArgOpt_older_than << " <time>                        Skip files modified after this\n"
             << ArgOpt_match_filenames << "                          Match files based on their filenames\n"
             << ArgOpt_match_size << "                               Match files based on their size\n"
-            << ArgOpt_match_hash << " <first|last> <size>           Compare files by hashing the first or last N bytes (default: 4k)\n"
-            << ArgOpt_compare_content << " <full|begin|end|find>    Enables file comparison based on content.\n"
+            << ArgOpt_match_hash << " <first|last|cascade|full> <size>\n"
+            "                                           Compare files by hashing the first or last N bytes (default: 4k)\n"
+            "                                             - cascade: Hashes files of equal size in stages (first block, last block, sparse\n"
+            "                                               samples, full content), each stage only for files still alike after the previous one.\n"
+            "                                               Requires " << ArgOpt_compare_everything << ", prints per-stage statistics to stderr.\n"
+            "                                             - full: Reads every file of a repeated size once, and groups the files by their full\n"
+            "                                               content hash (XXH3-128). Requires " << ArgOpt_compare_everything << ".\n"
+            << ArgOpt_verify << "                                   Byte-compare each file grouped by full content hash against its group (cascade, full).\n"
+            << ArgOpt_compare_content << " <full|begin|end|find|similar> <percent>\n"
+            "                                           Enables file comparison based on content.\n"
             "                                             - full: Compares the full content of each file.\n"
-            "                                             - begin, end, find: Must be used together with the --compare-to option.\n"
+            "                                             - similar: Splits each file into content-defined chunks, and reports the pairs of files\n"
+            "                                               sharing at least the given percent of the smaller one (default: 50), with the bytes\n"
+            "                                               shared. Requires " << ArgOpt_compare_everything << ", can't be combined with " << ArgOpt_match_hash << ".\n"
+            "                                             - begin, end, find: Must be used together with the --compare-to or --reference-db option.\n"
             "                                               - begin: Checks if the specified file's content appears at the beginning of each target file.\n"
             "                                               - end: Checks if the specified file's content appears at the end of each target file.\n"
             "                                               - find: Searches for the specified file's content anywhere within each target file.\n"
-            << ArgOpt_compare_to << " <file>                        Compare files based on the specified file's content.\n"
+            << ArgOpt_compare_to << " <file|dir> ...                Compare files based on the content of the reference files (a directory: every file in it).\n"
+            "                                           With several references each file is read once for all of them, and each match is\n"
+            "                                           listed with its reference.\n"
+            << ArgOpt_compile << " <file>                           Compile the " << ArgOpt_compare_to << " references (content, joker masks, search tables) into a\n"
+            "                                           database file and exit. Needs no directories or filenames.\n"
+            << ArgOpt_reference_db << " <file>                      Compare files to the references of a database made with " << ArgOpt_compile << ", instead of\n"
+            "                                           " << ArgOpt_compare_to << ": it is mapped, nothing is read or built at startup.\n"
+            << ArgOpt_reference_window << " <size>                  References larger than this are not loaded for begin, end and full, but read\n"
+            "                                           along with each file a window of this size at a time (default: 64M).\n"
             << ArgOpt_set_joker << " <value>                        Hexadecimal joker value to ignore during comparison (e.g. 0x000000FF; high-order bytes first).\n"
             << ArgOpt_compare_everything << "                       Compare each file against every other file.\n"
+            << ArgOpt_metadata_engine << " <sync|uring|threads>     How file metadata is queried during the scan (default: sync).\n"
+            "                                             - sync: One query after the other, best for local disks.\n"
+            "                                             - uring: Batches the queries of a directory with io_uring (falls back to threads if unavailable).\n"
+            "                                             - threads: Spreads the queries over a pool of helper threads.\n"
+            "                                             The batch engines help on high-latency mounts (e.g. NFS).\n"
+            << ArgOpt_page_cache << " <keep|drop|direct>          What reading the file contents leaves in the page cache (default: drop).\n"
+            "                                             - keep: Leaves caching to the system.\n"
+            "                                             - drop: Drops the pages read as it goes, so other programs keep their cached data.\n"
+            "                                             - direct: Reads around the page cache (O_DIRECT) where the filesystem supports it.\n"
+            << ArgOpt_mmap << " <size>                              Memory-map local files of at least this size instead of reading them (default: off).\n"
+            "                                           A file truncated during the scan then aborts the program.\n"
+            << ArgOpt_hash_cache << " <file>                        Persistent cache of file hashes, so that unchanged files are not read again on later runs.\n"
+            << ArgOpt_watch << "                                    Keep watching the directories after the scan and report group changes\n"
+            "                                             ('+' / '-' prefixed lines). Requires " << ArgOpt_compare_everything << " (Linux only).\n"
             "\n"
             "When '" << ArgOpt_compare_everything << "' and '" << ArgOpt_compare_content << " " << ArgVal_compare_content_full <<
             "' is used, the program implicitly activates both '" << ArgOpt_match_size << "' and '" << ArgOpt_match_hash << " " << ArgVal_match_hash_first <<
@@ -101,6 +166,35 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (args.has(ArgOpt_compile)) {
+        if (args.getValueCount(ArgOpt_compile) != 1) {
+            std::cout << "Error: The " << ArgOpt_compile << " option requires exactly one file.\n";
+            return 1;
+        }
+        if (args.getValueCount(ArgOpt_compare_to) == 0) {
+            std::cout << "Error: The " << ArgOpt_compile << " option requires " << ArgOpt_compare_to << ".\n";
+            return 1;
+        }
+
+        AntSeek::Config config;
+        for (const auto& reference : args.getList(ArgOpt_compare_to)) {
+            config.compareToFiles.emplace_back(reference);
+        }
+        if (args.has(ArgOpt_set_joker)) {
+            config.jokerBytes = StringUtils::hexStringToBytes(args.get(ArgOpt_set_joker));
+        }
+
+        try {
+            AntSeek as(config);
+            as.compileReferences(args.get(ArgOpt_compile));
+        }
+        catch (const std::runtime_error& e) {
+            std::cout << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
     if (args.getValueCount(ArgOpt_directories) == 0) {
         std::cout << "Error: No " << ArgOpt_directories << " specified.\n";
         return 1;
@@ -116,6 +210,27 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (args.has(ArgOpt_compare_everything) && args.has(ArgOpt_reference_db)) {
+        std::cout << "Error: Invalid combination of options: " << ArgOpt_compare_everything << " and " << ArgOpt_reference_db << " cannot be used together.\n";
+        return 1;
+    }
+
+    if (args.has(ArgOpt_compare_to) && args.has(ArgOpt_reference_db)) {
+        std::cout << "Error: Invalid combination of options: " << ArgOpt_compare_to << " and " << ArgOpt_reference_db << " cannot be used together.\n";
+        return 1;
+    }
+
+    if (args.has(ArgOpt_reference_db) && args.has(ArgOpt_set_joker)) {
+        std::cout << "Error: Invalid combination of options: " << ArgOpt_set_joker << " and " << ArgOpt_reference_db << " cannot be used together"
+            " (the jokers are those the database was compiled with).\n";
+        return 1;
+    }
+
+    if (args.has(ArgOpt_reference_window) && !args.has(ArgOpt_compare_to) && !args.has(ArgOpt_reference_db)) {
+        std::cout << "Error: Invalid combination of options: " << ArgOpt_reference_window << " requires " << ArgOpt_compare_to << " or " << ArgOpt_reference_db << ".\n";
+        return 1;
+    }
+
     if (args.has(ArgOpt_set_joker) && !args.has(ArgOpt_compare_to)) {
         std::cout << "Error: Invalid combination of options: " << ArgOpt_set_joker << " requires " << ArgOpt_compare_to << ".\n";
         return 1;
@@ -138,27 +253,117 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
-        if (args.has(ArgOpt_compare_content) && args.get(ArgOpt_compare_content) != ArgVal_compare_content_full) {
-            std::cout << "Error: The " << ArgOpt_compare_everything << " option can only be used with " << ArgOpt_compare_content << " if set to " << ArgVal_compare_content_full << ".\n";
+        if (args.has(ArgOpt_compare_content) && args.get(ArgOpt_compare_content) != ArgVal_compare_content_full &&
+            args.get(ArgOpt_compare_content) != ArgVal_compare_content_similar) {
+            std::cout << "Error: The " << ArgOpt_compare_everything << " option can only be used with " << ArgOpt_compare_content << " if set to " <<
+                ArgVal_compare_content_full << " or " << ArgVal_compare_content_similar << ".\n";
             return 1;
         }
     }
 
+    if (args.has(ArgOpt_compare_content) && args.get(ArgOpt_compare_content) == ArgVal_compare_content_similar) {
+        if (!args.has(ArgOpt_compare_everything)) {
+            std::cout << "Error: " << ArgOpt_compare_content << " " << ArgVal_compare_content_similar << " requires " << ArgOpt_compare_everything << ".\n";
+            return 1;
+        }
+        if (args.has(ArgOpt_match_hash) || args.has(ArgOpt_watch)) {
+            std::cout << "Error: " << ArgOpt_compare_content << " " << ArgVal_compare_content_similar << " can't be combined with " <<
+                ArgOpt_match_hash << " or " << ArgOpt_watch << ".\n";
+            return 1;
+        }
+    }
+
+    if (args.has(ArgOpt_watch)) {
+        if (args.getValueCount(ArgOpt_watch) > 0) {
+            std::cout << "Error: The " << ArgOpt_watch << " option does not accept any parameters.\n";
+            return 1;
+        }
+        if (!args.has(ArgOpt_compare_everything)) {
+            std::cout << "Error: The " << ArgOpt_watch << " option requires " << ArgOpt_compare_everything << ".\n";
+            return 1;
+        }
+    }
+
+    bool hashesFullContent = args.has(ArgOpt_match_hash) &&
+        (args.get(ArgOpt_match_hash) == ArgVal_match_hash_cascade || args.get(ArgOpt_match_hash) == ArgVal_match_hash_full);
+    if (hashesFullContent && !args.has(ArgOpt_compare_everything)) {
+        std::cout << "Error: " << ArgOpt_match_hash << " " << args.get(ArgOpt_match_hash) << " requires " << ArgOpt_compare_everything << ".\n";
+        return 1;
+    }
+
+    if (args.has(ArgOpt_verify)) {
+        if (args.getValueCount(ArgOpt_verify) > 0) {
+            std::cout << "Error: The " << ArgOpt_verify << " option does not accept any parameters.\n";
+            return 1;
+        }
+        if (!hashesFullContent) {
+            std::cout << "Error: The " << ArgOpt_verify << " option requires " << ArgOpt_match_hash << " " << ArgVal_match_hash_cascade <<
+                " or " << ArgVal_match_hash_full << ".\n";
+            return 1;
+        }
+    }
+
+    if (args.has(ArgOpt_compare_to) && args.getValueCount(ArgOpt_compare_to) == 0) {
+        std::cout << "Error: No reference files specified for " << ArgOpt_compare_to << ".\n";
+        return 1;
+    }
+
     if (args.has(ArgOpt_compare_to) && !args.has(ArgOpt_compare_content)) {
         std::cout << "Error: The " << ArgOpt_compare_to << " option requires option " << ArgOpt_compare_content << ".\n";
         return 1;
     }
 
+    if (args.has(ArgOpt_reference_db) && args.getValueCount(ArgOpt_reference_db) != 1) {
+        std::cout << "Error: The " << ArgOpt_reference_db << " option requires exactly one file.\n";
+        return 1;
+    }
+
+    if (args.has(ArgOpt_reference_db) && !args.has(ArgOpt_compare_content)) {
+        std::cout << "Error: The " << ArgOpt_reference_db << " option requires option " << ArgOpt_compare_content << ".\n";
+        return 1;
+    }
+
     AntSeek::Config config;
     config.setDirectories(args.getList(ArgOpt_directories));
     config.setFilenamePatterns(args.getList(ArgOpt_filenames));
     config.matchFilename = args.has(ArgOpt_match_filenames);
     config.matchSize = args.has(ArgOpt_match_size);
+    config.watch = args.has(ArgOpt_watch);
+    config.verify = args.has(ArgOpt_verify);
+
+    if (args.has(ArgOpt_exclude_dirs)) {
+        config.setExcludedDirectories(args.getList(ArgOpt_exclude_dirs));
+    }
+
+    try {
+        if (args.has(ArgOpt_max_depth)) {
+            config.maxDepth = std::stoi(args.get(ArgOpt_max_depth));
+            if (config.maxDepth < 0) {
+                throw std::invalid_argument("Negative depth");
+            }
+        }
+        if (args.has(ArgOpt_min_size)) {
+            config.minFileSize = StringUtils::parseSizeString(args.get(ArgOpt_min_size));
+        }
+        if (args.has(ArgOpt_max_size)) {
+            config.maxFileSize = StringUtils::parseSizeString(args.get(ArgOpt_max_size));
+        }
+        if (args.has(ArgOpt_newer_than)) {
+            config.minMtimeNs = StringUtils::parseTimeString(args.get(ArgOpt_newer_than));
+        }
+        if (args.has(ArgOpt_older_than)) {
+            config.maxMtimeNs = StringUtils::parseTimeString(args.get(ArgOpt_older_than));
+        }
+    }
+    catch (const std::exception& e) {
+        std::cout << "Error: Invalid filter value: " << e.what() << "\n";
+        return 1;
+    }
 
     if (args.has(ArgOpt_compare_everything)) {
         config.operationMode = AntSeek::Config::OperationMode::AllVsAll;
     }
-    else if (args.has(ArgOpt_compare_to)) {
+    else if (args.has(ArgOpt_compare_to) || args.has(ArgOpt_reference_db)) {
         config.operationMode = AntSeek::Config::OperationMode::CompareToFile;
     }
     else {
@@ -166,13 +371,34 @@ int main(int argc, char* argv[]) {
     }
 
     if (args.has(ArgOpt_compare_to)) {
-        config.compareToFile = args.get(ArgOpt_compare_to);
+        for (const auto& reference : args.getList(ArgOpt_compare_to)) {
+            config.compareToFiles.emplace_back(reference);
+        }
+    }
+
+    if (args.has(ArgOpt_reference_db)) {
+        config.referenceDbFile = args.get(ArgOpt_reference_db);
     }
 
     if (args.has(ArgOpt_set_joker)) {
         config.jokerBytes = StringUtils::hexStringToBytes(args.get(ArgOpt_set_joker));
     }
 
+    if (args.has(ArgOpt_reference_window)) {
+        std::uintmax_t window = 0;
+        try {
+            window = StringUtils::parseSizeString(args.get(ArgOpt_reference_window));
+        }
+        catch (const std::exception&) {
+        }
+        if (window == 0) {
+            std::cout << "Error: Invalid value for " << ArgOpt_reference_window << ": " << args.get(ArgOpt_reference_window) << "\n";
+            return 1;
+        }
+        // Whole pages, the windows are compared under masks of 64 bytes per word and read with direct I/O
+        config.referenceWindowSize = static_cast<size_t>((window + 4095) / 4096 * 4096);
+    }
+
     if (args.has(ArgOpt_compare_content)) {
         std::string content_mode = args.get(ArgOpt_compare_content);
         if (content_mode == ArgVal_compare_content_full) {
@@ -187,6 +413,23 @@ int main(int argc, char* argv[]) {
         else if (content_mode == ArgVal_compare_content_find) {
             config.matchContent = AntSeek::Config::MatchContent::Find;
         }
+        else if (content_mode == ArgVal_compare_content_similar) {
+            config.matchContent = AntSeek::Config::MatchContent::Similar;
+            if (args.getValueCount(ArgOpt_compare_content) > 1) {
+                double percent = 0;
+                try {
+                    percent = std::stod(args.get(ArgOpt_compare_content, 1));
+                }
+                catch (const std::exception&) {
+                    percent = 0;
+                }
+                if (!(percent > 0 && percent <= 100)) {
+                    std::cout << "Error: Invalid similarity percent for " << ArgOpt_compare_content << ": " << args.get(ArgOpt_compare_content, 1) << "\n";
+                    return 1;
+                }
+                config.minSimilarity = percent / 100;
+            }
+        }
         else {
             std::cout << "Error: Invalid value for " << ArgOpt_compare_content << ": " << content_mode << "\n";
             return 1;
@@ -201,6 +444,14 @@ int main(int argc, char* argv[]) {
         else if (hash_mode == ArgVal_match_hash_last) {
             config.hashMode = AntSeek::Config::HashMode::Last;
         }
+        else if (hash_mode == ArgVal_match_hash_cascade) {
+            config.hashMode = AntSeek::Config::HashMode::Cascade;
+            config.matchSize = true; // The stages are chosen by the file size
+        }
+        else if (hash_mode == ArgVal_match_hash_full) {
+            config.hashMode = AntSeek::Config::HashMode::Full;
+            config.matchSize = true; // Files of a unique size are not read at all
+        }
         else {
             std::cout << "Error: Invalid value for " << ArgOpt_match_hash << ": " << hash_mode << "\n";
             return 1;
@@ -225,6 +476,61 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (args.has(ArgOpt_hash_cache)) {
+        if (args.getValueCount(ArgOpt_hash_cache) != 1) {
+            std::cout << "Error: The " << ArgOpt_hash_cache << " option requires exactly one file.\n";
+            return 1;
+        }
+        config.hashCacheFile = args.get(ArgOpt_hash_cache);
+    }
+
+    if (args.has(ArgOpt_metadata_engine)) {
+        std::string engine = args.get(ArgOpt_metadata_engine);
+        if (engine == ArgVal_metadata_engine_sync) {
+            config.metadataEngine = MetadataUtils::Engine::Sync;
+        }
+        else if (engine == ArgVal_metadata_engine_uring) {
+            config.metadataEngine = MetadataUtils::Engine::IoUring;
+        }
+        else if (engine == ArgVal_metadata_engine_threads) {
+            config.metadataEngine = MetadataUtils::Engine::ThreadPool;
+        }
+        else {
+            std::cout << "Error: Invalid value for " << ArgOpt_metadata_engine << ": " << engine << "\n";
+            return 1;
+        }
+    }
+
+    if (args.has(ArgOpt_page_cache)) {
+        std::string policy = args.get(ArgOpt_page_cache);
+        if (policy == ArgVal_page_cache_keep) {
+            config.pageCache = FileReader::CachePolicy::Keep;
+        }
+        else if (policy == ArgVal_page_cache_drop) {
+            config.pageCache = FileReader::CachePolicy::Drop;
+        }
+        else if (policy == ArgVal_page_cache_direct) {
+            config.pageCache = FileReader::CachePolicy::Direct;
+        }
+        else {
+            std::cout << "Error: Invalid value for " << ArgOpt_page_cache << ": " << policy << "\n";
+            return 1;
+        }
+    }
+
+    std::uint64_t mapThreshold = 0;
+    if (args.has(ArgOpt_mmap)) {
+        try {
+            mapThreshold = StringUtils::parseSizeString(args.get(ArgOpt_mmap));
+        }
+        catch (const std::exception&) {
+        }
+        if (mapThreshold == 0) {
+            std::cout << "Error: Invalid value for " << ArgOpt_mmap << ": " << args.get(ArgOpt_mmap) << "\n";
+            return 1;
+        }
+    }
+
     // Set default values for AllVsAll with full content comparison
     // to improve performance when the user hasn't provided custom settings.
     if (config.operationMode == AntSeek::Config::OperationMode::AllVsAll &&
@@ -242,6 +548,8 @@ int main(int argc, char* argv[]) {
         thrCfg.fileCollectorCount = std::max(1, availableThreads / 3);
         thrCfg.hashCalculatorCount = std::max(1, availableThreads / 3);
         thrCfg.comparerCount = std::max(1, availableThreads / 3);
+        thrCfg.segmentWorkerCount = std::max(1, availableThreads);
+        thrCfg.mapThreshold = mapThreshold;
 
         AntSeek as(config);
         as.start(thrCfg);
@@ -250,6 +558,10 @@ int main(int argc, char* argv[]) {
 
         as.waitForFinish();
         as.printResults();
+
+        if (config.watch) {
+            as.watchForChanges();
+        }
     }
     catch (const std::runtime_error& e) {
         std::cout << "Error: " << e.what() << "\n";